@@ -143,6 +143,9 @@ class AsyncClient {
 
   tcp::socket& socket() { return mSocket; }
 
+  // Bytes written to the socket so far
+  size_t bytesSent = 0;
+
  protected:
   boost::asio::io_service& _io_service;
   tcp::socket mSocket;
@@ -196,6 +199,7 @@ class AsyncClient {
     if (disconnectCalled) return;
 
     if (!ec) {
+      bytesSent += len;
       if (_sent_cb) {
         // TODO send actual time
         _sent_cb(_sent_cb_arg, this, len, 0);
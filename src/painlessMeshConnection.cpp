@@ -70,12 +70,11 @@ void MeshConnection::initTCPCallbacks() {
         if (self->mesh->semaphoreTake()) {
           Log(COMMUNICATION, "onData(): fromId=%u\n", self ? self->nodeId : 0);
 
-          self->receiveBuffer.push(static_cast<const char *>(data), len,
-                                   shared_buffer);
+          self->receiveBuffer.push(static_cast<const char *>(data), len);
 
           // Signal that we are done
           self->client->ack(len);
-          self->readBufferTask.forceNextIteration();
+          self->mesh->queueIO(self);
 
           self->mesh->semaphoreGive();
         }
@@ -87,7 +86,8 @@ void MeshConnection::initTCPCallbacks() {
                                         size_t len, uint32_t time) {
         using namespace logger;
         if (self->mesh->semaphoreTake()) {
-          self->sentBufferTask.forceNextIteration();
+          self->writeBlocked = false;
+          self->mesh->queueIO(self);
           self->mesh->semaphoreGive();
         }
       },
@@ -111,56 +111,81 @@ void MeshConnection::initTCPCallbacks() {
 void MeshConnection::initTasks() {
   using namespace logger;
 
-  timeOutTask.set(NODE_TIMEOUT, TASK_ONCE, [self = this->shared_from_this()]() {
+  // All timers are run by a single mesh task, see Mesh::handleTimers()
+  timeOutTimer.attach(mesh->timerTask.get());
+  nodeSyncTimer.attach(mesh->timerTask.get());
+  timeSyncTimer.attach(mesh->timerTask.get());
+
+  timeOutTimer.set(NODE_TIMEOUT, TASK_ONCE, [self = this->shared_from_this()]() {
     Log(CONNECTION, "Time out reached\n");
     self->close();
   });
-  mesh->mScheduler->addTask(timeOutTask);
 
-  this->nodeSyncTask.set(
+  this->nodeSyncTimer.set(
       TASK_MINUTE, TASK_FOREVER, [self = this->shared_from_this()]() {
         Log(SYNC, "nodeSyncTask(): request with %u\n", self->nodeId);
-        router::send<protocol::NodeSyncRequest, MeshConnection>(
-            self->request(self->mesh->asNodeTree()), self);
-        self->timeOutTask.disable();
-        self->timeOutTask.restartDelayed();
+        router::sendNodeSync<painlessMesh, MeshConnection>(
+            (*self->mesh), self, protocol::NODE_SYNC_REQUEST);
+        self->timeOutTimer.disable();
+        self->timeOutTimer.restartDelayed();
       });
-  mesh->mScheduler->addTask(this->nodeSyncTask);
   if (station)
-    this->nodeSyncTask.enable();
+    this->nodeSyncTimer.enable();
   else
-    this->nodeSyncTask.enableDelayed(10 * TASK_SECOND);
+    this->nodeSyncTimer.enableDelayed(10 * TASK_SECOND);
 
   receiveBuffer = painlessmesh::buffer::ReceiveBuffer<TSTRING>();
-  readBufferTask.set(
-      TASK_SECOND, TASK_FOREVER, [self = this->shared_from_this()]() {
-        Log(GENERAL, "readBufferTask()\n");
-        if (!self->receiveBuffer.empty()) {
-          TSTRING frnt = self->receiveBuffer.front();
-          self->receiveBuffer.pop_front();
-          if (!self->receiveBuffer.empty())
-            self->readBufferTask.forceNextIteration();
-          router::routePackage<MeshConnection>(
-              (*self->mesh), self->shared_from_this(), frnt,
-              self->mesh->callbackList, self->mesh->getNodeTime());
-        }
-      });
-  mesh->mScheduler->addTask(readBufferTask);
-  readBufferTask.enableDelayed();
-
-  sentBufferTask.set(
-      TASK_SECOND, TASK_FOREVER, [self = this->shared_from_this()]() {
-        Log(GENERAL, "sentBufferTask()\n");
-        if (!self->sentBuffer.empty() && self->client->canSend()) {
-          auto ret = self->writeNext();
-          if (ret)
-            self->sentBufferTask.forceNextIteration();
-          else
-            self->sentBufferTask.delay(100 * TASK_MILLISECOND);
-        }
-      });
-  mesh->mScheduler->addTask(sentBufferTask);
-  sentBufferTask.enableDelayed();
+}
+
+uint32_t ICACHE_FLASH_ATTR MeshConnection::handleTimers(uint32_t now) {
+  // A callback can close the connection, which clears the timers
+  timeOutTimer.run(now);
+  nodeSyncTimer.run(now);
+  timeSyncTimer.run(now);
+  uint32_t next = TASK_HOUR;
+  if (timeOutTimer.isEnabled())
+    next = std::min(next, timeOutTimer.remaining(now));
+  if (nodeSyncTimer.isEnabled())
+    next = std::min(next, nodeSyncTimer.remaining(now));
+  if (timeSyncTimer.isEnabled())
+    next = std::min(next, timeSyncTimer.remaining(now));
+  return next;
+}
+
+size_t ICACHE_FLASH_ATTR MeshConnection::handleIO() {
+  using namespace logger;
+  size_t handled = 0;
+  if (canWrite()) {
+    writeBlocked = !writeNext();
+    if (writeBlocked) {
+      writeBlockedAt = millis();
+      // Nothing queues us again if no ack arrives
+      mesh->retryIO(PAINLESSMESH_WRITE_RETRY);
+    } else {
+      ++handled;
+    }
+  }
+  if (!receiveBuffer.empty()) {
+    // The only copy of the message, the view does not outlive the callbacks
+    TSTRING frnt = receiveBuffer.front().data;
+    receiveBuffer.pop_front();
+    ++handled;
+    router::routePackage<MeshConnection>((*mesh), shared_from_this(), frnt,
+                                         mesh->callbackList,
+                                         mesh->getNodeTime());
+  }
+  return handled;
+}
+
+bool ICACHE_FLASH_ATTR MeshConnection::pendingIO() {
+  return connected && (!receiveBuffer.empty() || canWrite());
+}
+
+bool ICACHE_FLASH_ATTR MeshConnection::canWrite() {
+  // After a failed write wait for an ack, or retry after a while
+  if (writeBlocked && millis() - writeBlockedAt < PAINLESSMESH_WRITE_RETRY)
+    return false;
+  return !sentBuffer.empty() && client->canSend();
 }
 
 void ICACHE_FLASH_ATTR MeshConnection::close() {
@@ -169,16 +194,9 @@ void ICACHE_FLASH_ATTR MeshConnection::close() {
   Log(CONNECTION, "MeshConnection::close() %u.\n", this->nodeId);
   this->connected = false;
 
-  this->timeSyncTask.setCallback(NULL);
-  this->nodeSyncTask.setCallback(NULL);
-  this->readBufferTask.setCallback(NULL);
-  this->sentBufferTask.setCallback(NULL);
-  this->timeOutTask.setCallback(NULL);
-  this->timeSyncTask.disable();
-  this->nodeSyncTask.disable();
-  this->readBufferTask.disable();
-  this->sentBufferTask.disable();
-  this->timeOutTask.disable();
+  this->timeSyncTimer.clear();
+  this->nodeSyncTimer.clear();
+  this->timeOutTimer.clear();
 
   this->client->onDisconnect(NULL, NULL);
   this->client->onError(NULL, NULL);
@@ -200,14 +218,26 @@ void ICACHE_FLASH_ATTR MeshConnection::close() {
 
   receiveBuffer.clear();
   sentBuffer.clear();
-  NodeTree::clear();
+  Neighbour::clear();
   Log(CONNECTION, "MeshConnection::close() done. Was station: %d.\n",
       this->station);
 }
 
-bool ICACHE_FLASH_ATTR MeshConnection::addMessage(TSTRING &message,
+bool ICACHE_FLASH_ATTR MeshConnection::addMessage(const TSTRING &message,
                                                   bool priority) {
-  if (ESP.getFreeHeap() - message.length() >=
+  return queueMessage<const TSTRING &>(message, message.length(), priority);
+}
+
+bool ICACHE_FLASH_ATTR MeshConnection::addMessage(
+    std::shared_ptr<const TSTRING> message, bool priority) {
+  // The payload is allocated already, queueing it costs (almost) nothing
+  return queueMessage(std::move(message), 0, priority);
+}
+
+template <class M>
+bool ICACHE_FLASH_ATTR MeshConnection::queueMessage(M message, size_t cost,
+                                                    bool priority) {
+  if (ESP.getFreeHeap() - cost >=
       MIN_FREE_MEMORY) {  // If memory heap is enough, queue the message
     if (priority) {
       sentBuffer.push(message, priority);
@@ -225,17 +255,17 @@ bool ICACHE_FLASH_ATTR MeshConnection::addMessage(TSTRING &message,
       } else {
         Log(ERROR, "addMessage(): Message queue full -> %d , FreeMem: %d\n",
             sentBuffer.size(), ESP.getFreeHeap());
-        sentBufferTask.forceNextIteration();
+        mesh->queueIO(shared_from_this());
         return false;
       }
     }
-    sentBufferTask.forceNextIteration();
+    mesh->queueIO(shared_from_this());
     return true;
   } else {
     // connection->sendQueue.clear(); // Discard all messages if free memory is
     // low
     Log(DEBUG, "addMessage(): Memory low, message was discarded\n");
-    sentBufferTask.forceNextIteration();
+    mesh->queueIO(shared_from_this());
     return false;
   }
 }
@@ -249,15 +279,16 @@ bool ICACHE_FLASH_ATTR MeshConnection::writeNext() {
   auto snd_len = client->space();
   if (len > snd_len) len = snd_len;
   if (len > 0) {
-    // sentBuffer.read(len, shared_buffer);
-    // auto written = client->write(shared_buffer.buffer, len, 1);
-    auto data_ptr = sentBuffer.readPtr(len);
-    auto written = client->write(data_ptr, len, 1);
-    if (written == len) {
+    // Data that wraps around the end of the buffer is written in two parts
+    painlessmesh::buffer::span_t first, second;
+    sentBuffer.readPtr(len, first, second);
+    auto written = client->write(first.data, first.length, 1);
+    if (written == first.length && second.length > 0)
+      written += client->write(second.data, second.length, 1);
+    if (written >= first.length) {
       Log(COMMUNICATION, "writeNext(): Package sent\n");
       client->send();  // TODO only do this for priority messages
-      sentBuffer.freeRead();
-      sentBufferTask.forceNextIteration();
+      sentBuffer.freeRead(written);
       return true;
     } else if (written == 0) {
       Log(COMMUNICATION,
@@ -15,6 +15,7 @@
 #include "painlessmesh/configuration.hpp"
 #include "painlessmesh/layout.hpp"
 #include "painlessmesh/mesh.hpp"
+#include "painlessmesh/timer.hpp"
 
 #ifndef PAINLESSMESH_ENABLE_ARDUINO_WIFI
 class MeshConnection;
@@ -35,16 +36,47 @@ class MeshConnection : public painlessmesh::layout::Neighbour,
   // for timeout
   uint32_t timeDelayLastRequested = 0;
 
-  bool addMessage(TSTRING &message, bool priority = false);
+  bool addMessage(const TSTRING &message, bool priority = false);
+  /**
+   * Queue a message that is shared with other connections, without copying it
+   */
+  bool addMessage(std::shared_ptr<const TSTRING> message,
+                  bool priority = false);
   bool writeNext();
+
+  /**
+   * Handle the next received message and write the next part of the sent
+   * buffer
+   *
+   * Called by Mesh::handleIO()
+   *
+   * @return The number of messages handled or written
+   */
+  size_t handleIO();
+
+  /**
+   * Whether there are received messages or sendable messages waiting
+   */
+  bool pendingIO();
+  bool ioQueued = false;
+
   painlessmesh::buffer::ReceiveBuffer<TSTRING> receiveBuffer;
   painlessmesh::buffer::SentBuffer<TSTRING> sentBuffer;
 
-  Task nodeSyncTask;
-  Task timeSyncTask;
-  Task readBufferTask;
-  Task sentBufferTask;
-  Task timeOutTask;
+  painlessmesh::timer::Timer nodeSyncTimer;
+  painlessmesh::timer::Timer timeSyncTimer;
+  painlessmesh::timer::Timer timeOutTimer;
+
+  painlessmesh::ntp::ClockFilter clockFilter;
+
+  /**
+   * Run the timers that are due
+   *
+   * Called by Mesh::handleTimers()
+   *
+   * @return The time until the next timer is due
+   */
+  uint32_t handleTimers(uint32_t now);
 
   MeshConnection(AsyncClient *client, painlessmesh::Mesh<MeshConnection> *pMesh,
                  bool station);
@@ -58,5 +90,15 @@ class MeshConnection : public painlessmesh::layout::Neighbour,
   void close();
 
   friend painlessmesh::Mesh<MeshConnection>;
+
+ private:
+  // Whether the last write failed and when
+  bool writeBlocked = false;
+  uint32_t writeBlockedAt = 0;
+
+  bool canWrite();
+
+  template <class M>
+  bool queueMessage(M message, size_t cost, bool priority);
 };
 #endif
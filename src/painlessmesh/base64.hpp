@@ -1,68 +1,46 @@
 #ifndef _PAINLESS_MESH_BASE64_HPP_
 #define _PAINLESS_MESH_BASE64_HPP_
 
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
 #include <string>
 
 #include "painlessmesh/configuration.hpp"
 
+// Host builds encode and decode 12/16 bytes at a time with the vector unit.
+// SSSE3 is checked at runtime, so no special compiler flags are needed. The
+// NEON code has not been built and tested on AArch64 yet, so it is only used
+// when PAINLESSMESH_ENABLE_BASE64_NEON is defined.
+#if !defined(ESP32) && !defined(ESP8266)
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PAINLESSMESH_BASE64_SSSE3
+#include <tmmintrin.h>
+#elif defined(__aarch64__) && defined(PAINLESSMESH_ENABLE_BASE64_NEON)
+#define PAINLESSMESH_BASE64_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
 namespace painlessmesh {
-  namespace base64 {
+namespace base64 {
 
 static inline bool is_base64(unsigned char c) {
-    return (isalnum(c) || (c == '+') || (c == '/'));
+  return (isalnum(c) || (c == '+') || (c == '/'));
 }
 
-static const TSTRING chars =
+static const char alphabet[] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
     "abcdefghijklmnopqrstuvwxyz"
     "0123456789+/";
 
-inline TSTRING encode(unsigned char const* bytes_to_encode,
-                          unsigned int in_len) {
-    TSTRING ret;
-    int i = 0;
-    int j = 0;
-    unsigned char char_array_3[3];
-    unsigned char char_array_4[4];
-
-    while (in_len--) {
-        char_array_3[i++] = *(bytes_to_encode++);
-        if (i == 3) {
-            char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-            char_array_4[1] = ((char_array_3[0] & 0x03) << 4) +
-                              ((char_array_3[1] & 0xf0) >> 4);
-            char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) +
-                              ((char_array_3[2] & 0xc0) >> 6);
-            char_array_4[3] = char_array_3[2] & 0x3f;
-
-            for (i = 0; (i < 4); i++) ret += chars[char_array_4[i]];
-            i = 0;
-        }
-    }
-
-    if (i) {
-        for (j = i; j < 3; j++) char_array_3[j] = '\0';
-
-        char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-        char_array_4[1] =
-            ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-        char_array_4[2] =
-            ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-        char_array_4[3] = char_array_3[2] & 0x3f;
-        for (j = 0; (j < i + 1); j++) ret += chars[char_array_4[j]];
-        while ((i++ < 3)) ret += '=';
-    }
-
-    return ret;
-}
+static const TSTRING chars = alphabet;
 
-inline TSTRING encode(const TSTRING& str64)
-{
-    return encode((unsigned char*)str64.c_str(), str64.length());
-}
-
-static const int B64index[256] =
-{
+/**
+ * Value of each character, the url safe '-' and '_' are accepted as well.
+ * Anything else decodes as zero.
+ */
+static const uint8_t B64index[256] = {
     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  62, 63, 62, 62, 63,
@@ -70,54 +48,297 @@ static const int B64index[256] =
     0,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14,
     15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 0,  0,  0,  0,  63,
     0,  26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
-    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51
-};
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51};
 
+/**
+ * Number of characters needed to encode the given number of bytes
+ */
+inline size_t encodedLength(size_t length) { return (length + 2) / 3 * 4; }
 
+/**
+ * Length of the encoded data without the '=' padding, if any
+ */
+inline size_t unpaddedLength(const char* data, size_t length) {
+  for (auto pad = 0; pad < 2 && length > 0 && data[length - 1] == '='; ++pad)
+    --length;
+  return length;
+}
 
-inline const TSTRING decode(const void* data, const size_t &len)
-{
-    if (len == 0) return "";
+/**
+ * Number of bytes the encoded data decodes to
+ */
+inline size_t decodedLength(const char* data, size_t length) {
+  length = unpaddedLength(data, length);
+  // The characters after the last block of four hold one byte less than
+  // their number, a single one holds none
+  size_t rest = length % 4;
+  return length / 4 * 3 + (rest > 1 ? rest - 1 : 0);
+}
 
-    unsigned char *p = (unsigned char*) data;
-    size_t j = 0,
-        pad1 = len % 4 || p[len - 1] == '=',
-        pad2 = pad1 && (len % 4 > 2 || p[len - 2] != '=');
-    const size_t last = (len - pad1) / 4 << 2;
-#ifdef PAINLESSMESH_ENABLE_STD_STRING
-    TSTRING result(last / 4 * 3 + pad1 + pad2, '\0');
-#else
-    TSTRING result;
-    result.reserve(last / 4 * 3 + pad1 + pad2);
-    for (size_t i = 0; i < last / 4 * 3 + pad1 + pad2; ++i)
-      result.concat('\0');
+#ifdef PAINLESSMESH_BASE64_SSSE3
+__attribute__((target("ssse3"))) inline size_t encodeSSSE3(
+    const unsigned char* bytes, size_t length, char* out) {
+  // See http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html
+  const __m128i shuffle =
+      _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  const __m128i shiftLUT =
+      _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                    '/' - 63, 'A', 0, 0);
+  size_t i = 0;
+  // Loads 16 bytes, of which 12 are encoded
+  for (; i + 16 <= length; i += 12, out += 16) {
+    auto in = _mm_loadu_si128((const __m128i*)(bytes + i));
+    in = _mm_shuffle_epi8(in, shuffle);
+    auto t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    auto t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    auto t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    auto t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    auto indices = _mm_or_si128(t1, t3);
+    // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+    auto range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    auto less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    range = _mm_or_si128(range, _mm_and_si128(less, _mm_set1_epi8(13)));
+    auto result = _mm_add_epi8(_mm_shuffle_epi8(shiftLUT, range), indices);
+    _mm_storeu_si128((__m128i*)out, result);
+  }
+  return i;
+}
+
+__attribute__((target("ssse3"))) inline size_t decodeSSSE3(
+    const char* data, size_t length, unsigned char* out) {
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16, out += 12) {
+    auto in = _mm_loadu_si128((const __m128i*)(data + i));
+    // Bytes above 127 are negative, so they are in none of the ranges
+    auto upper = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)),
+                               _mm_cmplt_epi8(in, _mm_set1_epi8('Z' + 1)));
+    auto lower = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)),
+                               _mm_cmplt_epi8(in, _mm_set1_epi8('z' + 1)));
+    auto digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+                               _mm_cmplt_epi8(in, _mm_set1_epi8('9' + 1)));
+    auto plus = _mm_cmpeq_epi8(in, _mm_set1_epi8('+'));
+    auto slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+    auto valid = _mm_or_si128(_mm_or_si128(upper, lower),
+                              _mm_or_si128(_mm_or_si128(digit, plus), slash));
+    // Leave anything else to the scalar code
+    if (_mm_movemask_epi8(valid) != 0xFFFF) break;
+    auto shift = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+                     _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+        _mm_or_si128(_mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+                                  _mm_and_si128(plus, _mm_set1_epi8(62 - '+'))),
+                     _mm_and_si128(slash, _mm_set1_epi8(63 - '/'))));
+    auto values = _mm_add_epi8(in, shift);
+    // Join the 6 bit values into 24 bits per 32 bit lane
+    auto merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    merged = _mm_shuffle_epi8(
+        merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1,
+                              -1, -1));
+    uint8_t block[16];
+    _mm_storeu_si128((__m128i*)block, merged);
+    memcpy(out, block, 12);
+  }
+  return i;
+}
+
+inline bool hasSSSE3() {
+  static const bool supported = __builtin_cpu_supports("ssse3");
+  return supported;
+}
 #endif
-    unsigned char *str = (unsigned char*) &result[0];
-
-    for (size_t i = 0; i < last; i += 4)
-    {
-        int n = B64index[p[i]] << 18 | B64index[p[i + 1]] << 12 | B64index[p[i + 2]] << 6 | B64index[p[i + 3]];
-        str[j++] = n >> 16;
-        str[j++] = n >> 8 & 0xFF;
-        str[j++] = n & 0xFF;
+
+#ifdef PAINLESSMESH_BASE64_NEON
+inline size_t encodeNEON(const unsigned char* bytes, size_t length,
+                         char* out) {
+  const uint8x16x4_t table = {
+      {vld1q_u8((const uint8_t*)alphabet), vld1q_u8((const uint8_t*)alphabet + 16),
+       vld1q_u8((const uint8_t*)alphabet + 32),
+       vld1q_u8((const uint8_t*)alphabet + 48)}};
+  const uint8x16_t mask = vdupq_n_u8(0x3f);
+  size_t i = 0;
+  for (; i + 48 <= length; i += 48, out += 64) {
+    auto in = vld3q_u8(bytes + i);
+    uint8x16x4_t result;
+    result.val[0] = vshrq_n_u8(in.val[0], 2);
+    result.val[1] = vandq_u8(
+        vorrq_u8(vshlq_n_u8(in.val[0], 4), vshrq_n_u8(in.val[1], 4)), mask);
+    result.val[2] = vandq_u8(
+        vorrq_u8(vshlq_n_u8(in.val[1], 2), vshrq_n_u8(in.val[2], 6)), mask);
+    result.val[3] = vandq_u8(in.val[2], mask);
+    for (auto k = 0; k < 4; ++k)
+      result.val[k] = vqtbl4q_u8(table, result.val[k]);
+    vst4q_u8((uint8_t*)out, result);
+  }
+  return i;
+}
+
+inline size_t decodeNEON(const char* data, size_t length,
+                         unsigned char* out) {
+  // The value plus one of each character up to 127, zero if it is invalid
+  uint8_t values[128] = {0};
+  for (auto k = 0; k < 64; ++k) values[(uint8_t)alphabet[k]] = k + 1;
+  const uint8x16x4_t low = {{vld1q_u8(values), vld1q_u8(values + 16),
+                             vld1q_u8(values + 32), vld1q_u8(values + 48)}};
+  const uint8x16x4_t high = {{vld1q_u8(values + 64), vld1q_u8(values + 80),
+                              vld1q_u8(values + 96), vld1q_u8(values + 112)}};
+  const uint8x16_t offset = vdupq_n_u8(64);
+  const uint8x16_t one = vdupq_n_u8(1);
+  size_t i = 0;
+  for (; i + 64 <= length; i += 64, out += 48) {
+    auto in = vld4q_u8((const uint8_t*)data + i);
+    uint8x16_t minimum = vdupq_n_u8(0xff);
+    for (auto k = 0; k < 4; ++k) {
+      // Indices out of range of a table give zero
+      auto c = in.val[k];
+      auto v = vorrq_u8(vqtbl4q_u8(low, c), vqtbl4q_u8(high, vsubq_u8(c, offset)));
+      minimum = vminq_u8(minimum, v);
+      in.val[k] = vsubq_u8(v, one);
     }
-    if (pad1)
-    {
-        int n = B64index[p[last]] << 18 | B64index[p[last + 1]] << 12;
-        str[j++] = n >> 16;
-        if (pad2)
-        {
-            n |= B64index[p[last + 2]] << 6;
-            str[j++] = n >> 8 & 0xFF;
-        }
+    // Leave anything else to the scalar code
+    if (vminvq_u8(minimum) == 0) break;
+    uint8x16x3_t result;
+    result.val[0] = vorrq_u8(vshlq_n_u8(in.val[0], 2), vshrq_n_u8(in.val[1], 4));
+    result.val[1] = vorrq_u8(vshlq_n_u8(in.val[1], 4), vshrq_n_u8(in.val[2], 2));
+    result.val[2] = vorrq_u8(vshlq_n_u8(in.val[2], 6), in.val[3]);
+    vst3q_u8(out, result);
+  }
+  return i;
+}
+#endif
+
+/**
+ * Encode the leading bytes with the vector unit, if there is one
+ *
+ * \return Number of bytes encoded, always a multiple of three
+ */
+inline size_t encodeVector(const unsigned char* bytes, size_t length,
+                           char* out) {
+#if defined(PAINLESSMESH_BASE64_SSSE3)
+  if (hasSSSE3()) return encodeSSSE3(bytes, length, out);
+#elif defined(PAINLESSMESH_BASE64_NEON)
+  return encodeNEON(bytes, length, out);
+#endif
+  return 0;
+}
+
+/**
+ * Decode the leading characters with the vector unit, if there is one. Stops
+ * at the first block with characters that are not in the alphabet.
+ *
+ * \return Number of characters decoded, always a multiple of four
+ */
+inline size_t decodeVector(const char* data, size_t length,
+                           unsigned char* out) {
+#if defined(PAINLESSMESH_BASE64_SSSE3)
+  if (hasSSSE3()) return decodeSSSE3(data, length, out);
+#elif defined(PAINLESSMESH_BASE64_NEON)
+  return decodeNEON(data, length, out);
+#endif
+  return 0;
+}
+
+/**
+ * Encode the bytes into a buffer of at least encodedLength(length) characters
+ *
+ * \return Number of characters written
+ */
+inline size_t encode(const unsigned char* bytes, size_t length, char* out) {
+  size_t i = encodeVector(bytes, length, out);
+  char* p = out + i / 3 * 4;
+  for (; i + 3 <= length; i += 3) {
+    uint32_t n = bytes[i] << 16 | bytes[i + 1] << 8 | bytes[i + 2];
+    *p++ = alphabet[n >> 18];
+    *p++ = alphabet[n >> 12 & 0x3f];
+    *p++ = alphabet[n >> 6 & 0x3f];
+    *p++ = alphabet[n & 0x3f];
+  }
+  if (i < length) {
+    uint32_t n = bytes[i] << 16;
+    if (i + 1 < length) n |= bytes[i + 1] << 8;
+    *p++ = alphabet[n >> 18];
+    *p++ = alphabet[n >> 12 & 0x3f];
+    *p++ = (i + 1 < length) ? alphabet[n >> 6 & 0x3f] : '=';
+    *p++ = '=';
+  }
+  return p - out;
+}
+
+/**
+ * Decode the data into a buffer of at least decodedLength(data, length) bytes
+ *
+ * \return Number of bytes written
+ */
+inline size_t decode(const char* data, size_t length, unsigned char* out) {
+  if (length == 0) return 0;
+  auto p = (const unsigned char*)data;
+  length = unpaddedLength(data, length);
+  const size_t last = length / 4 * 4;
+  size_t i = 0;
+  size_t j = 0;
+  while (i < last) {
+    auto done = decodeVector(data + i, last - i, out + j);
+    i += done;
+    j += done / 4 * 3;
+    // The rest, or a block the vector unit could not do
+    auto end = std::min(last, i + 16);
+    for (; i < end; i += 4) {
+      uint32_t n = B64index[p[i]] << 18 | B64index[p[i + 1]] << 12 |
+                   B64index[p[i + 2]] << 6 | B64index[p[i + 3]];
+      out[j++] = n >> 16;
+      out[j++] = n >> 8 & 0xFF;
+      out[j++] = n & 0xFF;
     }
-    return result;
+  }
+  // The data does not have to be padded or terminated, so only read the rest
+  const size_t rest = length - last;
+  if (rest > 1) {
+    uint32_t n = B64index[p[last]] << 18 | B64index[p[last + 1]] << 12;
+    out[j++] = n >> 16;
+    if (rest > 2) {
+      n |= B64index[p[last + 2]] << 6;
+      out[j++] = n >> 8 & 0xFF;
+    }
+  }
+  return j;
 }
 
-inline TSTRING decode(const TSTRING& str64)
-{
-    return decode(str64.c_str(), str64.length());
+/**
+ * A string of the given length to write into
+ */
+inline TSTRING allocate(size_t length) {
+#ifdef PAINLESSMESH_ENABLE_STD_STRING
+  return TSTRING(length, '\0');
+#else
+  TSTRING result;
+  result.reserve(length);
+  for (size_t i = 0; i < length; ++i) result.concat('\0');
+  return result;
+#endif
 }
+
+inline TSTRING encode(unsigned char const* bytes_to_encode,
+                      unsigned int in_len) {
+  auto result = allocate(encodedLength(in_len));
+  if (in_len > 0) encode(bytes_to_encode, in_len, &result[0]);
+  return result;
 }
+
+inline TSTRING encode(const TSTRING& str64) {
+  return encode((unsigned char*)str64.c_str(), str64.length());
+}
+
+inline const TSTRING decode(const void* data, const size_t& len) {
+  if (len == 0) return "";
+  auto result = allocate(decodedLength((const char*)data, len));
+  decode((const char*)data, len, (unsigned char*)&result[0]);
+  return result;
+}
+
+inline TSTRING decode(const TSTRING& str64) {
+  return decode(str64.c_str(), str64.length());
 }
+}  // namespace base64
+}  // namespace painlessmesh
 #endif
@@ -0,0 +1,609 @@
+#ifndef _PAINLESS_MESH_BINARY_HPP_
+#define _PAINLESS_MESH_BINARY_HPP_
+
+#include <cstring>
+
+#include "Arduino.h"
+#include "painlessmesh/configuration.hpp"
+
+namespace painlessmesh {
+
+/**
+ * Compact binary wire format
+ *
+ * Packages are normally send as json. Neighbours that both support the
+ * protocol::BINARY_FORMAT feature use this more compact encoding instead. It
+ * encodes the same json document, but numbers are stored as varints and known
+ * keys are replaced by their index in a dictionary (binary::keys).
+ *
+ * Packages are separated by a '\0' on the wire, so a frame never contains a
+ * zero byte. Each frame starts with binary::MARKER, which is how receivers
+ * tell it apart from a json package (those always start with a '{').
+ *
+ * \code
+ * frame:  MARKER VERSION value
+ * value:  tag payload
+ * object: OBJECT size (key value)*
+ * array:  ARRAY size value*
+ * string: STRING size bytes
+ * key:    varint 2 * (index + 1) | varint 2 * length + 1, bytes
+ * \endcode
+ *
+ * Varints are little endian base 128. Sizes are stored as size + 1, so that
+ * they never contain a zero byte.
+ */
+namespace binary {
+
+static const uint8_t MARKER = 0x02;
+static const uint8_t VERSION = 0x01;
+
+#ifndef PAINLESSMESH_BINARY_MAX_NESTING
+#define PAINLESSMESH_BINARY_MAX_NESTING 255
+#endif
+
+enum Tag {
+  NIL = 0x01,
+  FALSE_VALUE = 0x02,
+  TRUE_VALUE = 0x03,
+  UINT = 0x04,    // varint
+  NINT = 0x05,    // varint of -value
+  DOUBLE = 0x06,  // varint of the byte swapped ieee 754 bits + 1
+  STRING = 0x07,
+  OBJECT = 0x08,
+  ARRAY = 0x09,
+  SMALL_UINT = 0x10  // Tags from SMALL_UINT upwards hold tag - SMALL_UINT
+};
+
+/**
+ * Keys encoded by their index
+ *
+ * The index is part of the wire format, so this list can not be changed
+ * without increasing the VERSION. Other keys are encoded as strings.
+ */
+static const char* const keys[] = {
+    "type",  "dest",   "from",     "msg",   "routing",  "nodeId",
+    "root",  "subs",   "t0",       "t1",    "t2",       "features",
+    "md5",   "hardware", "role",   "forced", "noPart",  "partNo",
+    "data",  "id",     "time",     "stability", "freeMemory"};
+static const size_t noKeys = sizeof(keys) / sizeof(keys[0]);
+
+/**
+ * Whether the package is a binary frame (instead of json)
+ */
+inline bool isFrame(const char* data, size_t length) {
+  return length > 0 && (uint8_t)data[0] == MARKER;
+}
+
+/**
+ * Output that only counts the number of bytes written to it
+ */
+class Counter {
+ public:
+  size_t length = 0;
+
+  Counter& operator+=(char c) {
+    ++length;
+    return *this;
+  }
+};
+
+template <class S>
+void writeVarint(S& out, uint64_t value) {
+  while (value >= 0x80) {
+    out += (char)(0x80 | (value & 0x7F));
+    value >>= 7;
+  }
+  out += (char)value;
+}
+
+template <class S>
+void writeSize(S& out, size_t size) {
+  writeVarint(out, (uint64_t)size + 1);
+}
+
+template <class S>
+void writeBytes(S& out, const char* bytes, size_t length) {
+  for (size_t i = 0; i < length; ++i) out += bytes[i];
+}
+
+template <class S>
+void writeKey(S& out, const char* key) {
+  for (size_t i = 0; i < noKeys; ++i) {
+    if (key[0] == keys[i][0] && strcmp(key, keys[i]) == 0) {
+      writeVarint(out, 2 * (i + 1));
+      return;
+    }
+  }
+  auto length = strlen(key);
+  writeVarint(out, 2 * (uint64_t)length + 1);
+  writeBytes(out, key, length);
+}
+
+template <class S>
+void writeUInt(S& out, uint64_t value) {
+  if (value < 0x100 - SMALL_UINT) {
+    out += (char)(SMALL_UINT + value);
+    return;
+  }
+  out += (char)UINT;
+  writeVarint(out, value);
+}
+
+template <class S>
+void writeValue(S& out, JsonVariant value);
+
+template <class S>
+void writeObject(S& out, JsonObject obj) {
+  out += (char)OBJECT;
+  writeSize(out, obj.size());
+  for (JsonPair kv : obj) {
+    writeKey(out, kv.key().c_str());
+    writeValue(out, kv.value());
+  }
+}
+
+template <class S>
+void writeValue(S& out, JsonVariant value) {
+  if (value.is<JsonObject>()) {
+    writeObject(out, value.as<JsonObject>());
+  } else if (value.is<JsonArray>()) {
+    auto arr = value.as<JsonArray>();
+    out += (char)ARRAY;
+    writeSize(out, arr.size());
+    for (JsonVariant v : arr) writeValue(out, v);
+  } else if (value.is<bool>()) {
+    out += (char)(value.as<bool>() ? TRUE_VALUE : FALSE_VALUE);
+  } else if (value.is<uint64_t>()) {
+    writeUInt(out, value.as<uint64_t>());
+  } else if (value.is<int64_t>()) {
+    out += (char)NINT;
+    writeVarint(out, (uint64_t)(-(value.as<int64_t>() + 1)) + 1);
+  } else if (value.is<double>()) {
+    double d = value.as<double>();
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    // Byte swapping puts the sign and exponent in the low bytes, which keeps
+    // the varint short for round numbers
+    uint64_t swapped = 0;
+    for (size_t i = 0; i < sizeof(bits); ++i) {
+      swapped = (swapped << 8) | (bits & 0xFF);
+      bits >>= 8;
+    }
+    if (swapped == ~(uint64_t)0) {
+      // A NaN that we can not represent, json has no NaN either
+      out += (char)NIL;
+      return;
+    }
+    out += (char)DOUBLE;
+    writeVarint(out, swapped + 1);
+  } else if (value.is<const char*>()) {
+    auto str = value.as<const char*>();
+    auto length = strlen(str);
+    out += (char)STRING;
+    writeSize(out, length);
+    writeBytes(out, str, length);
+  } else {
+    out += (char)NIL;
+  }
+}
+
+/**
+ * Append bytes that may contain zeros, encoded so they do not
+ *
+ * Packages can not contain a zero byte, so raw data (e.g. firmware) has to be
+ * encoded. This uses consistent overhead byte stuffing (COBS), which adds one
+ * byte per 254 bytes, instead of the third that base64 adds. The result can
+ * be stored in a (json) string.
+ */
+template <class S>
+void escape(const char* bytes, size_t length, S& out) {
+  out.reserve(out.length() + length + length / 254 + 1);
+  auto codeAt = out.length();
+  out += (char)1;
+  uint8_t code = 1;
+  for (size_t i = 0; i < length; ++i) {
+    if (bytes[i] != 0) {
+      out += bytes[i];
+      ++code;
+    }
+    if (bytes[i] == 0 || code == 0xFF) {
+      out[codeAt] = (char)code;
+      codeAt = out.length();
+      out += (char)1;
+      code = 1;
+    }
+  }
+  out[codeAt] = (char)code;
+}
+
+/**
+ * Decode bytes encoded by escape() in place
+ *
+ * The decoded bytes are never longer than the encoded ones.
+ *
+ * @return The length of the decoded bytes
+ */
+inline size_t unescape(char* data, size_t length) {
+  size_t in = 0;
+  size_t out = 0;
+  while (in < length) {
+    uint8_t code = data[in++];
+    if (code == 0 || (size_t)(code - 1) > length - in) break;  // Invalid
+    memmove(data + out, data + in, code - 1);
+    in += code - 1;
+    out += code - 1;
+    if (code < 0xFF && in < length) data[out++] = 0;
+  }
+  return out;
+}
+
+/**
+ * Number of bytes needed to encode the json object as a binary frame
+ */
+inline size_t measure(JsonObject obj) {
+  Counter counter;
+  counter += (char)MARKER;
+  counter += (char)VERSION;
+  writeObject(counter, obj);
+  return counter.length;
+}
+
+/**
+ * Append the json object as a binary frame to the string
+ */
+template <class S>
+void write(JsonObject obj, S& out) {
+  out.reserve(out.length() + measure(obj));
+  out += (char)MARKER;
+  out += (char)VERSION;
+  writeObject(out, obj);
+}
+
+/**
+ * Reads the basic elements of a binary frame
+ */
+class Reader {
+ public:
+  Reader(const char* data, size_t length)
+      : it((uint8_t*)data), end((uint8_t*)data + length) {}
+
+  bool readByte(uint8_t& byte) {
+    if (it >= end) return false;
+    byte = *it;
+    ++it;
+    return true;
+  }
+
+  bool readVarint(uint64_t& value) {
+    value = 0;
+    for (uint8_t shift = 0; shift < 64; shift += 7) {
+      if (it >= end) return false;
+      uint8_t byte = *it;
+      ++it;
+      value |= (uint64_t)(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) return true;
+    }
+    return false;
+  }
+
+  /**
+   * Read a size
+   *
+   * Every element takes at least one byte, so a size larger than the
+   * remaining bytes is invalid.
+   */
+  bool readSize(size_t& size) {
+    uint64_t value;
+    if (!readVarint(value) || value == 0) return false;
+    if (value - 1 > (uint64_t)(end - it)) return false;
+    size = value - 1;
+    return true;
+  }
+
+  /**
+   * Read a key
+   *
+   * @param key Set to the dictionary key, or NULL if the key is stored as a
+   * string
+   * @param bytes Set to the start of the key if it is stored as string
+   * @param length The length of the key if it is stored as string
+   */
+  bool readKey(const char*& key, char*& bytes, size_t& length) {
+    uint64_t code;
+    if (!readVarint(code) || code == 0) return false;
+    if (code % 2 == 0) {
+      if (code / 2 > noKeys) return false;
+      key = keys[code / 2 - 1];
+      return true;
+    }
+    key = NULL;
+    if ((code - 1) / 2 > (uint64_t)(end - it)) return false;
+    length = (code - 1) / 2;
+    bytes = (char*)it;
+    it += length;
+    return true;
+  }
+
+  /**
+   * Read an integer value (including its tag)
+   */
+  bool readInteger(int64_t& value) {
+    uint8_t tag;
+    if (!readByte(tag)) return false;
+    if (tag >= SMALL_UINT) {
+      value = tag - SMALL_UINT;
+      return true;
+    }
+    uint64_t v;
+    if (tag == UINT && readVarint(v)) {
+      value = (int64_t)v;
+      return true;
+    }
+    if (tag == NINT && readVarint(v) && v > 0) {
+      value = -(int64_t)(v - 1) - 1;
+      return true;
+    }
+    return false;
+  }
+
+  /**
+   * Skip a value (including its tag)
+   *
+   * @param capacity Increased by the memory needed to store the value in a
+   * json document
+   */
+  bool skipValue(size_t& capacity, size_t depth) {
+    uint8_t tag;
+    if (!readByte(tag)) return false;
+    if (tag >= SMALL_UINT) return true;
+    uint64_t v;
+    size_t size;
+    switch (tag) {
+      case NIL:
+      case FALSE_VALUE:
+      case TRUE_VALUE:
+        return true;
+      case UINT:
+      case NINT:
+      case DOUBLE:
+        return readVarint(v);
+      case STRING:
+        if (!readSize(size)) return false;
+        it += size;
+        capacity += size + 1;
+        return true;
+      case OBJECT:
+        if (depth >= PAINLESSMESH_BINARY_MAX_NESTING || !readSize(size))
+          return false;
+        for (size_t i = 0; i < size; ++i) {
+          const char* key;
+          char* bytes;
+          size_t length;
+          if (!readKey(key, bytes, length)) return false;
+          if (key == NULL) capacity += length + 1;
+          capacity += JSON_OBJECT_SIZE(1);
+          if (!skipValue(capacity, depth + 1)) return false;
+        }
+        return true;
+      case ARRAY:
+        if (depth >= PAINLESSMESH_BINARY_MAX_NESTING || !readSize(size))
+          return false;
+        for (size_t i = 0; i < size; ++i) {
+          capacity += JSON_ARRAY_SIZE(1);
+          if (!skipValue(capacity, depth + 1)) return false;
+        }
+        return true;
+    }
+    return false;
+  }
+
+  uint8_t* it;
+  uint8_t* end;
+};
+
+/**
+ * Read the frame header
+ *
+ * @return Whether the frame starts with a valid marker and version
+ */
+inline bool readHeader(Reader& reader) {
+  uint8_t byte;
+  if (!reader.readByte(byte) || byte != MARKER) return false;
+  if (!reader.readByte(byte) || byte != VERSION) return false;
+  return true;
+}
+
+/**
+ * Memory needed to store the frame in a json document
+ *
+ * This is exact, so it can be used as the capacity of the document.
+ *
+ * @return The capacity, or 0 if the frame is invalid
+ */
+inline size_t capacity(const char* data, size_t length) {
+  Reader reader(data, length);
+  size_t capacity = 0;
+  if (!readHeader(reader) || !reader.skipValue(capacity, 0)) return 0;
+  return capacity;
+}
+
+/**
+ * Adds values to a json object under the given key
+ */
+template <class K>
+class MemberSlot {
+ public:
+  MemberSlot(JsonObject obj, K key) : obj(obj), key(key) {}
+
+  JsonObject createObject() { return obj.createNestedObject(key); }
+  JsonArray createArray() { return obj.createNestedArray(key); }
+
+  template <class V>
+  bool set(V value) {
+    return obj[key].set(value);
+  }
+
+ protected:
+  JsonObject obj;
+  K key;
+};
+
+/**
+ * Adds values to the end of a json array
+ */
+class ElementSlot {
+ public:
+  ElementSlot(JsonArray arr) : arr(arr) {}
+
+  JsonObject createObject() { return arr.createNestedObject(); }
+  JsonArray createArray() { return arr.createNestedArray(); }
+
+  template <class V>
+  bool set(V value) {
+    return arr.add(value);
+  }
+
+ protected:
+  JsonArray arr;
+};
+
+inline DeserializationError::Code readMembers(Reader& reader, JsonObject obj,
+                                              size_t depth);
+inline DeserializationError::Code readElements(Reader& reader, JsonArray arr,
+                                               size_t depth);
+
+template <class Slot>
+DeserializationError::Code readValue(Reader& reader, Slot&& slot,
+                                     size_t depth) {
+  uint8_t tag;
+  if (!reader.readByte(tag)) return DeserializationError::InvalidInput;
+  if (tag >= SMALL_UINT) {
+    if (!slot.set((uint64_t)(tag - SMALL_UINT)))
+      return DeserializationError::NoMemory;
+    return DeserializationError::Ok;
+  }
+  uint64_t v;
+  size_t size;
+  bool ok = true;
+  switch (tag) {
+    case NIL:
+      slot.set((const char*)NULL);
+      return DeserializationError::Ok;
+    case FALSE_VALUE:
+    case TRUE_VALUE:
+      ok = slot.set(tag == TRUE_VALUE);
+      break;
+    case UINT:
+      if (!reader.readVarint(v)) return DeserializationError::InvalidInput;
+      ok = slot.set(v);
+      break;
+    case NINT:
+      if (!reader.readVarint(v) || v == 0)
+        return DeserializationError::InvalidInput;
+      ok = slot.set(-(int64_t)(v - 1) - 1);
+      break;
+    case DOUBLE: {
+      if (!reader.readVarint(v) || v == 0)
+        return DeserializationError::InvalidInput;
+      --v;
+      uint64_t bits = 0;
+      for (size_t i = 0; i < sizeof(bits); ++i) {
+        bits = (bits << 8) | (v & 0xFF);
+        v >>= 8;
+      }
+      double d;
+      memcpy(&d, &bits, sizeof(d));
+      ok = slot.set(d);
+      break;
+    }
+    case STRING: {
+      if (!reader.readSize(size)) return DeserializationError::InvalidInput;
+      // Temporarily zero terminate the string, so it can be copied into the
+      // document. The last string in the frame is terminated by the frame
+      auto str = (char*)reader.it;
+      reader.it += size;
+      char next = 0;
+      if (reader.it < reader.end) {
+        next = *reader.it;
+        *reader.it = 0;
+      }
+      ok = slot.set(str);
+      if (reader.it < reader.end) *reader.it = next;
+      break;
+    }
+    case OBJECT: {
+      if (depth >= PAINLESSMESH_BINARY_MAX_NESTING)
+        return DeserializationError::TooDeep;
+      auto obj = slot.createObject();
+      if (obj.isNull()) return DeserializationError::NoMemory;
+      return readMembers(reader, obj, depth + 1);
+    }
+    case ARRAY: {
+      if (depth >= PAINLESSMESH_BINARY_MAX_NESTING)
+        return DeserializationError::TooDeep;
+      auto arr = slot.createArray();
+      if (arr.isNull()) return DeserializationError::NoMemory;
+      return readElements(reader, arr, depth + 1);
+    }
+    default:
+      return DeserializationError::InvalidInput;
+  }
+  if (!ok) return DeserializationError::NoMemory;
+  return DeserializationError::Ok;
+}
+
+inline DeserializationError::Code readMembers(Reader& reader, JsonObject obj,
+                                              size_t depth) {
+  size_t size;
+  if (!reader.readSize(size)) return DeserializationError::InvalidInput;
+  for (size_t i = 0; i < size; ++i) {
+    const char* key;
+    char* bytes;
+    size_t length;
+    if (!reader.readKey(key, bytes, length))
+      return DeserializationError::InvalidInput;
+    DeserializationError::Code err;
+    if (key != NULL) {
+      err = readValue(reader, MemberSlot<const char*>(obj, key), depth);
+    } else {
+      TSTRING str;
+      str.reserve(length);
+      writeBytes(str, bytes, length);
+      err = readValue(reader, MemberSlot<TSTRING>(obj, str), depth);
+    }
+    if (err != DeserializationError::Ok) return err;
+  }
+  return DeserializationError::Ok;
+}
+
+inline DeserializationError::Code readElements(Reader& reader, JsonArray arr,
+                                               size_t depth) {
+  size_t size;
+  if (!reader.readSize(size)) return DeserializationError::InvalidInput;
+  for (size_t i = 0; i < size; ++i) {
+    auto err = readValue(reader, ElementSlot(arr), depth);
+    if (err != DeserializationError::Ok) return err;
+  }
+  return DeserializationError::Ok;
+}
+
+/**
+ * Read a binary frame into a json object
+ *
+ * @param data The frame. Must be zero terminated and is modified during
+ * reading, but restored afterwards
+ * @param length Length of the frame
+ * @param obj The object to add the values to. Its document should have at
+ * least binary::capacity() free memory.
+ */
+inline DeserializationError read(char* data, size_t length, JsonObject obj) {
+  Reader reader(data, length);
+  if (!readHeader(reader)) return DeserializationError::NotSupported;
+  uint8_t tag;
+  if (!reader.readByte(tag) || tag != OBJECT)
+    return DeserializationError::InvalidInput;
+  return readMembers(reader, obj, 1);
+}
+}  // namespace binary
+}  // namespace painlessmesh
+#endif
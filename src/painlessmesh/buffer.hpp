@@ -1,7 +1,9 @@
 #ifndef _PAINLESS_MESH_BUFFER_HPP_
 #define _PAINLESS_MESH_BUFFER_HPP_
 
-#include <list>
+#include <algorithm>
+#include <memory>
+#include <vector>
 
 #include "Arduino.h"
 #include "painlessmesh/configuration.hpp"
@@ -10,100 +12,212 @@
 #define TCP_MSS 1024
 #endif
 
+#ifndef RECEIVE_BUFFER_CAPACITY
+#define RECEIVE_BUFFER_CAPACITY 2048
+#endif
+
+#ifndef SENT_BUFFER_CAPACITY
+#define SENT_BUFFER_CAPACITY 2048
+#endif
+
 namespace painlessmesh {
 namespace buffer {
 
-// Temporary buffer used by ReceiveBuffer and SentBuffer
+// Temporary buffer used by SentBuffer
 struct temp_buffer_t {
   size_t length = TCP_MSS;
   char buffer[TCP_MSS];
 };
 
 /**
- * \brief ReceivedBuffer handles cstrings and stores them as strings
+ * \brief Double ended queue stored in a single (growing) array
+ *
+ * Only allocates when it grows beyond its current capacity, so a queue that
+ * is reused does not allocate at all.
+ */
+template <class V>
+class ring_queue_t {
+ public:
+  bool empty() const { return count == 0; }
+
+  size_t size() const { return count; }
+
+  V &front() { return values[first]; }
+
+  void push_back(V value) {
+    grow(count + 1);
+    values[(first + count) % values.size()] = value;
+    ++count;
+  }
+
+  void push_front(V value) {
+    grow(count + 1);
+    first = (first + values.size() - 1) % values.size();
+    values[first] = value;
+    ++count;
+  }
+
+  V &operator[](size_t i) { return values[(first + i) % values.size()]; }
+
+  void pop_front() {
+    // Release anything the value holds on to
+    values[first] = V();
+    first = (first + 1) % values.size();
+    --count;
+  }
+
+  void clear() {
+    while (!empty()) pop_front();
+    first = 0;
+  }
+
+ private:
+  std::vector<V> values;
+  size_t first = 0;
+  size_t count = 0;
+
+  void grow(size_t capacity) {
+    if (capacity <= values.size()) return;
+    std::vector<V> newValues(std::max(capacity, 2 * values.size()));
+    for (size_t i = 0; i < count; ++i)
+      newValues[i] = values[(first + i) % values.size()];
+    values.swap(newValues);
+    first = 0;
+  }
+};
+
+/**
+ * \brief A contiguous region of memory
+ */
+struct span_t {
+  const char *data = NULL;
+  size_t length = 0;
+};
+
+/**
+ * \brief ReceiveBuffer splits the received data into messages
+ *
+ * Received data is appended to a single buffer and split on the '\0'
+ * separators in place, so every byte is only copied once. Messages are
+ * handed out as views into that buffer, which stay valid until pop_front()
+ * or the next push(). The space is reused once all messages are consumed.
  */
 template <class T>
 class ReceiveBuffer {
  public:
-  ReceiveBuffer() { buffer = T(); }
+  ReceiveBuffer() {}
 
   /**
    * Push a message into the buffer
    */
-  void push(const char *cstr, size_t length, temp_buffer_t &buf) {
-    auto data_ptr = cstr;
-    do {
-      auto len = strnlen(data_ptr, length);
-      do {
-        auto read_len = std::min(len, buf.length);
-        memcpy(buf.buffer, data_ptr, read_len);
-        buf.buffer[read_len] = '\0';
-        auto newBuffer = T(buf.buffer);
-        stringAppend(buffer, newBuffer);
-        len -= newBuffer.length();
-        length -= newBuffer.length();
-        data_ptr += newBuffer.length() * sizeof(char);
-      } while (len > 0);
-      if (length > 0) {
-        // Skip/remove the '\0' between the messages
-        length -= 1;
-        data_ptr += 1 * sizeof(char);
-        if (buffer.length() > 0) {  // skip empty buffers
-          jsonStrings.push_back(buffer);
-          buffer = T();
-        }
+  void push(const char *cstr, size_t length) {
+    if (messages.empty() && partial > 0) {
+      // Only an incomplete message left, move it to the start
+      memmove(data.data(), data.data() + partial, end - partial);
+      end -= partial;
+      partial = 0;
+    }
+    grow(end + length);
+    memcpy(data.data() + end, cstr, length);
+
+    auto it = data.data() + end;
+    auto last = it + length;
+    end += length;
+    while (it < last) {
+      auto sep = (char *)memchr(it, '\0', last - it);
+      if (sep == NULL) break;
+      auto offset = (size_t)(sep - data.data());
+      if (offset > partial) {  // skip empty messages
+        message_t msg;
+        msg.offset = partial;
+        msg.length = offset - partial;
+        messages.push_back(msg);
       }
-    } while (length > 0);
+      partial = offset + 1;
+      it = sep + 1;
+    }
   }
 
   /**
    * Get the oldest message from the buffer
+   *
+   * The message is zero terminated.
    */
-  T front() {
-    if (!empty()) return (*jsonStrings.begin());
-    return T();
+  span_t front() {
+    span_t view;
+    if (!empty()) {
+      view.data = data.data() + messages.front().offset;
+      view.length = messages.front().length;
+    }
+    return view;
   }
 
   /**
    * Remove the oldest message from the buffer
    */
-  void pop_front() { jsonStrings.pop_front(); }
+  void pop_front() {
+    if (empty()) return;
+    messages.pop_front();
+    if (messages.empty() && partial == end) {
+      end = 0;
+      partial = 0;
+      // Release memory needed for exceptionally large messages
+      if (data.size() > RECEIVE_BUFFER_CAPACITY) {
+        std::vector<char> newData(RECEIVE_BUFFER_CAPACITY);
+        data.swap(newData);
+      }
+    }
+  }
 
   /**
    * Is the buffer empty
    */
-  bool empty() { return jsonStrings.empty(); }
+  bool empty() { return messages.empty(); }
 
   /**
    * Clear the buffer
    */
   void clear() {
-    jsonStrings.clear();
-    buffer = T();
+    messages.clear();
+    end = 0;
+    partial = 0;
   }
 
  private:
-  T buffer;
-  std::list<T> jsonStrings;
+  struct message_t {
+    size_t offset;
+    size_t length;
+  };
 
-  /**
-   * Helper function to deal with difference Arduino String
-   * and std::string
-   */
-  inline void stringAppend(T &buffer, T &newBuffer) { buffer.concat(newBuffer); };
-};
+  std::vector<char> data;
+  // End of the received data
+  size_t end = 0;
+  // Start of the message that is not complete yet
+  size_t partial = 0;
+  ring_queue_t<message_t> messages;
 
-#ifdef PAINLESSMESH_ENABLE_STD_STRING
-template <>
-inline void ReceiveBuffer<std::string>::stringAppend(std::string &buffer,
-                                              std::string &newBuffer) {
-  buffer.append(newBuffer);
-}
-#endif
+  void grow(size_t capacity) {
+    if (capacity <= data.size()) return;
+    auto newSize = std::max((size_t)RECEIVE_BUFFER_CAPACITY, data.size());
+    while (newSize < capacity) newSize *= 2;
+    data.resize(newSize);
+  }
+};
 
 /**
  * \brief SentBuffer stores messages (strings) and allows them to be read in any
  * length
+ *
+ * Messages are copied into a single ring buffer, each followed by its '\0'
+ * separator. The buffer starts with SENT_BUFFER_CAPACITY bytes and only grows
+ * when a message does not fit anymore, so normally pushing and reading
+ * messages does not allocate any memory. Once a grown buffer is empty again it
+ * shrinks back to SENT_BUFFER_CAPACITY.
+ *
+ * Messages that are sent to multiple connections (i.e. broadcasts) can be
+ * pushed as a shared payload instead. Those are not copied, the buffer only
+ * keeps track of how much of the payload has been read. The payload is freed
+ * once all buffers holding it have sent it.
  */
 template <class T>
 class SentBuffer {
@@ -117,14 +231,50 @@ class SentBuffer {
    *
    * High priority messages will be sent to the front of the buffer
    */
-  void push(T message, bool priority = false) {
-    if (priority) {
-      if (clean)
-        jsonStrings.push_front(message);
-      else
-        jsonStrings.insert((++jsonStrings.begin()), message);
-    } else
-      jsonStrings.push_back(message);
+  void push(const T& message, bool priority = false) {
+    segment_t segment;
+    segment.length = message.length() + 1;  // Including the '\0' separator
+    auto length = segment.length;
+    grow(used + length);
+    if (!priority || segments.empty()) {
+      copyIn((head + used) % data.size(), message.c_str(), length);
+      segments.push_back(segment);
+    } else if (clean || segments.front().payload) {
+      // The ring buffer only holds copied messages, so this message comes
+      // first in the ring buffer, even if it is queued behind a shared one
+      head = (head + data.size() - length) % data.size();
+      copyIn(head, message.c_str(), length);
+      pushFront(segment);
+    } else {
+      // The front message is partly sent already, so it needs to stay in
+      // front. Move its remainder back to make room behind it.
+      auto remainder = segments.front().length;
+      auto newHead = (head + data.size() - length) % data.size();
+      move(newHead, head, remainder);
+      head = newHead;
+      copyIn((head + remainder) % data.size(), message.c_str(), length);
+      pushFront(segment);
+    }
+    used += length;
+    pending += length;
+  }
+
+  /**
+   * push a shared message into the buffer, without copying it
+   *
+   * The payload should not be changed while it is in the buffer.
+   *
+   * \param priority Whether this is a high priority message.
+   */
+  void push(std::shared_ptr<const T> payload, bool priority = false) {
+    segment_t segment;
+    segment.length = payload->length() + 1;  // c_str() is '\0' terminated
+    segment.payload = std::move(payload);
+    pending += segment.length;
+    if (!priority || segments.empty())
+      segments.push_back(segment);
+    else
+      pushFront(segment);
   }
 
   /**
@@ -133,12 +283,11 @@ class SentBuffer {
    * Returns the actual length available (<= the requested length
    */
   size_t requestLength(size_t buffer_length) {
-    if (jsonStrings.empty())
+    if (empty())
       return 0;
     else
-      // String.toCharArray automatically turns the last character into
-      // a \0, we need the extra space to deal with that annoyance
-      return std::min(buffer_length - 1, jsonStrings.begin()->length() + 1);
+      // Leave space for the null termination added by read()
+      return std::min(buffer_length - 1, pending);
   }
 
   /**
@@ -147,29 +296,57 @@ class SentBuffer {
    * Note the user should first make sure the requested length is available
    * using `SentBuffer.requestLength()`, otherwise this function might fail.
    * Note that if multiple messages are read then they are separated using '\0'.
+   *
+   * \return The length read, which can be less than requested when shared
+   * messages are queued (see readPtr())
    */
-  void read(size_t length, temp_buffer_t &buf) {
-    // TODO: I don't think we actually need to copy here, and/or
-    // we should add a non-copy mode, that returns a pointer directly
-    // to the data (using c_str()).
-    //
-    // Note that toCharrArray always null terminates
-    // independent of whether the whole string was read so we use one extra
-    // space
-    jsonStrings.front().toCharArray(buf.buffer, length + 1);
-    last_read_size = length;
+  size_t read(size_t length, temp_buffer_t &buf) {
+    span_t first, second;
+    readPtr(length, first, second);
+    memcpy(buf.buffer, first.data, first.length);
+    memcpy(buf.buffer + first.length, second.data, second.length);
+    buf.buffer[last_read_size] = '\0';
+    return last_read_size;
   }
 
   /**
-   * Returns a pointer directly to the oldest message
+   * Returns pointers directly to the oldest data
+   *
+   * The data is split over two spans when it wraps around the end of the ring
+   * buffer or continues in a shared message, otherwise the second span is
+   * empty. If the data is not contained in two spans, less than the requested
+   * length is returned.
    *
    * Note the user should first make sure the requested length is available
    * using `SentBuffer.requestLength()`, otherwise this function might fail.
    * Note that if multiple messages are read then they are separated using '\0'.
    */
-  const char* readPtr(size_t length) {
-    last_read_size = length;
-    return jsonStrings.front().c_str();
+  void readPtr(size_t length, span_t &first, span_t &second) {
+    span_t spans[2];
+    size_t n = 0;
+    size_t total = 0;
+    auto pos = head;
+    for (size_t i = 0; i < segments.size() && total < length; ++i) {
+      auto &segment = segments[i];
+      auto len = std::min(segment.length, length - total);
+      if (segment.payload) {
+        if (!append(spans, n, segment.payload->c_str() + segment.offset, len))
+          break;
+        total += len;
+        continue;
+      }
+      auto part = std::min(len, data.size() - pos);
+      if (!append(spans, n, data.data() + pos, part)) break;
+      total += part;
+      if (part < len) {
+        if (!append(spans, n, data.data(), len - part)) break;
+        total += len - part;
+      }
+      pos = (pos + len) % data.size();
+    }
+    first = spans[0];
+    second = spans[1];
+    last_read_size = total;
   }
 
   /**
@@ -177,50 +354,147 @@ class SentBuffer {
    *
    * Should be called after a call of read() to clear the buffer.
    */
-  void freeRead() {
-    if (last_read_size == jsonStrings.begin()->length() + 1) {
-      jsonStrings.pop_front();
-      clean = true;
-    } else {
-      // jsonStrings.begin()->remove(0, last_read_size);
-      stringEraseFront((*jsonStrings.begin()), last_read_size);
-      clean = false;
+  void freeRead() { freeRead(last_read_size); }
+
+  /**
+   * Clear the given number of bytes from the buffer.
+   *
+   * Can be used instead of freeRead() if less than the read length was used.
+   */
+  void freeRead(size_t length) {
+    pending -= length;
+    while (length > 0) {
+      auto &segment = segments.front();
+      auto len = std::min(length, segment.length);
+      if (segment.payload) {
+        segment.offset += len;
+      } else {
+        head = (head + len) % data.size();
+        used -= len;
+      }
+      segment.length -= len;
+      length -= len;
+      clean = segment.length == 0;
+      if (clean) segments.pop_front();
     }
     last_read_size = 0;
+    if (used == 0) release();
   }
 
-  bool empty() { return jsonStrings.empty(); }
+  bool empty() { return pending == 0; }
+
+  void clear() {
+    head = 0;
+    used = 0;
+    pending = 0;
+    clean = true;
+    segments.clear();
+    release();
+  }
 
-  void clear() { jsonStrings.clear(); }
+  size_t size() { return segments.size(); }
 
-  size_t size() { return jsonStrings.size(); }
+  /**
+   * Size of the ring buffer
+   */
+  size_t capacity() const { return data.size(); }
 
  private:
+  struct segment_t {
+    // (Remaining) length, including the '\0' separator
+    size_t length = 0;
+    // Shared messages are not copied into the ring buffer
+    std::shared_ptr<const T> payload;
+    size_t offset = 0;
+  };
+
   size_t last_read_size = 0;
   bool clean = true;
-  std::list<T> jsonStrings;
+  std::vector<char> data;
+  size_t head = 0;
+  // Bytes used in the ring buffer
+  size_t used = 0;
+  // Bytes still to be sent, including shared messages
+  size_t pending = 0;
+  ring_queue_t<segment_t> segments;
 
-  inline void stringEraseFront(T &string, size_t length) { string.remove(0, length); };
-};
+  /**
+   * Queue a message directly behind the message that is being sent
+   */
+  void pushFront(const segment_t &segment) {
+    if (clean) {
+      segments.push_front(segment);
+      return;
+    }
+    auto front = segments.front();
+    segments.pop_front();
+    segments.push_front(segment);
+    segments.push_front(front);
+  }
+
+  /**
+   * Add data to the spans, merging it with the last span if it is adjacent
+   *
+   * \return false if no span was left
+   */
+  static bool append(span_t *spans, size_t &n, const char *ptr, size_t len) {
+    if (n > 0 && spans[n - 1].data + spans[n - 1].length == ptr) {
+      spans[n - 1].length += len;
+      return true;
+    }
+    if (n == 2) return false;
+    spans[n].data = ptr;
+    spans[n].length = len;
+    ++n;
+    return true;
+  }
+
+  void grow(size_t capacity) {
+    if (capacity <= data.size()) return;
+    auto newSize = std::max((size_t)SENT_BUFFER_CAPACITY, data.size());
+    while (newSize < capacity) newSize *= 2;
+    std::vector<char> newData(newSize);
+    if (used > 0) {
+      auto len = std::min(used, data.size() - head);
+      memcpy(newData.data(), data.data() + head, len);
+      memcpy(newData.data() + len, data.data(), used - len);
+    }
+    data.swap(newData);
+    head = 0;
+  }
 
-#ifdef PAINLESSMESH_ENABLE_STD_STRING
-template <>
-inline void SentBuffer<std::string>::read(size_t length, temp_buffer_t &buf) {
-  jsonStrings.front().copy(buf.buffer, length);
-  // Mimic String.toCharArray behaviour, which will insert
-  // null termination at the end of original string and the last
-  // character
-  if (length == jsonStrings.front().length() + 1) buf.buffer[length - 1] = '\0';
-  buf.buffer[length] = '\0';
-  last_read_size = length;
-}
-
-template <>
-inline void SentBuffer<std::string>::stringEraseFront(std::string &string,
-                                               size_t length) {
-  string.erase(0, length);
+  /**
+   * Release memory needed for exceptionally large messages, the ring buffer
+   * should be empty
+   */
+  void release() {
+    head = 0;
+    if (data.size() > SENT_BUFFER_CAPACITY) {
+      std::vector<char> newData(SENT_BUFFER_CAPACITY);
+      data.swap(newData);
+    }
+  }
+
+  void copyIn(size_t pos, const char *src, size_t length) {
+    auto len = std::min(length, data.size() - pos);
+    memcpy(data.data() + pos, src, len);
+    memcpy(data.data(), src + len, length - len);
+  }
+
+  /**
+   * Move data to an earlier position in the ring buffer
+   */
+  void move(size_t to, size_t from, size_t length) {
+    while (length > 0) {
+      auto len =
+          std::min(length, std::min(data.size() - to, data.size() - from));
+      memmove(data.data() + to, data.data() + from, len);
+      to = (to + len) % data.size();
+      from = (from + len) % data.size();
+      length -= len;
+    }
+  }
 };
-#endif
 
 }  // namespace buffer
 }  // namespace painlessmesh
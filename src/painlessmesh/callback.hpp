@@ -1,6 +1,7 @@
 #ifndef _PAINLESS_MESH_CALLBACK_HPP_
 #define _PAINLESS_MESH_CALLBACK_HPP_
 
+#include<deque>
 #include<map>
 
 #include "painlessmesh/configuration.hpp"
@@ -9,22 +10,37 @@
 
 extern painlessmesh::logger::LogClass Log;
 
+#ifndef PAINLESSMESH_CALLBACK_TABLE_SIZE
+// Package types below this are looked up directly in a table, others in a map
+#define PAINLESSMESH_CALLBACK_TABLE_SIZE 32
+#endif
+
 namespace painlessmesh {
 
 /**
  * Helper functions to work with multiple callbacks
  */
 namespace callback {
+/**
+ * A list of callbacks
+ *
+ * Callbacks can add new callbacks while the list is executed, those are called
+ * from the next execute() on.
+ */
 template <typename... Args>
 class List {
  public:
   int execute(Args... args) {
-    for (auto&& f : callbacks) {
-      f(args...);
+    // Adding to a deque keeps references to the other callbacks valid
+    auto size = callbacks.size();
+    for (size_t i = 0; i < size; ++i) {
+      callbacks[i](args...);
     }
-    return callbacks.size();
+    return size;
   }
 
+  bool empty() const { return callbacks.empty(); }
+
   /*
    * Needs to be wrapped into semaphore
    *
@@ -44,11 +60,16 @@ class List {
   }
 
  protected:
-  std::list<std::function<void(Args...)>> callbacks;
+  std::deque<std::function<void(Args...)>> callbacks;
 };
 
 /**
  * Manage callbacks for receiving packages
+ *
+ * The built in package types (and most plugin types) are small numbers, so
+ * their callbacks are kept in a table indexed by the package id. Larger ids
+ * are kept in a map. Both keep the lists in place when callbacks are added, so
+ * a callback can add others while it is executed.
  */
 template <typename... Args>
 class PackageCallbackList {
@@ -57,21 +78,40 @@ class PackageCallbackList {
    * Add a callback for specific package id
    */
   void onPackage(int id, std::function<void(Args...)> func) {
-    callbackMap[id].push_back(func);
+    if (id >= 0 && id < PAINLESSMESH_CALLBACK_TABLE_SIZE) {
+      if (table.size() <= (size_t)id) table.resize(id + 1);
+      table[id].push_back(func);
+    } else {
+      callbackMap[id].push_back(func);
+    }
   }
 
   /**
    * Execute all the callbacks associated with a certain package
    */
-  int execute(int id, Args... args) { return callbackMap[id].execute(args...); }
+  int execute(int id, Args... args) {
+    if (id >= 0 && (size_t)id < table.size())
+      return table[id].execute(args...);
+    auto it = callbackMap.find(id);
+    if (it == callbackMap.end()) return 0;
+    return it->second.execute(args...);
+  }
 
  protected:
+  std::deque<List<Args...>> table;
   std::map<int, List<Args...>> callbackMap;
 };
 
+/**
+ * Callbacks for packages received by the mesh
+ *
+ * The Variant is passed by reference, so all callbacks share the same parsed
+ * document. Callbacks that take the Variant by value still work, but make a
+ * copy.
+ */
 template <typename T>
 using MeshPackageCallbackList =
-    PackageCallbackList<protocol::Variant, std::shared_ptr<T>, uint32_t>;
+    PackageCallbackList<protocol::Variant&, std::shared_ptr<T>, uint32_t>;
 }  // namespace callback
 }  // namespace painlessmesh
 
@@ -1,19 +1,27 @@
 #ifndef _PAINLESS_MESH_LAYOUT_HPP_
 #define _PAINLESS_MESH_LAYOUT_HPP_
 
+#include <algorithm>
+#include <functional>
 #include <list>
+#include <map>
 #include <memory>
+#include <unordered_map>
+#include <vector>
 
 #include "painlessmesh/protocol.hpp"
 
+#ifndef PAINLESSMESH_MAX_BROADCAST_ORIGINS
+#define PAINLESSMESH_MAX_BROADCAST_ORIGINS 64
+#endif
+
 namespace painlessmesh {
 namespace layout {
 
-#include <memory>
 /**
  * Whether the tree contains the given nodeId
  */
-inline bool contains(protocol::NodeTree nodeTree, uint32_t nodeId) {
+inline bool contains(const protocol::NodeTree& nodeTree, uint32_t nodeId) {
   if (nodeTree.nodeId == nodeId) {
     return true;
   }
@@ -27,18 +35,192 @@ inline protocol::NodeTree excludeRoute(protocol::NodeTree&& tree,
                                        uint32_t exclude) {
   // Make sure to exclude any subs with nodeId == 0,
   // even if exlude is not set to zero
-  tree.subs.remove_if([exclude](protocol::NodeTree s) {
+  tree.subs.remove_if([exclude](const protocol::NodeTree& s) {
     return s.nodeId == 0 || s.nodeId == exclude;
   });
   return tree;
 }
 
+/**
+ * Hash of the tree
+ *
+ * Independent of the order of the subs. Used to check that a delta node sync
+ * is applied to the same tree it was based on.
+ */
+inline uint32_t hash(const protocol::NodeTree& tree) {
+  auto mix = [](uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+  };
+  uint32_t subs = 0;
+  for (auto&& s : tree.subs) subs += mix(hash(s));
+  return mix(tree.nodeId ^ mix(subs + tree.root));
+}
+
+/**
+ * Revision of the known layout of the mesh
+ *
+ * Increases every time a neighbour changes its subs. Used to know when the
+ * routing index of a Layout is out of date.
+ */
+inline size_t& revision() {
+  static size_t rev = 0;
+  return rev;
+}
+
+/**
+ * \brief Remembers which broadcasts were received recently
+ *
+ * For every origin the highest sequence number is kept, together with a bitmap
+ * of the 32 sequence numbers before it. This is enough to detect broadcasts
+ * that are flooded back through a (temporary) loop in the mesh. Older sequence
+ * numbers are dropped, unless they are so far back that the origin must have
+ * restarted its sequence.
+ */
+class SequenceFilter {
+ public:
+  /**
+   * Sequence numbers this far behind the highest one are taken as a restart of
+   * the origin, not as a late duplicate
+   */
+  static const uint32_t restartDistance = (uint32_t)1 << 16;
+
+  /**
+   * Record the broadcast and return whether it was received before
+   */
+  bool seen(uint32_t origin, uint32_t seq) {
+    ++tick;
+    auto it = windows.find(origin);
+    if (it == windows.end()) {
+      if (windows.size() >= PAINLESSMESH_MAX_BROADCAST_ORIGINS) evict();
+      windows[origin] = {seq, 1, tick};
+      return false;
+    }
+    auto& window = it->second;
+    window.used = tick;
+    auto diff = (int32_t)(seq - window.highest);
+    if (diff > 0) {
+      window.bits = diff < 32 ? (window.bits << diff) | 1 : 1;
+      window.highest = seq;
+      return false;
+    }
+    auto age = window.highest - seq;
+    if (age >= restartDistance) {
+      window.highest = seq;
+      window.bits = 1;
+      return false;
+    }
+    // Too old to tell, so treat it as a duplicate
+    if (age >= 32) return true;
+    auto mask = (uint32_t)1 << age;
+    if (window.bits & mask) return true;
+    window.bits |= mask;
+    return false;
+  }
+
+  size_t size() const { return windows.size(); }
+
+  void clear() { windows.clear(); }
+
+ private:
+  struct window_t {
+    uint32_t highest;
+    // Bit n is set if highest - n was received
+    uint32_t bits;
+    // Value of tick when the origin was last seen
+    uint32_t used;
+  };
+  std::unordered_map<uint32_t, window_t> windows;
+  uint32_t tick = 0;
+
+  /**
+   * Forget the origin that was not seen for the longest time
+   */
+  void evict() {
+    auto oldest = windows.begin();
+    for (auto it = windows.begin(); it != windows.end(); ++it) {
+      if ((int32_t)(it->second.used - oldest->second.used) < 0) oldest = it;
+    }
+    if (oldest != windows.end()) windows.erase(oldest);
+  }
+};
+
 template <class T>
 class Layout {
  public:
   size_t stability = 0;
   std::list<std::shared_ptr<T> > subs;
 
+  /**
+   * Number of packages that were send on using only their header (see
+   * router::routePackage)
+   */
+  size_t forwardedPackages = 0;
+
+  /**
+   * Number of packages that were fully parsed before handling them
+   */
+  size_t parsedPackages = 0;
+
+  /**
+   * Number of broadcasts that were dropped, because they were received before
+   */
+  size_t duplicatePackages = 0;
+
+  /**
+   * Broadcasts received recently, see router::routePackage
+   */
+  SequenceFilter seenBroadcasts;
+
+  /**
+   * Callbacks for SINGLE packages that pass through this node on their way to
+   * another node, see plugin::PackageHandler::onRelay()
+   */
+  std::map<int, std::vector<std::function<bool(protocol::Variant&)> > >
+      relayCallbacks;
+
+  /**
+   * Whether packages of this type that pass through should be parsed
+   */
+  bool relays(int type) const {
+    return !relayCallbacks.empty() && relayCallbacks.count(type) > 0;
+  }
+
+  /**
+   * Run the relay callbacks for a package that passes through
+   *
+   * \return Whether a callback handled the package, so it should not be send
+   * on
+   */
+  bool relay(protocol::Variant& variant) {
+    auto it = relayCallbacks.find(variant.type());
+    if (it == relayCallbacks.end()) return false;
+    for (auto&& f : it->second) {
+      if (f(variant)) return true;
+    }
+    return false;
+  }
+
+  /**
+   * Sequence number for the next broadcast from this node
+   *
+   * Starts at a value based on the time of the first broadcast, so a node that
+   * restarts is unlikely to reuse the numbers it used before. The time is
+   * scrambled, so the new start is also unlikely to be just behind the old
+   * numbers (see SequenceFilter::restartDistance).
+   */
+  uint32_t nextBroadcastSeq() {
+    if (broadcastSeq == 0)
+      broadcastSeq = ((uint32_t)micros() * 0x9E3779B1u) ^ nodeId;
+    ++broadcastSeq;
+    if (broadcastSeq == 0) ++broadcastSeq;
+    return broadcastSeq;
+  }
+
   /** Return the nodeId of the node that we are running on.
    *
    * On the ESP hardware nodeId is uniquely calculated from the MAC address of
@@ -46,18 +228,84 @@ class Layout {
    */
   uint32_t getNodeId() { return nodeId; }
 
-  protocol::NodeTree asNodeTree() {
-    auto nt = protocol::NodeTree(nodeId, root);
-    for (auto&& s : subs) {
-      if (s->nodeId == 0) continue;
-      nt.subs.push_back(protocol::NodeTree(*s));
+  /**
+   * The layout of the mesh as seen from this node
+   *
+   * The tree is cached and only rebuild after the layout changed, so the
+   * returned reference is only valid until the layout changes.
+   */
+  const protocol::NodeTree& asNodeTree() {
+    if (treeLayoutRevision != revision() || treeSubs != subs.size() ||
+        tree.nodeId != nodeId || tree.root != root) {
+      auto nt = protocol::NodeTree(nodeId, root);
+      for (auto&& s : subs) {
+        if (s->nodeId == 0) continue;
+        nt.subs.push_back(protocol::NodeTree(*s));
+      }
+      treeLayoutRevision = revision();
+      treeSubs = subs.size();
+      if (nt != tree) {
+        tree = std::move(nt);
+        ++treeRevision;
+      }
     }
-    return nt;
+    return tree;
+  }
+
+  /**
+   * Revision of the tree returned by asNodeTree()
+   *
+   * Increases every time the tree changes.
+   */
+  size_t getTreeRevision() {
+    asNodeTree();
+    return treeRevision;
+  }
+
+  /**
+   * The neighbour through which the given node can be reached
+   *
+   * Uses an index from nodeId to neighbour, which is rebuild when the layout
+   * changed since the last lookup.
+   *
+   * @return The neighbour or NULL if the node is not part of the mesh
+   */
+  std::shared_ptr<T> findRoute(uint32_t nodeId) {
+    if (routesRevision != revision() || routesSubs != subs.size())
+      updateRoutes();
+    auto route = routes.find(nodeId);
+    if (route == routes.end()) return NULL;
+    return route->second.lock();
   }
 
  protected:
   uint32_t nodeId = 0;
   bool root = false;
+
+ private:
+  uint32_t broadcastSeq = 0;
+  std::unordered_map<uint32_t, std::weak_ptr<T> > routes;
+  size_t routesRevision = 0;
+  size_t routesSubs = 0;
+
+  protocol::NodeTree tree;
+  size_t treeRevision = 0;
+  size_t treeLayoutRevision = 0;
+  size_t treeSubs = 0;
+
+  void updateRoutes() {
+    routes.clear();
+    for (auto&& s : subs) addRoutes((*s), s);
+    routesRevision = revision();
+    routesSubs = subs.size();
+  }
+
+  void addRoutes(const protocol::NodeTree& tree,
+                 const std::shared_ptr<T>& conn) {
+    // The first neighbour that contains the node is used
+    routes.emplace(tree.nodeId, conn);
+    for (auto&& s : tree.subs) addRoutes(s, conn);
+  }
 };
 
 template <class T>
@@ -67,7 +315,7 @@ void syncLayout(Layout<T>& layout, uint32_t changedId) {
   for (auto&& sub : layout.subs) {
     if (sub->connected && !sub->newConnection && sub->nodeId != 0 &&
         sub->nodeId != changedId) {  // Exclude current
-      sub->nodeSyncTask.forceNextIteration();
+      sub->nodeSyncTimer.forceNextIteration();
     }
   }
   layout.stability /= 2;
@@ -78,13 +326,37 @@ class Neighbour : public protocol::NodeTree {
   // Inherit constructors
   using protocol::NodeTree::NodeTree;
 
+  /**
+   * Protocol features supported by both us and this neighbour
+   */
+  uint32_t features = 0;
+
+  /**
+   * The last node sync package send to this neighbour
+   *
+   * Reused as long as our layout does not change (see router::sendNodeSync)
+   */
+  struct {
+    TSTRING msg;
+    int type = 0;
+    size_t revision = 0;
+    uint32_t nodeId = 0;
+    uint32_t features = 0;
+    bool reusable = false;
+  } syncCache;
+
+  /**
+   * Ask the neighbour to send its full tree with our next node sync
+   */
+  bool resendRequested = false;
+
   /**
    * Is the passed nodesync valid
    *
    * If not then the caller of this function should probably disconnect
    * this neighbour.
    */
-  bool validSubs(protocol::NodeTree tree) {
+  bool validSubs(const protocol::NodeTree& tree) {
     if (nodeId == 0)  // Cant really know, so valid as far as we know
       return true;
     if (nodeId != tree.nodeId) return false;
@@ -104,39 +376,131 @@ class Neighbour : public protocol::NodeTree {
    *
    * \return Whether we adopted the new tree
    */
-  bool updateSubs(protocol::NodeTree tree) {
+  bool updateSubs(const protocol::NodeTree& tree) {
     if (nodeId == 0 || tree != (*this)) {
       nodeId = tree.nodeId;
       subs = tree.subs;
       root = tree.root;
+      ++revision();
       return true;
     }
     return false;
   }
 
+  /**
+   * Forget the subs, e.g. because the connection was closed
+   */
+  void clear() {
+    protocol::NodeTree::clear();
+    syncCache.msg = TSTRING();
+    resendRequested = false;
+    resetSync();
+    ++revision();
+  }
+
+  /**
+   * Forget the tree we send last, so the next node sync contains the full
+   * tree
+   */
+  void resetSync() {
+    sentValid = false;
+    sent = protocol::NodeTree();
+  }
+
+  /**
+   * Turn a delta node sync into the full tree, using the subs we know
+   *
+   * \return Whether the package now holds the full tree. False if the delta
+   * was not based on the tree we know.
+   */
+  bool applyDelta(protocol::NodeSyncRequest& pkg) {
+    if (!pkg.delta) return true;
+    if (nodeId == 0 || pkg.nodeId != nodeId ||
+        layout::hash(*this) != pkg.baseHash)
+      return false;
+    auto changed = std::move(pkg.subs);
+    pkg.subs = subs;
+    pkg.subs.remove_if([&pkg, &changed](const protocol::NodeTree& s) {
+      for (auto&& id : pkg.removed)
+        if (id == s.nodeId) return true;
+      for (auto&& c : changed)
+        if (c.nodeId == s.nodeId) return true;
+      return false;
+    });
+    pkg.subs.splice(pkg.subs.end(), changed);
+    if (layout::hash(pkg) != pkg.hash) return false;
+    pkg.delta = false;
+    pkg.removed.clear();
+    return true;
+  }
+
   /**
    * Create a request
    */
   protocol::NodeSyncRequest request(NodeTree&& layout) {
-    auto subTree = excludeRoute(std::move(layout), nodeId);
-    return protocol::NodeSyncRequest(subTree.nodeId, nodeId, subTree.subs,
-                                     subTree.root);
+    auto pkg = protocol::NodeSyncRequest();
+    fillSync(pkg, excludeRoute(std::move(layout), nodeId));
+    return pkg;
   }
 
   /**
    * Create a reply
    */
   protocol::NodeSyncReply reply(NodeTree&& layout) {
-    auto subTree = excludeRoute(std::move(layout), nodeId);
-    return protocol::NodeSyncReply(subTree.nodeId, nodeId, subTree.subs,
-                                   subTree.root);
+    auto pkg = protocol::NodeSyncReply();
+    fillSync(pkg, excludeRoute(std::move(layout), nodeId));
+    return pkg;
+  }
+
+ private:
+  // The tree we send with the last node sync
+  protocol::NodeTree sent;
+  uint32_t sentHash = 0;
+  bool sentValid = false;
+
+  /**
+   * Fill the node sync with our tree, or the delta against the last send
+   * tree if the neighbour supports that
+   */
+  void fillSync(protocol::NodeSyncRequest& pkg, NodeTree&& subTree) {
+    pkg.from = subTree.nodeId;
+    pkg.nodeId = subTree.nodeId;
+    pkg.dest = nodeId;
+    pkg.root = subTree.root;
+    pkg.features = PAINLESSMESH_FEATURES;
+    pkg.resend = resendRequested;
+    resendRequested = false;
+
+    auto treeHash = layout::hash(subTree);
+    if ((features & protocol::DELTA_SYNC) && sentValid) {
+      pkg.delta = true;
+      pkg.baseHash = sentHash;
+      pkg.hash = treeHash;
+      for (auto&& s : subTree.subs) {
+        auto old = std::find_if(
+            sent.subs.begin(), sent.subs.end(),
+            [&s](const NodeTree& o) { return o.nodeId == s.nodeId; });
+        if (old == sent.subs.end() || (*old) != s) pkg.subs.push_back(s);
+      }
+      for (auto&& o : sent.subs) {
+        auto current = std::find_if(
+            subTree.subs.begin(), subTree.subs.end(),
+            [&o](const NodeTree& s) { return o.nodeId == s.nodeId; });
+        if (current == subTree.subs.end()) pkg.removed.push_back(o.nodeId);
+      }
+    } else {
+      pkg.subs = subTree.subs;
+    }
+    sent = std::move(subTree);
+    sentHash = treeHash;
+    sentValid = true;
   }
 };
 
 /**
  * The size of the mesh (the number of nodes)
  */
-inline uint32_t size(protocol::NodeTree nodeTree) {
+inline uint32_t size(const protocol::NodeTree& nodeTree) {
   auto no = 1;
   for (auto&& s : nodeTree.subs) {
     no += size(s);
@@ -147,7 +511,7 @@ inline uint32_t size(protocol::NodeTree nodeTree) {
 /**
  * Whether the top node in the tree is also the root of the mesh
  */
-inline bool isRoot(protocol::NodeTree nodeTree) {
+inline bool isRoot(const protocol::NodeTree& nodeTree) {
   if (nodeTree.root) return true;
   return false;
 }
@@ -155,7 +519,7 @@ inline bool isRoot(protocol::NodeTree nodeTree) {
 /**
  * Whether any node in the tree is also root of the mesh
  */
-inline bool isRooted(protocol::NodeTree nodeTree) {
+inline bool isRooted(const protocol::NodeTree& nodeTree) {
   if (isRoot(nodeTree)) return true;
   for (auto&& s : nodeTree.subs) {
     if (isRooted(s)) return true;
@@ -166,7 +530,7 @@ inline bool isRooted(protocol::NodeTree nodeTree) {
 /**
  * Return all nodes in a list container
  */
-inline std::list<uint32_t> asList(protocol::NodeTree nodeTree,
+inline std::list<uint32_t> asList(const protocol::NodeTree& nodeTree,
                                   bool includeSelf = true) {
   std::list<uint32_t> lst;
   if (includeSelf) lst.push_back(nodeTree.nodeId);
@@ -0,0 +1,189 @@
+#ifndef _PAINLESS_MESH_MD5_HPP_
+#define _PAINLESS_MESH_MD5_HPP_
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+#include "painlessmesh/configuration.hpp"
+
+namespace painlessmesh {
+namespace md5 {
+
+/**
+ * \brief Incremental MD5 (RFC 1321)
+ *
+ * Data can be added in pieces of any size. The state can be saved to a string
+ * and restored later, so a hash over a large file can be continued after a
+ * reboot without reading the file again.
+ */
+class Context {
+ public:
+  Context() { reset(); }
+
+  void reset() {
+    state[0] = 0x67452301;
+    state[1] = 0xefcdab89;
+    state[2] = 0x98badcfe;
+    state[3] = 0x10325476;
+    count = 0;
+  }
+
+  void update(const char* data, size_t length) {
+    auto bytes = (const uint8_t*)data;
+    auto used = count % 64;
+    count += length;
+    if (used > 0) {
+      auto n = std::min(length, (size_t)(64 - used));
+      memcpy(buffer + used, bytes, n);
+      bytes += n;
+      length -= n;
+      if (used + n < 64) return;
+      transform(buffer);
+    }
+    for (; length >= 64; length -= 64, bytes += 64) transform(bytes);
+    memcpy(buffer, bytes, length);
+  }
+
+  void update(const TSTRING& data) { update(data.c_str(), data.length()); }
+
+  /**
+   * Number of bytes hashed so far
+   */
+  uint64_t size() const { return count; }
+
+  /**
+   * The hash of the data so far, as lower case hex. More data can be added
+   * afterwards.
+   */
+  TSTRING hexdigest() const {
+    Context ctx = *this;
+    uint8_t padding[72] = {0x80};
+    auto used = count % 64;
+    ctx.update((const char*)padding, used < 56 ? 56 - used : 120 - used);
+    uint8_t length[8];
+    for (auto i = 0; i < 8; ++i) length[i] = (count * 8) >> (8 * i);
+    ctx.update((const char*)length, 8);
+    uint8_t digest[16];
+    for (auto i = 0; i < 16; ++i) digest[i] = ctx.state[i / 4] >> (8 * (i % 4));
+    return toHex(digest, 16);
+  }
+
+  /**
+   * The state as a hex string, see restore()
+   */
+  TSTRING save() const {
+    uint8_t bytes[24 + 64];
+    for (auto i = 0; i < 16; ++i) bytes[i] = state[i / 4] >> (8 * (i % 4));
+    for (auto i = 0; i < 8; ++i) bytes[16 + i] = count >> (8 * i);
+    memcpy(bytes + 24, buffer, count % 64);
+    return toHex(bytes, 24 + count % 64);
+  }
+
+  /**
+   * Continue from a state returned by save()
+   *
+   * \return false if the state is invalid, the context is reset in that case
+   */
+  bool restore(const TSTRING& hex) {
+    reset();
+    uint8_t bytes[24 + 64];
+    auto length = hex.length() / 2;
+    if (hex.length() % 2 != 0 || length < 24 || length > sizeof(bytes))
+      return false;
+    for (size_t i = 0; i < length; ++i) {
+      auto high = fromHex(hex[2 * i]);
+      auto low = fromHex(hex[2 * i + 1]);
+      if (high < 0 || low < 0) return false;
+      bytes[i] = (high << 4) | low;
+    }
+    uint64_t n = 0;
+    for (auto i = 0; i < 8; ++i) n |= (uint64_t)bytes[16 + i] << (8 * i);
+    if (length != 24 + n % 64) return false;
+    for (auto i = 0; i < 4; ++i) {
+      state[i] = 0;
+      for (auto j = 0; j < 4; ++j)
+        state[i] |= (uint32_t)bytes[4 * i + j] << (8 * j);
+    }
+    count = n;
+    memcpy(buffer, bytes + 24, n % 64);
+    return true;
+  }
+
+ protected:
+  uint32_t state[4];
+  uint64_t count;
+  uint8_t buffer[64];
+
+  static TSTRING toHex(const uint8_t* bytes, size_t length) {
+    static const char digits[] = "0123456789abcdef";
+    TSTRING hex;
+    hex.reserve(2 * length);
+    for (size_t i = 0; i < length; ++i) {
+      hex += digits[bytes[i] >> 4];
+      hex += digits[bytes[i] & 0xf];
+    }
+    return hex;
+  }
+
+  static int fromHex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+  }
+
+  static uint32_t rotate(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+  void transform(const uint8_t* block) {
+    static const uint32_t k[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+        0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+        0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+        0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+        0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+        0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+        0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+        0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+        0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+    static const uint8_t r[16] = {7, 12, 17, 22, 5, 9,  14, 20,
+                                  4, 11, 16, 23, 6, 10, 15, 21};
+    uint32_t m[16];
+    for (auto i = 0; i < 16; ++i)
+      m[i] = block[4 * i] | (block[4 * i + 1] << 8) |
+             (block[4 * i + 2] << 16) | ((uint32_t)block[4 * i + 3] << 24);
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    for (auto i = 0; i < 64; ++i) {
+      uint32_t f;
+      int g;
+      if (i < 16) {
+        f = (b & c) | (~b & d);
+        g = i;
+      } else if (i < 32) {
+        f = (d & b) | (~d & c);
+        g = (5 * i + 1) % 16;
+      } else if (i < 48) {
+        f = b ^ c ^ d;
+        g = (3 * i + 5) % 16;
+      } else {
+        f = c ^ (b | ~d);
+        g = (7 * i) % 16;
+      }
+      auto tmp = d;
+      d = c;
+      c = b;
+      b += rotate(a + f + k[i] + m[g], r[4 * (i / 16) + i % 4]);
+      a = tmp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+  }
+};
+
+}  // namespace md5
+}  // namespace painlessmesh
+#endif
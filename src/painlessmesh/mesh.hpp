@@ -3,6 +3,7 @@
 
 #include "painlessmesh/configuration.hpp"
 
+#include "painlessmesh/buffer.hpp"
 #include "painlessmesh/ntp.hpp"
 #include "painlessmesh/plugin.hpp"
 #include "painlessmesh/tcp.hpp"
@@ -11,12 +12,21 @@
 #include "painlessmesh/ota.hpp"
 #endif
 
+#ifndef PAINLESSMESH_IO_BUDGET
+#define PAINLESSMESH_IO_BUDGET 16
+#endif
+
+#ifndef PAINLESSMESH_WRITE_RETRY
+#define PAINLESSMESH_WRITE_RETRY 100  // Retry a failed write after this (ms)
+#endif
+
 namespace painlessmesh {
 typedef std::function<void(uint32_t nodeId)> newConnectionCallback_t;
 typedef std::function<void(uint32_t nodeId)> droppedConnectionCallback_t;
 typedef std::function<void(uint32_t from, TSTRING &msg)> receivedCallback_t;
 typedef std::function<void()> changedConnectionsCallback_t;
 typedef std::function<void(int32_t offset)> nodeTimeAdjustedCallback_t;
+typedef std::function<void(int64_t offset)> nodeTimeAdjusted64Callback_t;
 typedef std::function<void(uint32_t nodeId, int32_t delay)> nodeDelayCallback_t;
 
 /**
@@ -40,6 +50,10 @@ class Mesh : public ntp::MeshTime, public plugin::PackageHandler<T> {
 
     mScheduler->enableAll();
 
+    ioTask = this->addTask(TASK_SECOND, TASK_FOREVER, [this]() { handleIO(); });
+    timerTask =
+        this->addTask(TASK_MINUTE, TASK_FOREVER, [this]() { handleTimers(); });
+
     // Add package handlers
     this->callbackList = painlessmesh::ntp::addPackageCallback(
         std::move(this->callbackList), (*this));
@@ -66,9 +80,10 @@ class Mesh : public ntp::MeshTime, public plugin::PackageHandler<T> {
   }
 
 #ifdef PAINLESSMESH_ENABLE_OTA
-  void initOTA(TSTRING role = "") {
+  void initOTA(TSTRING role = "", bool resumable = false,
+               size_t cacheSize = 0) {
     painlessmesh::plugin::ota::addPackageCallback(*this->mScheduler, (*this),
-                                                  role);
+                                                  role, resumable, cacheSize);
   }
 #endif
 
@@ -103,6 +118,14 @@ class Mesh : public ntp::MeshTime, public plugin::PackageHandler<T> {
 
   void setDebugMsgTypes(uint16_t types) { Log.setLogLevel(types); }
 
+  /**
+   * Maximum number of messages received or written per scheduler pass
+   *
+   * A higher budget gives a higher throughput, but other tasks have to wait
+   * longer before they run. Default is PAINLESSMESH_IO_BUDGET.
+   */
+  void setIOBudget(size_t budget) { ioBudget = budget > 0 ? budget : 1; }
+
   /**
    * Disconnect and stop this node
    */
@@ -114,6 +137,7 @@ class Mesh : public ntp::MeshTime, public plugin::PackageHandler<T> {
       (*conn)->close();
       this->eraseClosedConnections();
     }
+    ioQueue.clear();
     plugin::PackageHandler<T>::stop();
   }
 
@@ -141,7 +165,7 @@ class Mesh : public ntp::MeshTime, public plugin::PackageHandler<T> {
     Log(logger::COMMUNICATION, "sendSingle(): dest=%u msg=%s\n", destId,
         msg.c_str());
     auto single = painlessmesh::protocol::Single(this->nodeId, destId, msg);
-    return painlessmesh::router::send<T>(single, (*this));
+    return painlessmesh::router::send<protocol::Single, T>(single, (*this));
   }
 
   /** Broadcast a message to every node on the mesh network.
@@ -154,10 +178,11 @@ class Mesh : public ntp::MeshTime, public plugin::PackageHandler<T> {
     using namespace logger;
     Log(COMMUNICATION, "sendBroadcast(): msg=%s\n", msg.c_str());
     auto pkg = painlessmesh::protocol::Broadcast(this->nodeId, 0, msg);
+    pkg.seq = this->nextBroadcastSeq();
     auto success = router::broadcast<protocol::Broadcast, T>(pkg, (*this), 0);
     if (success && includeSelf) {
       auto variant = protocol::Variant(pkg);
-      this->callbackList.execute(pkg.type, pkg, NULL, 0);
+      this->callbackList.execute(pkg.type, variant, NULL, 0);
     }
     if (success > 0) return true;
     return false;
@@ -197,14 +222,14 @@ class Mesh : public ntp::MeshTime, public plugin::PackageHandler<T> {
     using namespace painlessmesh;
     this->callbackList.onPackage(
         protocol::SINGLE,
-        [onReceive](protocol::Variant variant, std::shared_ptr<T>, uint32_t) {
+        [onReceive](protocol::Variant& variant, std::shared_ptr<T>, uint32_t) {
           auto pkg = variant.to<protocol::Single>();
           onReceive(pkg.from, pkg.msg);
           return false;
         });
     this->callbackList.onPackage(
         protocol::BROADCAST,
-        [onReceive](protocol::Variant variant, std::shared_ptr<T>, uint32_t) {
+        [onReceive](protocol::Variant& variant, std::shared_ptr<T>, uint32_t) {
           auto pkg = variant.to<protocol::Broadcast>();
           onReceive(pkg.from, pkg.msg);
           return false;
@@ -272,9 +297,30 @@ class Mesh : public ntp::MeshTime, public plugin::PackageHandler<T> {
    *    Serial.println(String(offset));
    * });
    * \endcode
+   *
+   * The offset is clamped to the range of an int32_t. Steps larger than that
+   * (about 35 minutes) happen when joining a mesh, use onNodeTimeAdjusted64()
+   * to get their full size.
    */
   void onNodeTimeAdjusted(nodeTimeAdjustedCallback_t onTimeAdjusted) {
     Log(logger::GENERAL, "onNodeTimeAdjusted():\n");
+    if (!onTimeAdjusted) {
+      nodeTimeAdjustedCallback = NULL;
+      return;
+    }
+    nodeTimeAdjustedCallback = [onTimeAdjusted](int64_t offset) {
+      onTimeAdjusted((int32_t)std::max<int64_t>(
+          INT32_MIN, std::min<int64_t>(INT32_MAX, offset)));
+    };
+  }
+
+  /** Callback that gets called every time node time gets adjusted
+   *
+   * Same as onNodeTimeAdjusted(), but with the full 64 bit offset (see
+   * getNodeTime64()).
+   */
+  void onNodeTimeAdjusted64(nodeTimeAdjusted64Callback_t onTimeAdjusted) {
+    Log(logger::GENERAL, "onNodeTimeAdjusted64():\n");
     nodeTimeAdjustedCallback = onTimeAdjusted;
   }
 
@@ -348,10 +394,15 @@ class Mesh : public ntp::MeshTime, public plugin::PackageHandler<T> {
         conn->nodeId);
     painlessmesh::protocol::TimeSync timeSync;
     if (ntp::adopt(this->asNodeTree(), (*conn))) {
-      timeSync = painlessmesh::protocol::TimeSync(this->nodeId, conn->nodeId,
-                                                  this->getNodeTime());
+      uint64_t now = (conn->features & protocol::TIME64)
+                         ? this->getNodeTime64()
+                         : this->getNodeTime();
+      timeSync =
+          painlessmesh::protocol::TimeSync(this->nodeId, conn->nodeId, now);
       Log(S_TIME, "startTimeSync(): Requesting time from %u\n", conn->nodeId);
     } else {
+      // Samples of an unfinished burst are stale by the time we adopt again
+      conn->clockFilter.reset();
       timeSync = painlessmesh::protocol::TimeSync(this->nodeId, conn->nodeId);
       Log(S_TIME, "startTimeSync(): Requesting %u to adopt our time\n",
           conn->nodeId);
@@ -372,6 +423,99 @@ class Mesh : public ntp::MeshTime, public plugin::PackageHandler<T> {
     return false;
   }
 
+  /**
+   * Signal that the connection has data to handle or send
+   *
+   * Connections are handled in the order they became ready by a single task,
+   * see handleIO()
+   */
+  void queueIO(std::shared_ptr<T> conn) {
+    if (conn->ioQueued || !conn->connected) return;
+    conn->ioQueued = true;
+    ioQueue.push_back(conn);
+    if (ioTask) ioTask->forceNextIteration();
+  }
+
+  /**
+   * Look for work that was not signalled again after the given time (ms)
+   *
+   * Used by connections whose write failed, and that are not ready until
+   * either an ack arrives or PAINLESSMESH_WRITE_RETRY has passed. An earlier
+   * retry is kept, later calls can only bring it forward.
+   */
+  void retryIO(uint32_t delay) {
+    uint32_t at = millis() + delay;
+    if (!ioRetry || (int32_t)(at - ioRetryAt) < 0) {
+      ioRetry = true;
+      ioRetryAt = at;
+    }
+  }
+
+  /**
+   * Handle the connections that are ready, within the ioBudget
+   *
+   * Each connection handles one message at a time and is queued again while
+   * it has work left, so busy connections can not starve the others. Work
+   * left after the budget is used up is handled in the next pass.
+   */
+  void handleIO() {
+    using namespace logger;
+    // A busy queue must not hold back the retry, so check the deadline too
+    bool retryDue = ioRetry && (int32_t)(millis() - ioRetryAt) >= 0;
+    if (retryDue) ioRetry = false;
+    if (ioQueue.empty() || retryDue) {
+      // Pick up any work that was not signalled (e.g. a failed write)
+      for (auto&& conn : this->subs) {
+        if (conn->pendingIO()) queueIO(conn);
+      }
+    }
+    size_t budget = ioBudget;
+    while (budget > 0 && !ioQueue.empty()) {
+      auto conn = ioQueue.front().lock();
+      ioQueue.pop_front();
+      if (!conn) continue;
+      conn->ioQueued = false;
+      if (!conn->connected) continue;
+      auto used = conn->handleIO();
+      budget -= std::min(budget, used);
+      if (conn->pendingIO()) queueIO(conn);
+    }
+    if (!ioQueue.empty()) {
+      Log(COMMUNICATION, "handleIO(): budget used, %u connections waiting\n",
+          ioQueue.size());
+      ioTask->forceNextIteration();
+    } else if (ioRetry) {
+      // Wait for the deadline, which later passes do not move
+      int32_t left = ioRetryAt - millis();
+      if (left > 0)
+        ioTask->delay(std::min<uint32_t>(left, TASK_SECOND));
+      else
+        ioTask->forceNextIteration();
+    }
+  }
+
+  /**
+   * Run the connection timers that are due and sleep until the next one
+   *
+   * A single task runs the timers of all connections, so the number of tasks
+   * the scheduler has to check does not grow with the number of connections.
+   * Timers wake this task up when they are moved forward.
+   */
+  void handleTimers() {
+    // Runs at least every minute, often enough to track the roll over of
+    // micros() for getNodeTime64()
+    this->getNodeTime64();
+    auto now = millis();
+    uint32_t next = TASK_MINUTE;
+    for (auto&& conn : this->subs) {
+      if (conn->connected) next = std::min(next, conn->handleTimers(now));
+    }
+    if (next > 0)
+      timerTask->delay(next);
+    else
+      timerTask->forceNextIteration();
+  }
+
   void eraseClosedConnections() {
     using namespace logger;
     Log(CONNECTION, "eraseClosedConnections():\n");
@@ -383,7 +527,7 @@ class Mesh : public ntp::MeshTime, public plugin::PackageHandler<T> {
   callback::List<uint32_t> newConnectionCallbacks;
   callback::List<uint32_t, bool> droppedConnectionCallbacks;
   callback::List<uint32_t> changedConnectionCallbacks;
-  nodeTimeAdjustedCallback_t nodeTimeAdjustedCallback;
+  nodeTimeAdjusted64Callback_t nodeTimeAdjustedCallback;
   nodeDelayCallback_t nodeDelayReceivedCallback;
 #ifdef ESP32
   SemaphoreHandle_t xSemaphore = NULL;
@@ -396,6 +540,14 @@ class Mesh : public ntp::MeshTime, public plugin::PackageHandler<T> {
 
   Scheduler *mScheduler;
 
+  std::shared_ptr<Task> ioTask;
+  std::shared_ptr<Task> timerTask;
+  buffer::ring_queue_t<std::weak_ptr<T> > ioQueue;
+  size_t ioBudget = PAINLESSMESH_IO_BUDGET;
+  // Whether and when (millis()) handleIO() has to look for unsignalled work
+  bool ioRetry = false;
+  uint32_t ioRetryAt = 0;
+
   /**
    * Wrapper function for ESP32 semaphore function
    *
@@ -9,6 +9,30 @@
 #define TIME_SYNC_ACCURACY 5000  // Minimum time sync accuracy (5ms
 #endif
 
+#ifndef TIME_SYNC_BURST
+#define TIME_SYNC_BURST 4  // Exchanges per sync, the fastest one is used
+#endif
+
+#ifndef TIME_SYNC_MAX_INTERVAL
+#define TIME_SYNC_MAX_INTERVAL 10 * TASK_MINUTE  // Resync period for stable
+                                                 // clocks
+#endif
+
+#ifndef TIME_SYNC_MAX_DELAY
+#define TIME_SYNC_MAX_DELAY 500000  // Exchanges slower than this (0.5s) are
+                                    // ignored
+#endif
+
+#ifndef TIME_SLEW_RATE
+#define TIME_SLEW_RATE 500  // Max adjustment when slewing (500us per second)
+#endif
+
+#ifndef TIME_SLEW_LIMIT
+#define TIME_SLEW_LIMIT 128000  // Larger offsets (128ms) are always stepped
+#endif
+
+#include <cmath>
+
 #include "Arduino.h"
 
 #include "painlessmesh/callback.hpp"
@@ -24,32 +48,107 @@ class MeshTime {
  public:
   /** Returns the mesh time in microsecond precision.
    *
-   * Time rolls over every 71 minutes.
+   * Time rolls over every 71 minutes, see getNodeTime64() for a time that
+   * does not.
    *
    * Nodes try to keep a common time base synchronizing to each other using [an
    * SNTP based
    * protocol](https://gitlab.com/painlessMesh/painlessMesh/wikis/mesh-protocol#time-sync)
    */
-  uint32_t getNodeTime() { return micros() + timeOffset; }
+  uint32_t getNodeTime() { return getNodeTime64(); }
+
+  /** Returns the mesh time as a 64 bit value in microseconds
+   *
+   * Unlike getNodeTime() this does not roll over, because the roll over of
+   * micros() is tracked. This requires the time to be requested at least once
+   * every 71 minutes, which the mesh does by itself.
+   *
+   * Neighbours that both support the 64 bit time sync share the full value,
+   * with older nodes only the lower 32 bits are synced.
+   */
+  uint64_t getNodeTime64() {
+    auto local = localTime64();
+    if (slewRemaining != 0) slew(local);
+    return local + timeOffset;
+  }
+
+  /**
+   * Adjust the mesh time gradually instead of in steps
+   *
+   * When enabled, offsets smaller than TIME_SLEW_LIMIT found by the time sync
+   * are applied at TIME_SLEW_RATE, so the mesh time never jumps (or goes
+   * back). Larger offsets (e.g. when joining a mesh) are still stepped.
+   */
+  void setTimeSlew(bool on = true) {
+    slewEnabled = on;
+    if (!on) {
+      timeOffset += slewRemaining;
+      slewRemaining = 0;
+    }
+  }
 
  protected:
-  uint32_t timeOffset = 0;
-};
+  int64_t timeOffset = 0;
+  bool slewEnabled = false;
+  // Part of the last offset that still has to be slewed
+  int64_t slewRemaining = 0;
+  uint64_t lastSlew = 0;
+  uint32_t lastMicros = 0;
+  uint64_t rollovers = 0;
+
+  /**
+   * micros(), extended to 64 bits
+   */
+  uint64_t localTime64() {
+    uint32_t now = micros();
+    if (now < lastMicros) rollovers += (uint64_t)1 << 32;
+    lastMicros = now;
+    return rollovers | now;
+  }
 
-/**
- * Calculate the offset of the local clock using the ntp algorithm
- *
- * See ntp overview for more information
- */
-inline int32_t clockOffset(uint32_t time0, uint32_t time1, uint32_t time2,
-                           uint32_t time3) {
-  uint32_t offset =
-      ((int32_t)(time1 - time0) / 2) + ((int32_t)(time2 - time3) / 2);
-
-  // Take small steps to avoid over correction
-  if (offset < 0.5 * TASK_SECOND && offset > 4) offset = offset / 4;
-  return offset;
-}
+  /**
+   * Extend a recent 32 bit node time (e.g. a receive time) to 64 bits
+   */
+  uint64_t toNodeTime64(uint32_t time) {
+    auto now = getNodeTime64();
+    return now - (uint32_t)((uint32_t)now - time);
+  }
+
+  /**
+   * Apply an offset found by the time sync
+   *
+   * The offset is measured against the slewed time, so it replaces what is
+   * left of the previous one.
+   *
+   * \return Whether the offset will be slewed instead of stepped
+   */
+  bool adjustTime(int64_t offset) {
+    auto local = localTime64();
+    if (slewRemaining != 0) slew(local);
+    if (slewEnabled && offset < TIME_SLEW_LIMIT && offset > -TIME_SLEW_LIMIT) {
+      slewRemaining = offset;
+      lastSlew = local;
+      return true;
+    }
+    slewRemaining = 0;
+    timeOffset += offset;
+    return false;
+  }
+
+  void slew(uint64_t local) {
+    auto step = (int64_t)((local - lastSlew) * TIME_SLEW_RATE / 1000000);
+    if (step == 0) return;
+    if (step >= std::abs(slewRemaining)) {
+      timeOffset += slewRemaining;
+      slewRemaining = 0;
+      return;
+    }
+    lastSlew += step * 1000000 / TIME_SLEW_RATE;
+    if (slewRemaining < 0) step = -step;
+    timeOffset += step;
+    slewRemaining -= step;
+  }
+};
 
 /**
  * Calculate the time it took to get reply from other node
@@ -61,6 +160,95 @@ inline int32_t tripDelay(uint32_t time0, uint32_t time1, uint32_t time2,
   return ((time3 - time0) - (time2 - time1)) / 2;
 }
 
+/**
+ * \brief Select the best of a burst of time sync exchanges
+ *
+ * A single exchange gives a noisy offset when one of the messages waited in a
+ * queue. The error of an exchange is at most its trip delay, so (like the ntp
+ * clock filter) we do a burst of TIME_SYNC_BURST exchanges and use the offset
+ * of the one with the smallest delay.
+ *
+ * The filter also estimates how fast our clock drifts away from the
+ * neighbour, from the offsets found by consecutive syncs. Stable clocks are
+ * synced less often, see interval().
+ */
+class ClockFilter {
+ public:
+  /**
+   * Estimated drift of our clock relative to the neighbour (in us per s)
+   */
+  double drift = 0;
+
+  /**
+   * Add the result of one exchange
+   *
+   * \return Whether the burst is complete and offset() can be applied
+   */
+  bool add(int64_t offset, int32_t delay) {
+    if (samples == 0 || delay < bestDelay) {
+      bestOffset = offset;
+      bestDelay = delay;
+    }
+    ++samples;
+    return samples >= TIME_SYNC_BURST;
+  }
+
+  /**
+   * The offset of the fastest exchange in the burst
+   */
+  int64_t offset() const { return bestOffset; }
+
+  /**
+   * Start a new burst, after the offset was applied at the given (local) time
+   *
+   * \param synced Whether the clocks were in sync (within TIME_SYNC_ACCURACY)
+   */
+  void applied(int64_t offset, uint32_t now, bool synced) {
+    // Only the offset that built up after a successful sync says something
+    // about the drift, a large step means the clocks were not synced yet
+    if (synced && lastSynced) {
+      auto elapsed = now - lastApplied;
+      if (elapsed > 0) {
+        double sample = 1e6 * offset / (double)elapsed;
+        drift = hasDrift ? drift + 0.5 * (sample - drift) : sample;
+        hasDrift = true;
+      }
+    }
+    lastSynced = synced;
+    lastApplied = now;
+    samples = 0;
+  }
+
+  /**
+   * Time until the next sync (in ms)
+   *
+   * The time it takes for the estimated drift to reach half of
+   * TIME_SYNC_ACCURACY, between TIME_SYNC_INTERVAL and TIME_SYNC_MAX_INTERVAL.
+   */
+  uint32_t interval() const {
+    if (!hasDrift) return TIME_SYNC_INTERVAL;
+    double ms = 1e3 * (TIME_SYNC_ACCURACY / 2) / std::max(fabs(drift), 1e-3);
+    if (ms < TIME_SYNC_INTERVAL) return TIME_SYNC_INTERVAL;
+    if (ms > TIME_SYNC_MAX_INTERVAL) return TIME_SYNC_MAX_INTERVAL;
+    return ms;
+  }
+
+  /**
+   * Drop the current burst, e.g. because its samples are no longer valid
+   */
+  void reset() { samples = 0; }
+
+  size_t size() const { return samples; }
+
+ protected:
+  size_t samples = 0;
+  int64_t bestOffset = 0;
+  int32_t bestDelay = 0;
+  uint32_t lastApplied = 0;
+  bool lastSynced = false;
+  bool hasDrift = false;
+};
+
 inline bool adopt(protocol::NodeTree mesh, protocol::NodeTree connection) {
   auto mySubCount =
       layout::size(layout::excludeRoute(std::move(mesh), connection.nodeId));
@@ -76,7 +264,7 @@ inline bool adopt(protocol::NodeTree mesh, protocol::NodeTree connection) {
 
 template <class T>
 void initTimeSync(protocol::NodeTree mesh, std::shared_ptr<T> connection,
-                  uint32_t nodeTime) {
+                  uint64_t nodeTime) {
   using namespace painlessmesh::logger;
   painlessmesh::protocol::TimeSync timeSync;
   if (adopt(mesh, (*connection))) {
@@ -102,7 +290,8 @@ void handleTimeSync(T& mesh, painlessmesh::protocol::TimeSync timeSync,
       Log(logger::ERROR,
           "handleTimeSync(): Received time sync error. Restarting time "
           "sync.\n");
-      conn->timeSyncTask.forceNextIteration();
+      conn->clockFilter.reset();
+      conn->timeSyncTimer.forceNextIteration();
       break;
     case (painlessmesh::protocol::TIME_SYNC_REQUEST):  // Other party request me
                                                        // to ask it for time
@@ -110,53 +299,91 @@ void handleTimeSync(T& mesh, painlessmesh::protocol::TimeSync timeSync,
           "handleTimeSync(): Received requesto to start TimeSync with "
           "node: %u\n",
           conn->nodeId);
-      timeSync.reply(mesh.getNodeTime());
+      if (conn->features & protocol::TIME64)
+        timeSync.reply(mesh.getNodeTime64());
+      else
+        timeSync.reply(mesh.getNodeTime());
       router::send<painlessmesh::protocol::TimeSync>(timeSync, conn, true);
       break;
 
     case (painlessmesh::protocol::TIME_REQUEST):
-      timeSync.reply(receivedAt, mesh.getNodeTime());
+      if (conn->features & protocol::TIME64)
+        timeSync.reply(mesh.toNodeTime64(receivedAt), mesh.getNodeTime64());
+      else
+        timeSync.reply(receivedAt, mesh.getNodeTime());
       router::send<painlessmesh::protocol::TimeSync>(timeSync, conn, true);
 
       Log(logger::S_TIME,
           "handleTimeSync(): timeSyncStatus with %u completed\n", conn->nodeId);
 
       // After response is sent I assume sync is completed
-      conn->timeSyncTask.delay(TIME_SYNC_INTERVAL);
+      conn->timeSyncTimer.delay(TIME_SYNC_INTERVAL);
       break;
 
     case (painlessmesh::protocol::TIME_REPLY): {
       Log(logger::S_TIME,
           "handleTimeSync(): %u adopting TIME_RESPONSE from %u\n", mesh.nodeId,
           conn->nodeId);
-      int32_t offset = painlessmesh::ntp::clockOffset(
-          timeSync.msg.t0, timeSync.msg.t1, timeSync.msg.t2, receivedAt);
-      mesh.timeOffset += offset;  // Accumulate offset
+      auto& filter = conn->clockFilter;
+      auto& msg = timeSync.msg;
+      int32_t delay;
+      int64_t offset;
+      if (conn->features & protocol::TIME64) {
+        auto t3 = mesh.toNodeTime64(receivedAt);
+        delay = ((int64_t)(t3 - msg.t0) - (int64_t)(msg.t2 - msg.t1)) / 2;
+        offset = (int64_t)(msg.t1 - msg.t0) / 2 + (int64_t)(msg.t2 - t3) / 2;
+      } else {
+        delay = painlessmesh::ntp::tripDelay(msg.t0, msg.t1, msg.t2, receivedAt);
+        offset = ((int32_t)(msg.t1 - msg.t0) / 2) +
+                 ((int32_t)(msg.t2 - receivedAt) / 2);
+      }
+      if (delay < 0 || delay > TIME_SYNC_MAX_DELAY) {
+        // Our clock changed during the exchange, or it was stuck in a queue
+        Log(logger::S_TIME, "handleTimeSync(): ignoring exchange, delay %d\n",
+            delay);
+        conn->timeSyncTimer.delay(200 * TASK_MILLISECOND);
+        break;
+      }
+      if (!filter.add(offset, delay)) {
+        // Next exchange of the burst
+        conn->timeSyncTimer.forceNextIteration();
+        break;
+      }
+      offset = filter.offset();
+      // Small offsets might be slewed in, the next sync measures what is left
+      bool slewed = mesh.adjustTime(offset);
 
       // flag all connections for re-timeSync
       if (mesh.nodeTimeAdjustedCallback) {
         mesh.nodeTimeAdjustedCallback(offset);
       }
 
-      if (offset < TIME_SYNC_ACCURACY && offset > -TIME_SYNC_ACCURACY) {
-        // mark complete only if offset was less than 10 ms
-        conn->timeSyncTask.delay(TIME_SYNC_INTERVAL);
+      bool synced = offset < TIME_SYNC_ACCURACY && offset > -TIME_SYNC_ACCURACY;
+      filter.applied(offset, micros(), synced);
+      if (synced || slewed) {
+        // mark complete only if offset was less than 5 ms, or is being slewed
+        // in (the next sync corrects what is left)
+        conn->timeSyncTimer.delay(synced ? filter.interval()
+                                         : TIME_SYNC_INTERVAL);
         Log(logger::S_TIME,
-            "handleTimeSync(): timeSyncStatus with %u completed\n",
-            conn->nodeId);
+            "handleTimeSync(): timeSyncStatus with %u completed, drift %d "
+            "us/s\n",
+            conn->nodeId, (int)filter.drift);
 
         // Time has changed, update other nodes
-        for (auto&& connection : mesh.subs) {
-          if (connection->nodeId != conn->nodeId) {  // exclude this connection
-            connection->timeSyncTask.forceNextIteration();
-            Log(logger::S_TIME,
-                "handleTimeSync(): timeSyncStatus with %u brought forward\n",
-                connection->nodeId);
+        if (synced) {
+          for (auto&& connection : mesh.subs) {
+            if (connection->nodeId != conn->nodeId) {  // exclude this one
+              connection->timeSyncTimer.forceNextIteration();
+              Log(logger::S_TIME,
+                  "handleTimeSync(): timeSyncStatus with %u brought forward\n",
+                  connection->nodeId);
+            }
           }
         }
       } else {
         // Iterate sync procedure if accuracy was not enough
-        conn->timeSyncTask.delay(200 * TASK_MILLISECOND);  // Small delay
+        conn->timeSyncTimer.delay(200 * TASK_MILLISECOND);  // Small delay
         Log(logger::S_TIME,
             "handleTimeSync(): timeSyncStatus with %u needs further tries\n",
             conn->nodeId);
@@ -220,7 +447,7 @@ callback::MeshPackageCallbackList<U> addPackageCallback(
   // TimeSync
   callbackList.onPackage(
       protocol::TIME_SYNC,
-      [&mesh](protocol::Variant variant, std::shared_ptr<U> connection,
+      [&mesh](protocol::Variant& variant, std::shared_ptr<U> connection,
               uint32_t receivedAt) {
         auto timeSync = variant.to<protocol::TimeSync>();
         handleTimeSync<T, U>(mesh, timeSync, connection, receivedAt);
@@ -230,7 +457,7 @@ callback::MeshPackageCallbackList<U> addPackageCallback(
   // TimeDelay
   callbackList.onPackage(
       protocol::TIME_DELAY,
-      [&mesh](protocol::Variant variant, std::shared_ptr<U> connection,
+      [&mesh](protocol::Variant& variant, std::shared_ptr<U> connection,
               uint32_t receivedAt) {
         auto timeDelay = variant.to<protocol::TimeDelay>();
         handleTimeDelay<T, U>(mesh, timeDelay, connection, receivedAt);
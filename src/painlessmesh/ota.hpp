@@ -1,10 +1,17 @@
 #ifndef _PAINLESS_MESH_PLUGIN_OTA_HPP_
 #define _PAINLESS_MESH_PLUGIN_OTA_HPP_
 
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+
 #include "painlessmesh/configuration.hpp"
 
 #include "painlessmesh/base64.hpp"
+#include "painlessmesh/binary.hpp"
 #include "painlessmesh/logger.hpp"
+#include "painlessmesh/md5.hpp"
 #include "painlessmesh/plugin.hpp"
 
 #if defined(ESP32) || defined(ESP8266)
@@ -16,6 +23,42 @@
 #endif
 #endif
 
+#ifndef OTA_WINDOW_SIZE
+#define OTA_WINDOW_SIZE 4  // Number of parts that are requested at the same time
+#endif
+
+#ifndef OTA_BUFFER_SIZE
+#define OTA_BUFFER_SIZE 8192  // Memory for parts that arrive out of order
+#endif
+
+#ifndef OTA_REQUEST_TIMEOUT
+#define OTA_REQUEST_TIMEOUT 30 * TASK_SECOND  // Request a part again after this
+#endif
+
+#ifndef OTA_MULTICAST_DELAY
+#define OTA_MULTICAST_DELAY 100  // Time (ms) to collect requests for a part
+#endif
+
+#ifndef OTA_CACHE_SIZE
+#define OTA_CACHE_SIZE 4096  // Memory for parts kept to answer other nodes
+#endif
+
+#ifndef OTA_PART_SIZE
+#define OTA_PART_SIZE 1024  // Size of the parts a distributed image is split in
+#endif
+
+#ifndef OTA_ANNOUNCE_INTERVAL
+#define OTA_ANNOUNCE_INTERVAL 60 * TASK_SECOND  // Repeat the announce this often
+#endif
+
+#ifndef OTA_CHECKPOINT_PARTS
+#define OTA_CHECKPOINT_PARTS 16  // Save the progress after this many parts
+#endif
+
+#ifndef OTA_MAX_TRIES
+#define OTA_MAX_TRIES 10  // Give up if a part does not arrive after this many
+#endif
+
 namespace painlessmesh {
 namespace plugin {
 
@@ -41,6 +84,23 @@ namespace plugin {
  * the node (with a data message). The node will then write this data and
  * request the next part of the data. This exchange continuous until the node
  * has all the data, written it and reboots into the new firmware.
+ *
+ * To hide the round trip to the distribution node, a number of parts is
+ * requested at the same time (see ota::Window).
+ *
+ * When a number of nodes update at the same time, the distribution node can
+ * broadcast parts that more than one node needs (see ota::Distributor).
+ *
+ * The firmware is stored in a file until it is complete and its MD5 checks
+ * out. An update that is interrupted, by a reboot or by losing the connection
+ * to the distribution node, continues where it stopped (see ota::Progress).
+ *
+ * Nodes also keep the last parts they relayed or received, and answer requests
+ * for them that pass through (see ota::Cache).
+ *
+ * Nodes ask for the data to be send as escaped raw bytes (see ota::Encoding).
+ * Distribution nodes that do not know this send base64 instead, which is
+ * still supported.
  */
 namespace ota {
 
@@ -79,27 +139,24 @@ class Announce : public BroadcastPackage {
 
   Announce() : BroadcastPackage(10) {}
 
-  Announce(JsonObject jsonObj) : BroadcastPackage(jsonObj) {
-    md5 = jsonObj["md5"].as<TSTRING>();
-    hardware = jsonObj["hardware"].as<TSTRING>();
-    role = jsonObj["role"].as<TSTRING>();
-    if (jsonObj.containsKey("forced")) forced = jsonObj["forced"];
-    noPart = jsonObj["noPart"];
+  Announce(JsonObject jsonObj) : BroadcastPackage(10) {
+    schema::read(*this, jsonObj);
   }
 
   JsonObject addTo(JsonObject&& jsonObj) const {
-    jsonObj = BroadcastPackage::addTo(std::move(jsonObj));
-    jsonObj["md5"] = md5;
-    jsonObj["hardware"] = hardware;
-    jsonObj["role"] = role;
-    if (forced) jsonObj["forced"] = forced;
-    jsonObj["noPart"] = noPart;
-    return jsonObj;
+    return schema::write(*this, std::move(jsonObj));
   }
 
-  size_t jsonObjectSize() const {
-    return JSON_OBJECT_SIZE(noJsonFields + 5) +
-           round(1.1 * (md5.length() + hardware.length() + role.length()));
+  size_t jsonObjectSize() const { return schema::jsonObjectSize(*this); }
+
+  template <class V>
+  void visit(V& v) {
+    BroadcastPackage::visit(v);
+    v("md5", md5);
+    v("hardware", hardware);
+    v("role", role);
+    v.optional("forced", forced);
+    v("noPart", noPart);
   }
 
  protected:
@@ -110,6 +167,13 @@ class Announce : public BroadcastPackage {
 
 class Data;
 
+/** How the firmware is encoded in ota::Data::data
+ */
+enum Encoding {
+  BASE64 = 0,  // Understood by all nodes, but a third larger than the data
+  ESCAPED = 1  // The raw bytes with zeros escaped, see binary::escape()
+};
+
 /** Request (part of) the firmware update
  *
  * This is send by the node needing the new firmware, to the firmware
@@ -122,18 +186,30 @@ class DataRequest : public Announce {
   size_t partNo = 0;
   uint32_t dest = 0;
 
+  /**
+   * The encoding the node can read. Older nodes leave this out, so they get
+   * base64.
+   */
+  Encoding encoding = BASE64;
+
   DataRequest() : Announce(11, router::SINGLE) {}
 
-  DataRequest(JsonObject jsonObj) : Announce(jsonObj) {
-    dest = jsonObj["dest"];
-    partNo = jsonObj["partNo"];
+  DataRequest(JsonObject jsonObj) : Announce(11, router::SINGLE) {
+    schema::read(*this, jsonObj);
   }
 
   JsonObject addTo(JsonObject&& jsonObj) const {
-    jsonObj = Announce::addTo(std::move(jsonObj));
-    jsonObj["dest"] = dest;
-    jsonObj["partNo"] = partNo;
-    return jsonObj;
+    return schema::write(*this, std::move(jsonObj));
+  }
+
+  size_t jsonObjectSize() const { return schema::jsonObjectSize(*this); }
+
+  template <class V>
+  void visit(V& v) {
+    Announce::visit(v);
+    v("dest", dest);
+    v("partNo", partNo);
+    v.optional("encoding", encoding);
   }
 
   static DataRequest replyTo(const Announce& ann, uint32_t from,
@@ -147,21 +223,26 @@ class DataRequest : public Announce {
     req.noPart = ann.noPart;
     req.partNo = partNo;
     req.from = from;
+    req.encoding = ESCAPED;
     return req;
   }
 
+  /**
+   * Request another part from the node that sent the data
+   *
+   * Only valid for data that the distribution node sent to this node. Data
+   * that was broadcast or answered by a cache has no usable dest or from, use
+   * the request made from the announce instead.
+   */
   static DataRequest replyTo(const Data& d, size_t partNo);
 
-  size_t jsonObjectSize() const {
-    return JSON_OBJECT_SIZE(noJsonFields + 5 + 2) +
-           round(1.1 * (md5.length() + hardware.length() + role.length()));
-  }
-
  protected:
   DataRequest(int type) : Announce(type, router::SINGLE) {}
 };
 
 /** Package containing part of the firmware
+ *
+ * The data is encoded as given by encoding, use bytes() to get the firmware.
  *
  * The package type/identifier is set to 12.
  */
@@ -171,16 +252,56 @@ class Data : public DataRequest {
 
   Data() : DataRequest(12) {}
 
-  Data(JsonObject jsonObj) : DataRequest(jsonObj) {
-    data = jsonObj["data"].as<TSTRING>();
-  }
+  Data(JsonObject jsonObj) : DataRequest(12) { schema::read(*this, jsonObj); }
 
   JsonObject addTo(JsonObject&& jsonObj) const {
-    jsonObj = DataRequest::addTo(std::move(jsonObj));
-    jsonObj["data"] = data;
-    return jsonObj;
+    return schema::write(*this, std::move(jsonObj));
+  }
+
+  size_t jsonObjectSize() const { return schema::jsonObjectSize(*this); }
+
+  template <class V>
+  void visit(V& v) {
+    DataRequest::visit(v);
+    v("data", data);
+  }
+
+  /**
+   * Take the firmware bytes out of the package
+   *
+   * Escaped data is decoded in place, so the bytes are not copied again.
+   */
+  TSTRING bytes() {
+    if (encoding == BASE64) return base64::decode(data);
+    auto length = binary::unescape(&data[0], data.length());
+#if defined(ESP32) || defined(ESP8266)
+    data.remove(length);
+#else
+    data.resize(length);
+#endif
+    return std::move(data);
+  }
+
+  /**
+   * Reply to a request with the given firmware bytes, encoded as the
+   * requesting node prefers
+   */
+  static Data replyTo(const DataRequest& req, const char* bytes, size_t length,
+                      size_t partNo) {
+    Data d;
+    if (req.encoding == ESCAPED) {
+      binary::escape(bytes, length, d.data);
+    } else {
+      d.data = base64::encode((unsigned char const*)bytes, length);
+    }
+    d = replyTo(req, std::move(d.data), partNo);
+    d.encoding = req.encoding;
+    return d;
   }
 
+  /**
+   * Reply to a request with data that is already base64 encoded
+   */
   static Data replyTo(const DataRequest& req, TSTRING data, size_t partNo) {
     Data d;
     d.from = req.dest;
@@ -194,12 +315,6 @@ class Data : public DataRequest {
     d.data = data;
     return d;
   }
-
-  size_t jsonObjectSize() const {
-    return JSON_OBJECT_SIZE(noJsonFields + 5 + 2 + 1) +
-           round(1.1 * (md5.length() + hardware.length() + role.length() +
-                        data.length()));
-  }
 };
 
 inline DataRequest DataRequest::replyTo(const Data& d, size_t partNo) {
@@ -212,9 +327,368 @@ inline DataRequest DataRequest::replyTo(const Data& d, size_t partNo) {
   req.forced = d.forced;
   req.noPart = d.noPart;
   req.partNo = partNo;
+  req.encoding = ESCAPED;
   return req;
 }
 
+/**
+ * \brief The parts of an update that are requested, buffered and written
+ *
+ * Requesting one part and waiting for it before requesting the next means
+ * every part costs a full round trip to the distribution node, which adds up
+ * over a couple of hops. Instead a sliding window of up to OTA_WINDOW_SIZE
+ * parts is requested at the same time.
+ *
+ * Parts have to be written in order. Parts that arrive early are buffered, and
+ * the window shrinks so that the buffered parts fit in OTA_BUFFER_SIZE bytes.
+ * Only parts that are lost are requested again: a part is considered lost when
+ * a part requested after it arrives first, or when it did not arrive within
+ * OTA_REQUEST_TIMEOUT.
+ *
+ * Parts that are broadcast by the distribution node (see ota::Distributor) are
+ * used as well, even if they were not requested, as long as they fall within
+ * the window. They are not requested anymore.
+ */
+class Window {
+ public:
+  Window(size_t noPart, size_t size = OTA_WINDOW_SIZE,
+         size_t bufferSize = OTA_BUFFER_SIZE)
+      : noPart(noPart), size(std::max(size, (size_t)1)), bufferSize(bufferSize) {}
+
+  /**
+   * Parts to request now, i.e. new parts that fit in the window and parts that
+   * need to be requested again
+   */
+  std::vector<size_t> requests(uint32_t now) {
+    std::vector<size_t> parts;
+    if (!started) {
+      start = now;
+      started = true;
+    }
+    for (auto&& pair : outstanding) {
+      auto& req = pair.second;
+      if (req.lost || now - req.time >= OTA_REQUEST_TIMEOUT) {
+        if (++req.tries > OTA_MAX_TRIES) {
+          hasFailed = true;
+          return {};
+        }
+        req.lost = false;
+        req.time = now;
+        req.seq = ++seq;
+        parts.push_back(pair.first);
+      }
+    }
+    nextRequest = std::max(nextRequest, nextPart);
+    while (nextRequest < noPart && nextRequest < nextPart + limit()) {
+      if (buffer.count(nextRequest) == 0) {
+        outstanding[nextRequest] = {now, ++seq, 1, false};
+        parts.push_back(nextRequest);
+      }
+      ++nextRequest;
+    }
+    return parts;
+  }
+
+  /**
+   * Add a part that was received
+   *
+   * \param broadcast Whether the part was broadcast, instead of send in reply
+   * to our request
+   *
+   * \return Whether the part was accepted. Duplicates and parts that do not
+   * fit in the buffer are ignored.
+   */
+  bool add(size_t partNo, TSTRING data, bool broadcast = false) {
+    auto it = outstanding.find(partNo);
+    if (it == outstanding.end() &&
+        (!broadcast || partNo < nextPart || partNo >= noPart ||
+         partNo >= nextPart + limit() || buffer.count(partNo) > 0))
+      return false;
+    maxPartSize = std::max(maxPartSize, (size_t)data.length());
+    if (partNo != nextPart && buffered + data.length() > bufferSize)
+      // Will be requested again after the time out
+      return false;
+    if (it != outstanding.end()) {
+      // Replies arrive in the order of the requests, unless they are lost.
+      // Broadcasts answer requests of other nodes, so they say nothing about
+      // the order
+      if (!broadcast) {
+        for (auto&& pair : outstanding) {
+          if (pair.second.seq < it->second.seq) pair.second.lost = true;
+        }
+      }
+      outstanding.erase(it);
+    }
+    buffered += data.length();
+    buffer[partNo] = std::move(data);
+    return true;
+  }
+
+  /**
+   * Whether the next part to write has arrived
+   */
+  bool available() const { return buffer.count(nextPart) > 0; }
+
+  /**
+   * Take the next part to write, only valid if available()
+   */
+  TSTRING take() {
+    auto it = buffer.find(nextPart);
+    auto data = std::move(it->second);
+    buffer.erase(it);
+    buffered -= data.length();
+    written += data.length();
+    ++nextPart;
+    return data;
+  }
+
+  /**
+   * Continue an interrupted update at the given part, call this before the
+   * first request
+   */
+  void resume(size_t partNo) {
+    nextPart = std::min(partNo, noPart);
+    nextRequest = nextPart;
+  }
+
+  /**
+   * The next part to write
+   */
+  size_t partNo() const { return nextPart; }
+
+  bool complete() const { return nextPart >= noPart; }
+
+  /**
+   * Whether a part was requested OTA_MAX_TRIES times without success
+   */
+  bool failed() const { return hasFailed; }
+
+  /**
+   * Bytes written per second since the first request
+   */
+  uint32_t throughput(uint32_t now) const {
+    if (now == start) return 0;
+    return 1000.0 * written / (now - start);
+  }
+
+  size_t bytesWritten() const { return written; }
+
+  /**
+   * Memory used by parts that are waiting to be written
+   */
+  size_t bufferedBytes() const { return buffered; }
+
+  /**
+   * Number of parts that are requested, but did not arrive yet
+   */
+  size_t inFlight() const { return outstanding.size(); }
+
+ protected:
+  struct request_t {
+    uint32_t time;
+    uint32_t seq;
+    size_t tries;
+    bool lost;
+  };
+
+  size_t noPart;
+  size_t size;
+  size_t bufferSize;
+  size_t nextPart = 0;
+  size_t nextRequest = 0;
+  size_t maxPartSize = 0;
+  size_t buffered = 0;
+  size_t written = 0;
+  uint32_t seq = 0;
+  uint32_t start = 0;
+  bool started = false;
+  bool hasFailed = false;
+  std::map<size_t, request_t> outstanding;
+  std::map<size_t, TSTRING> buffer;
+
+  /**
+   * Number of parts after nextPart that can be requested
+   */
+  size_t limit() const {
+    if (maxPartSize == 0) return size;
+    // nextPart itself is written right away, the others need to be buffered
+    return std::min(size, 1 + bufferSize / maxPartSize);
+  }
+};
+
+/**
+ * \brief Decide how to serve the parts that nodes request
+ *
+ * Without coordination every node that updates requests every part, and the
+ * same part travels over the links near the distribution node once for each
+ * node. The distributor tracks which nodes are updating and which parts they
+ * requested. Requests for the same part within OTA_MULTICAST_DELAY are
+ * combined, and a part that more than one node needs (either because they
+ * requested it, or because they have not reached it yet) is broadcast once.
+ * Nodes that are behind pick up broadcast parts (see ota::Window) and only
+ * request the gaps.
+ *
+ * Nodes that did not send a request for OTA_REQUEST_TIMEOUT are considered
+ * done.
+ */
+class Distributor {
+ public:
+  struct send_t {
+    size_t partNo;
+    uint32_t dest;  // Zero to broadcast
+    Encoding encoding;
+  };
+
+  /**
+   * Number of parts that were broadcast and send to a single node
+   */
+  size_t broadcasts = 0;
+  size_t unicasts = 0;
+
+  void add(const DataRequest& req, uint32_t now) {
+    auto& node = nodes[req.from];
+    node.lastSeen = now;
+    node.encoding = req.encoding;
+    node.partNo = req.partNo;
+    auto& part = pending[req.partNo];
+    if (part.nodes.empty()) part.since = now;
+    part.nodes.insert(req.from);
+  }
+
+  /**
+   * The parts that should be send now
+   */
+  std::vector<send_t> due(uint32_t now) {
+    for (auto it = nodes.begin(); it != nodes.end();) {
+      if (now - it->second.lastSeen >= OTA_REQUEST_TIMEOUT)
+        it = nodes.erase(it);
+      else
+        ++it;
+    }
+    std::vector<send_t> sends;
+    bool shared = nodes.size() > 1;
+    for (auto it = pending.begin(); it != pending.end();) {
+      auto& part = it->second;
+      // Only wait for more requests if there are other nodes to send them
+      if (shared && now - part.since < OTA_MULTICAST_DELAY) {
+        ++it;
+        continue;
+      }
+      if (part.nodes.size() > 1 || (shared && behind(it->first, part.nodes))) {
+        sends.push_back({it->first, 0, encoding()});
+        ++broadcasts;
+      } else {
+        for (auto&& nodeId : part.nodes) {
+          auto node = nodes.find(nodeId);
+          sends.push_back({it->first, nodeId,
+                           node == nodes.end() ? BASE64 : node->second.encoding});
+          ++unicasts;
+        }
+      }
+      it = pending.erase(it);
+    }
+    return sends;
+  }
+
+  /**
+   * Number of nodes that are updating
+   */
+  size_t requesters() const { return nodes.size(); }
+
+ protected:
+  struct node_t {
+    uint32_t lastSeen;
+    size_t partNo;
+    Encoding encoding;
+  };
+
+  struct part_t {
+    uint32_t since;
+    std::set<uint32_t> nodes;
+  };
+
+  std::map<uint32_t, node_t> nodes;
+  std::map<size_t, part_t> pending;
+
+  /**
+   * Whether another node still has to reach this part
+   */
+  bool behind(size_t partNo, const std::set<uint32_t>& requested) const {
+    for (auto&& pair : nodes) {
+      if (pair.second.partNo < partNo && requested.count(pair.first) == 0)
+        return true;
+    }
+    return false;
+  }
+
+  /**
+   * Broadcasts have to be readable by all nodes
+   */
+  Encoding encoding() const {
+    for (auto&& pair : nodes) {
+      if (pair.second.encoding != ESCAPED) return BASE64;
+    }
+    return ESCAPED;
+  }
+};
+
+/**
+ * \brief The most recent parts seen by this node
+ *
+ * When many nodes update, their requests travel the same path to the
+ * distribution node. A node on that path that recently relayed (or received) a
+ * part can answer a request for it directly, so the request and data only
+ * travel the last hops. Parts are kept up to a total of OTA_CACHE_SIZE bytes,
+ * the oldest part is dropped first.
+ */
+class Cache {
+ public:
+  /**
+   * Number of requests answered from the cache
+   */
+  size_t hits = 0;
+
+  Cache(size_t capacity = OTA_CACHE_SIZE) : capacity(capacity) {}
+
+  void add(const TSTRING& md5, size_t partNo, TSTRING bytes) {
+    if (bytes.length() > capacity || find(md5, partNo)) return;
+    while (used + bytes.length() > capacity) {
+      used -= parts.front().bytes.length();
+      parts.pop_front();
+    }
+    used += bytes.length();
+    parts.push_back({md5, partNo, std::move(bytes)});
+  }
+
+  /**
+   * The bytes of the part, or NULL if it is not in the cache
+   */
+  const TSTRING* find(const TSTRING& md5, size_t partNo) const {
+    for (auto&& part : parts) {
+      if (part.partNo == partNo && part.md5 == md5) return &part.bytes;
+    }
+    return NULL;
+  }
+
+  size_t size() const { return parts.size(); }
+
+  /**
+   * Memory used by the cached parts
+   */
+  size_t bytes() const { return used; }
+
+ protected:
+  struct part_t {
+    TSTRING md5;
+    size_t partNo;
+    TSTRING bytes;
+  };
+
+  size_t capacity;
+  size_t used = 0;
+  std::list<part_t> parts;
+};
+
 /** Data related to the current state of the node update
  *
  * This class is used by the OTA algorithm to keep track of both the current
@@ -237,11 +711,7 @@ class State : public protocol::PackageInterface {
 
   State() {}
 
-  State(JsonObject jsonObj) {
-    md5 = jsonObj["md5"].as<TSTRING>();
-    hardware = jsonObj["hardware"].as<TSTRING>();
-    role = jsonObj["role"].as<TSTRING>();
-  }
+  State(JsonObject jsonObj) { schema::read(*this, jsonObj); }
 
   State(const Announce& ann) {
     md5 = ann.md5;
@@ -251,151 +721,798 @@ class State : public protocol::PackageInterface {
   }
 
   JsonObject addTo(JsonObject&& jsonObj) const {
-    jsonObj["role"] = role;
-    jsonObj["md5"] = md5;
-    jsonObj["hardware"] = hardware;
-    return jsonObj;
+    return schema::write(*this, std::move(jsonObj));
   }
 
-  size_t jsonObjectSize() const {
-    return JSON_OBJECT_SIZE(3) +
-           round(1.1 * (md5.length() + hardware.length() + role.length()));
+  size_t jsonObjectSize() const { return schema::jsonObjectSize(*this); }
+
+  /**
+   * Only the firmware version is stored, the progress of an update is stored
+   * separately (see ota::Progress)
+   */
+  template <class V>
+  void visit(V& v) {
+    v("role", role);
+    v("md5", md5);
+    v("hardware", hardware);
   }
 
   std::shared_ptr<Task> task;
+  std::shared_ptr<Window> window;
+};
+
+/**
+ * \brief Progress of an update, saved so it can continue after a reboot
+ *
+ * Parts are hashed as they are written, so the image can be checked against
+ * the announced MD5 without reading it again. Every OTA_CHECKPOINT_PARTS parts
+ * the progress, including the state of the hash, is saved by the ota::Sink.
+ * After a reboot or a lost connection the update continues at the last saved
+ * part.
+ */
+class Progress : public protocol::PackageInterface {
+ public:
+  TSTRING md5;
+  TSTRING hardware;
+  TSTRING role;
+  size_t noPart = 0;
+  /**
+   * The next part to write
+   */
+  size_t partNo = 0;
+  /**
+   * Bytes written so far
+   */
+  size_t bytes = 0;
+  /**
+   * The saved state of the hash, see md5::Context::save()
+   */
+  TSTRING hash;
+
+  Progress() {}
+
+  Progress(const Announce& ann) {
+    md5 = ann.md5;
+    hardware = ann.hardware;
+    role = ann.role;
+    noPart = ann.noPart;
+  }
+
+  /**
+   * Read saved progress, check valid() before using it
+   */
+  Progress(JsonObject jsonObj) {
+    schema::read(*this, jsonObj);
+    if (!context.restore(hash) || context.size() != bytes) {
+      partNo = 0;
+      bytes = 0;
+      hash = "";
+      context.reset();
+    }
+  }
+
+  JsonObject addTo(JsonObject&& jsonObj) const {
+    return schema::write(*this, std::move(jsonObj));
+  }
+
+  size_t jsonObjectSize() const { return schema::jsonObjectSize(*this); }
+
+  template <class V>
+  void visit(V& v) {
+    v("md5", md5);
+    v("hardware", hardware);
+    v("role", role);
+    v("noPart", noPart);
+    v("partNo", partNo);
+    v("bytes", bytes);
+    v("hash", hash);
+  }
+
+  /**
+   * Whether there is anything to continue from
+   */
+  bool valid() const { return md5.length() > 0 && partNo > 0; }
+
+  /**
+   * Add the next part that was written
+   *
+   * \return Whether the progress should be saved now
+   */
+  bool add(const TSTRING& data) {
+    context.update(data);
+    bytes += data.length();
+    ++partNo;
+    if (partNo % OTA_CHECKPOINT_PARTS != 0 && !complete()) return false;
+    hash = context.save();
+    return true;
+  }
+
+  bool complete() const { return noPart > 0 && partNo >= noPart; }
+
+  /**
+   * Whether the written data matches the announced MD5
+   */
+  bool verify() const {
+    auto digest = context.hexdigest();
+    if (digest.length() != md5.length()) return false;
+    for (size_t i = 0; i < md5.length(); ++i) {
+      if (tolower(md5[i]) != digest[i]) return false;
+    }
+    return true;
+  }
+
+ protected:
+  md5::Context context;
+};
+
+/**
+ * \brief Where a node writes the firmware it receives
+ *
+ * The sink decides where the image is stored and how it is installed, the
+ * rest of the update (see addUpdater()) is the same on every platform. See
+ * ota::MemorySink, ota::FileSink, ota::UpdateSink and ota::ResumableSink.
+ */
+class Sink {
+ public:
+  virtual ~Sink() {}
+
+  /**
+   * The saved progress of an interrupted update, if the sink keeps it
+   */
+  virtual Progress load() { return Progress(); }
+
+  /**
+   * Start a new image, or continue one after progress.bytes bytes
+   *
+   * \return false if the image can not be started or continued
+   */
+  virtual bool begin(const Progress& progress) = 0;
+
+  virtual bool write(const char* data, size_t length) = 0;
+
+  /**
+   * Save the progress, called every OTA_CHECKPOINT_PARTS parts
+   */
+  virtual void save(const Progress& progress) {}
+
+  /**
+   * Install the image, called once all parts are written and the MD5 matches
+   */
+  virtual bool end(const Progress& progress) = 0;
+
+  /**
+   * Throw away the image and the saved progress
+   */
+  virtual void discard() {}
 };
 
+/**
+ * \brief Keep the firmware in memory
+ *
+ * Mainly useful to simulate updates on the host, where the firmware is not
+ * installed. The saved progress survives as long as the sink, so a new updater
+ * with the same sink behaves like a node after a reboot.
+ */
+class MemorySink : public Sink {
+ public:
+  std::string image;
+  Progress saved;
+
+  /**
+   * Called with the complete image
+   */
+  std::function<bool(const std::string& image)> onEnd;
+
+  Progress load() { return saved; }
+
+  bool begin(const Progress& progress) {
+    if (progress.bytes > image.length()) return false;
+    image.resize(progress.bytes);
+    return true;
+  }
+
+  bool write(const char* data, size_t length) {
+    image.append(data, length);
+    return true;
+  }
+
+  void save(const Progress& progress) { saved = progress; }
+
+  bool end(const Progress& progress) {
+    if (onEnd) return onEnd(image);
+    return true;
+  }
+
+  void discard() {
+    image.clear();
+    saved = Progress();
+  }
+};
+
+/**
+ * Send the requests for the parts the window wants now
+ */
 template <class T>
-void addPackageCallback(Scheduler& scheduler, plugin::PackageHandler<T>& mesh,
-                        TSTRING role = "") {
-  using namespace logger;
+void requestParts(plugin::PackageHandler<T>& mesh, DataRequest request,
+                  Window& window, uint32_t now) {
+  for (auto&& partNo : window.requests(now)) {
+    request.partNo = partNo;
+    mesh.sendPackage(&request);
+  }
+}
+
+/**
+ * Serve a firmware to the nodes that request it
+ *
+ * Parts are broadcast when more than one node needs them, see
+ * ota::Distributor. The announce still has to be send by the caller.
+ *
+ * \param readPart Returns the raw bytes of the given part
+ */
+template <class T>
+std::shared_ptr<Distributor> addDistributor(
+    Scheduler& scheduler, plugin::PackageHandler<T>& mesh, Announce announce,
+    std::function<TSTRING(size_t partNo)> readPart) {
+  auto distributor = std::make_shared<Distributor>();
+  announce.from = mesh.getNodeId();
+  mesh.addTask(
+      scheduler, OTA_MULTICAST_DELAY, TASK_FOREVER,
+      [distributor, announce, readPart, &mesh]() {
+        for (auto&& send : distributor->due(millis())) {
+          auto request = DataRequest::replyTo(announce, send.dest, send.partNo);
+          request.encoding = send.encoding;
+          auto bytes = readPart(send.partNo);
+          auto data = Data::replyTo(request, bytes.c_str(), bytes.length(),
+                                    send.partNo);
+          if (send.dest == 0) data.routing = router::BROADCAST;
+          mesh.sendPackage(&data);
+        }
+      });
+  mesh.onPackage(11, [distributor, announce](protocol::Variant& variant) {
+    auto request = variant.to<DataRequest>();
+    if (request.md5 == announce.md5) distributor->add(request, millis());
+    return false;
+  });
+  return distributor;
+}
+
+/**
+ * Announce and serve a firmware image that is held in memory
+ *
+ * The md5, number of parts and sender of the announce are filled in from the
+ * image. The announce is repeated every interval, so nodes that join later
+ * update as well.
+ */
+template <class T>
+std::shared_ptr<Distributor> addDistributor(
+    Scheduler& scheduler, plugin::PackageHandler<T>& mesh, Announce announce,
+    std::shared_ptr<const TSTRING> image, size_t partSize = OTA_PART_SIZE,
+    uint32_t interval = OTA_ANNOUNCE_INTERVAL) {
+  md5::Context context;
+  context.update(*image);
+  announce.md5 = context.hexdigest();
+  announce.noPart = (image->length() + partSize - 1) / partSize;
+  announce.from = mesh.getNodeId();
+  auto distributor =
+      addDistributor(scheduler, mesh, announce, [image, partSize](size_t partNo) {
 #if defined(ESP32) || defined(ESP8266)
-  auto currentFW = std::make_shared<State>();
-  currentFW->role = role;
-  auto updateFW = std::make_shared<State>();
-  updateFW->role = role;
-#ifdef ESP32
-  SPIFFS.begin(true);  // Start the SPI Flash Files System
+        return image->substring(partNo * partSize, (partNo + 1) * partSize);
 #else
-  SPIFFS.begin();  // Start the SPI Flash Files System
+        return image->substr(partNo * partSize, partSize);
 #endif
-  if (SPIFFS.exists(currentFW->ota_fn)) {
-    auto file = SPIFFS.open(currentFW->ota_fn, "r");
-    TSTRING msg = "";
-    while (file.available()) {
-      msg += (char)file.read();
-    }
-    auto var = protocol::Variant(msg);
-    auto fw = var.to<State>();
-    if (fw.role == role && fw.hardware == currentFW->hardware) {
-      Log(DEBUG, "MD5 found %s\n", fw.md5.c_str());
-      currentFW->md5 = fw.md5;
+      });
+  mesh.addTask(scheduler, interval, TASK_FOREVER,
+               [announce, &mesh]() { mesh.sendPackage(&announce); });
+  return distributor;
+}
+
+/**
+ * Keep the parts that this node sees and answer requests for them that pass
+ * through, see ota::Cache
+ *
+ * OTA data and requests that pass through are parsed for this, instead of
+ * being send on using only their header.
+ */
+template <class T>
+std::shared_ptr<Cache> addCache(plugin::PackageHandler<T>& mesh,
+                                size_t capacity = OTA_CACHE_SIZE) {
+  auto cache = std::make_shared<Cache>(capacity);
+  auto store = [cache](protocol::Variant& variant) {
+    auto pkg = variant.to<Data>();
+    cache->add(pkg.md5, pkg.partNo, pkg.bytes());
+    // Still send it on
+    return false;
+  };
+  mesh.onRelay(12, store);
+  mesh.onPackage(12, store);
+  mesh.onRelay(11, [cache, &mesh](protocol::Variant& variant) {
+    auto request = variant.to<DataRequest>();
+    auto bytes = cache->find(request.md5, request.partNo);
+    if (!bytes) return false;
+    // Still from the distribution node, which is who the request was for
+    auto data = Data::replyTo(request, bytes->c_str(), bytes->length(),
+                              request.partNo);
+    mesh.sendPackage(&data);
+    ++cache->hits;
+    return true;
+  });
+  return cache;
+}
+
+/**
+ * \brief The firmware a node runs and the update it is receiving
+ *
+ * See addUpdater()
+ */
+class Updater {
+ public:
+  /**
+   * The role, hardware and md5 of the running firmware
+   */
+  State current;
+  /**
+   * The firmware the node is updating to, md5 is empty if there is none
+   */
+  State update;
+  Progress progress;
+  std::shared_ptr<Sink> sink;
+  /**
+   * Request made from the announce, with this node as from and the
+   * distribution node as dest. All parts are requested with it.
+   */
+  DataRequest request;
+  /**
+   * Whether the sink is ready for the next part
+   */
+  bool open = false;
+  /**
+   * Number of firmwares that were installed
+   */
+  size_t installed = 0;
+
+  /**
+   * Stop the update and throw away its progress
+   */
+  void reset() {
+    if (update.task) {
+      update.task->setOnDisable(NULL);
+      update.task->disable();
     }
+    update.md5 = "";
+    update.partNo = 0;
+    update.window = NULL;
+    sink->discard();
+    open = false;
+    progress = Progress();
   }
+};
 
-  mesh.onPackage(10, [currentFW, updateFW, &mesh,
-                      &scheduler](protocol::Variant variant) {
+/**
+ * Update this node when a new firmware for its role and hardware is announced
+ *
+ * Parts are requested through an ota::Window, and written to the sink and
+ * hashed as they arrive (see ota::Progress). An interrupted update continues
+ * on the next announce, also after a reboot if the sink saved the progress.
+ *
+ * \param current The role, hardware and md5 of the running firmware
+ * \param onInstalled Called after the sink installed a new firmware
+ */
+template <class T>
+std::shared_ptr<Updater> addUpdater(
+    Scheduler& scheduler, plugin::PackageHandler<T>& mesh, State current,
+    std::shared_ptr<Sink> sink,
+    std::function<void(const Progress&)> onInstalled = NULL) {
+  using namespace logger;
+  auto updater = std::make_shared<Updater>();
+  updater->current = current;
+  updater->update.role = current.role;
+  updater->update.hardware = current.hardware;
+  updater->sink = sink;
+
+  // Continue an update that was interrupted by a reboot
+  auto saved = sink->load();
+  if (saved.valid() && saved.role == current.role &&
+      saved.hardware == current.hardware && saved.md5 != current.md5) {
+    Log(DEBUG, "OTA: Continue update %s at part %u\n", saved.md5.c_str(),
+        saved.partNo);
+    updater->progress = saved;
+  }
+
+  mesh.onPackage(10, [updater, &mesh, &scheduler](protocol::Variant& variant) {
     // convert variant to Announce
     auto pkg = variant.to<Announce>();
+    auto& update = updater->update;
+    auto& progress = updater->progress;
     // Check if we want the update
-    if (currentFW->role == pkg.role && currentFW->hardware == pkg.hardware) {
-      if ((currentFW->md5 == pkg.md5 && !pkg.forced) ||
-          updateFW->md5 == pkg.md5)
-        // Either already have it, or already updating to it
+    if (updater->current.role != pkg.role ||
+        updater->current.hardware != pkg.hardware)
+      return false;
+    if ((updater->current.md5 == pkg.md5 && !pkg.forced) ||
+        (update.md5 == pkg.md5 && update.window))
+      // Either already have it, or already updating to it
+      return false;
+    if (update.task) {
+      // Stop requesting parts of an older version
+      update.task->setOnDisable(NULL);
+      update.task->disable();
+    }
+    if (progress.md5 != pkg.md5 || progress.noPart != pkg.noPart) {
+      updater->sink->discard();
+      updater->open = false;
+      progress = Progress(pkg);
+    } else {
+      Log(DEBUG, "OTA: Continue at part %u of %u\n", progress.partNo,
+          progress.noPart);
+    }
+    if (!updater->open && !updater->sink->begin(progress)) {
+      // The image can not be continued, start over
+      updater->sink->discard();
+      progress = Progress(pkg);
+      if (!updater->sink->begin(progress)) {
+        Log(ERROR, "OTA: Could not start the update\n");
         return false;
-      else {
-        auto request = DataRequest::replyTo(pkg, mesh.getNodeId(), updateFW->partNo);
-        updateFW->md5 = pkg.md5;
-        // enable the request task
-        updateFW->task =
-            mesh.addTask(scheduler, 30 * TASK_SECOND, 10,
-                         [request, &mesh]() { mesh.sendPackage(&request); });
-        updateFW->task->setOnDisable([updateFW]() {
-          Log(ERROR, "OTA: Did not receive the requested data.\n");
-          updateFW->md5 = "";
-        });
       }
     }
-    return false;
-  });
+    updater->open = true;
 
-  mesh.onPackage(11, [currentFW](protocol::Variant variant) {
-    Log(ERROR, "Data request should not be send to this node\n");
+    updater->request =
+        DataRequest::replyTo(pkg, mesh.getNodeId(), progress.partNo);
+    update.md5 = pkg.md5;
+    update.partNo = progress.partNo;
+    auto window = std::make_shared<Window>(pkg.noPart);
+    window->resume(progress.partNo);
+    update.window = window;
+    // enable the request task, which also requests lost parts again
+    update.task = mesh.addTask(
+        scheduler, TASK_SECOND, TASK_FOREVER,
+        [window, updater, &mesh]() {
+          requestParts(mesh, updater->request, (*window), millis());
+          if (window->failed()) updater->update.task->disable();
+        });
+    update.task->setOnDisable([updater]() {
+      Log(ERROR,
+          "OTA: Did not receive the requested data, continue on the next "
+          "announce.\n");
+      updater->update.window = NULL;
+    });
     return false;
   });
 
-  mesh.onPackage(12, [currentFW, updateFW, &mesh,
-                      &scheduler](protocol::Variant variant) {
+  mesh.onPackage(12, [updater, onInstalled, &mesh](protocol::Variant& variant) {
     auto pkg = variant.to<Data>();
-    // Check whether it is a new part, of correct md5 role etc etc
-    if (updateFW->partNo == pkg.partNo && updateFW->md5 == pkg.md5 &&
-        updateFW->role == pkg.role && updateFW->hardware == pkg.hardware) {
-      // If so write
-      if (pkg.partNo == 0) {
-#ifdef ESP32
-        uint32_t maxSketchSpace = UPDATE_SIZE_UNKNOWN;
-#else
-        uint32_t maxSketchSpace =
-                (ESP.getFreeSketchSpace() - 0x1000) & 0xFFFFF000;
-#endif
-        Log(DEBUG, "Sketch size %d\n", maxSketchSpace);
-        if (Update.isRunning()) {
-          Update.end(false);
-        }
-        if (!Update.begin(maxSketchSpace)) {  // start with max available size
-          Log(DEBUG, "handleOTA(): OTA start failed!");
-          Update.printError(Serial);
-          Update.end();
-        } else {
-          Update.setMD5(pkg.md5.c_str());
+    auto& update = updater->update;
+    auto& progress = updater->progress;
+    auto window = update.window;
+    // Check whether it is a part of the current update, of correct md5 role
+    // etc etc
+    if (!window || update.md5 != pkg.md5 || update.role != pkg.role ||
+        update.hardware != pkg.hardware)
+      return false;
+    if (!window->add(pkg.partNo, pkg.bytes(),
+                     pkg.routing == router::BROADCAST))
+      return false;
+
+    // Write the parts that are next in line
+    while (window->available()) {
+      auto data = window->take();
+      if (!updater->sink->write(data.c_str(), data.length())) {
+        Log(ERROR, "handleOTA(): OTA write failed!\n");
+        updater->reset();
+        return false;
+      }
+      update.partNo = window->partNo();
+      if (progress.add(data)) updater->sink->save(progress);
+
+      // If last part then check md5 and install
+      if (window->complete()) {
+        Log(DEBUG, "handleOTA(): received %u bytes at %u bytes/s\n",
+            window->bytesWritten(), window->throughput(millis()));
+        auto done = progress;
+        auto installed = progress.verify() && updater->sink->end(progress);
+        updater->reset();
+        if (!installed) {
+          Log(ERROR, "handleOTA(): OTA failed!\n");
+          return false;
         }
+        updater->current.md5 = done.md5;
+        ++updater->installed;
+        if (onInstalled) onInstalled(done);
+        return false;
       }
+    }
+
+    // else request more. Not in reply to pkg, because broadcast parts and
+    // parts from a cache do not say who to ask.
+    requestParts(mesh, updater->request, (*window), millis());
+    return false;
+  });
+  return updater;
+}
 
-      //    write data
-      auto b64Data = base64::decode(pkg.data);
-      if (Update.write((uint8_t*)b64Data.c_str(), b64Data.length()) !=
-          b64Data.length()) {
-        Log(ERROR, "handleOTA(): OTA write failed!");
+#if defined(ESP32) || defined(ESP8266)
+/**
+ * \brief Store the firmware in a file, and install it once it is complete
+ *
+ * The progress is saved next to the image, so an update can continue after a
+ * reboot. The file system needs room for one firmware image.
+ */
+class FileSink : public Sink {
+ public:
+  TSTRING progress_fn = "/ota_progress.json";
+  TSTRING image_fn = "/ota_fw.bin";
+
+  Progress load() {
+    if (!SPIFFS.exists(progress_fn) || !SPIFFS.exists(image_fn))
+      return Progress();
+    auto file = SPIFFS.open(progress_fn, "r");
+    TSTRING msg = "";
+    while (file.available()) {
+      msg += (char)file.read();
+    }
+    file.close();
+    auto progress = protocol::Variant(msg).to<Progress>();
+    file = SPIFFS.open(image_fn, "r");
+    auto size = file.size();
+    file.close();
+    if (size < progress.bytes) return Progress();
+    return progress;
+  }
+
+  bool begin(const Progress& progress) {
+    image.close();
+    if (progress.bytes == 0) {
+      SPIFFS.remove(image_fn);
+      image = SPIFFS.open(image_fn, "w");
+      return (bool)image;
+    }
+    if (!SPIFFS.exists(image_fn)) return false;
+    image = SPIFFS.open(image_fn, "r+");
+    return image && image.seek(progress.bytes, SeekSet);
+  }
+
+  bool write(const char* data, size_t length) {
+    if (image.write((const uint8_t*)data, length) == length) return true;
+    Log(logger::ERROR,
+        "handleOTA(): Could not store the firmware, is SPIFFS full?\n");
+    return false;
+  }
+
+  void save(const Progress& progress) {
+    image.flush();
+    auto file = SPIFFS.open(progress_fn, "w");
+    String msg;
+    protocol::Variant(&progress).printTo(msg);
+    file.print(msg);
+    file.close();
+  }
+
+  /**
+   * Write the stored image to the update partition
+   */
+  bool end(const Progress& progress) {
+    using namespace logger;
+    image.close();
+    if (Update.isRunning()) {
+      Update.end(false);
+    }
+    if (!Update.begin(progress.bytes)) {
+      Log(ERROR, "handleOTA(): OTA start failed!\n");
+      Update.printError(Serial);
+      return false;
+    }
+    Update.setMD5(progress.md5.c_str());
+    auto file = SPIFFS.open(image_fn, "r");
+    uint8_t buffer[512];
+    size_t left = progress.bytes;
+    while (left > 0) {
+      auto n = file.read(buffer, std::min(left, sizeof(buffer)));
+      if (n == 0 || Update.write(buffer, n) != n) {
         Update.printError(Serial);
         Update.end();
-        updateFW->md5 = "";
-        updateFW->partNo = 0;
+        file.close();
         return false;
       }
+      left -= n;
+      yield();
+    }
+    file.close();
+    if (!Update.end(true)) {
+      Update.printError(Serial);
+      return false;
+    }
+    return true;
+  }
 
-      // If last part then write ota_fn and reboot
-      if (pkg.partNo == pkg.noPart - 1) {
-        //       check md5, reboot
-        if (Update.end(true)) {  // true to set the size to the
-                                 // current progress
-          auto file = SPIFFS.open(updateFW->ota_fn, "w");
-          String msg;
-          auto var = protocol::Variant(updateFW.get());
-          var.printTo(msg);
-          file.print(msg);
-          file.close();
-
-          Log(DEBUG, "handleOTA(): OTA Success! %s, %s\n", msg.c_str(),
-              updateFW->role.c_str());
-          ESP.restart();
-        } else {
-          Log(DEBUG, "handleOTA(): OTA failed!\n");
-          Update.printError(Serial);
-          updateFW->md5 = "";
-          updateFW->partNo = 0;
-        }
-        updateFW->task->setOnDisable(NULL);
-        updateFW->task->disable();
-      } else {
-        // else request more
-        ++updateFW->partNo;
-        auto request = DataRequest::replyTo(pkg, updateFW->partNo);
-        updateFW->task->setCallback(
-            [request, &mesh]() { mesh.sendPackage(&request); });
-        updateFW->task->disable();
-        updateFW->task->restart();
-      }
+  void discard() {
+    image.close();
+    SPIFFS.remove(progress_fn);
+    SPIFFS.remove(image_fn);
+  }
+
+ protected:
+  File image;
+};
+
+/**
+ * \brief Write the firmware directly to the update partition
+ *
+ * Needs no room in the file system, but an update can only continue while the
+ * node keeps running.
+ */
+class UpdateSink : public Sink {
+ public:
+  bool begin(const Progress& progress) {
+    using namespace logger;
+    if (progress.bytes > 0) return false;
+#ifdef ESP32
+    uint32_t maxSketchSpace = UPDATE_SIZE_UNKNOWN;
+#else
+    uint32_t maxSketchSpace = (ESP.getFreeSketchSpace() - 0x1000) & 0xFFFFF000;
+#endif
+    Log(DEBUG, "Sketch size %d\n", maxSketchSpace);
+    if (Update.isRunning()) {
+      Update.end(false);
+    }
+    if (!Update.begin(maxSketchSpace)) {  // start with max available size
+      Log(ERROR, "handleOTA(): OTA start failed!\n");
+      Update.printError(Serial);
+      Update.end();
+      return false;
     }
+    Update.setMD5(progress.md5.c_str());
+    return true;
+  }
+
+  bool write(const char* data, size_t length) {
+    if (Update.write((uint8_t*)data, length) == length) return true;
+    Update.printError(Serial);
+    Update.end();
+    return false;
+  }
+
+  bool end(const Progress& progress) {
+    // true to set the size to the current progress
+    if (Update.end(true)) return true;
+    Update.printError(Serial);
+    return false;
+  }
+
+  void discard() {
+    if (Update.isRunning()) Update.end(false);
+  }
+};
+
+/**
+ * \brief Use an ota::FileSink when the file system has room for the image, and
+ * an ota::UpdateSink otherwise
+ *
+ * The choice is made when an update starts, from the announced number of
+ * parts. Only updates that are stored in a file can continue after a reboot.
+ */
+class ResumableSink : public Sink {
+ public:
+  FileSink file;
+  UpdateSink update;
+
+  Progress load() { return file.load(); }
+
+  bool begin(const Progress& progress) {
+    if (progress.bytes > 0) {
+      // Only the file can be continued, also right after a reboot
+      if (sink == &update) return false;
+      sink = &file;
+      return file.begin(progress);
+    }
+    file.discard();
+    sink = fits(progress) ? (Sink*)&file : (Sink*)&update;
+    return sink->begin(progress);
+  }
+
+  bool write(const char* data, size_t length) {
+    return sink && sink->write(data, length);
+  }
+
+  void save(const Progress& progress) {
+    if (sink) sink->save(progress);
+  }
+
+  bool end(const Progress& progress) { return sink && sink->end(progress); }
+
+  void discard() {
+    // Also removes a saved image that was loaded but not continued
+    file.discard();
+    if (sink == &update) update.discard();
+    sink = NULL;
+  }
+
+ protected:
+  Sink* sink = NULL;
+
+  bool fits(const Progress& progress) {
+    using namespace logger;
+    size_t needed = progress.noPart * OTA_PART_SIZE;
+#ifdef ESP32
+    size_t available = SPIFFS.totalBytes() - SPIFFS.usedBytes();
+#else
+    FSInfo info;
+    if (!SPIFFS.info(info)) return false;
+    size_t available = info.totalBytes - info.usedBytes;
+#endif
+    // Leave room for the progress file and the file system's own overhead
+    if (available >= needed + needed / 8) return true;
+    Log(DEBUG, "OTA: %u bytes free in SPIFFS, writing the update directly\n",
+        available);
+    return false;
+  }
+};
+#endif
+
+/**
+ * Update this node when a new firmware for its role is announced
+ *
+ * The firmware is written directly with an ota::UpdateSink, after it is
+ * installed the node reboots into it. Use addUpdater() for other sinks.
+ *
+ * \param resumable Store the firmware in SPIFFS when it fits, so the update
+ * can continue after a reboot (see ota::ResumableSink). This writes every byte
+ * to flash twice.
+ * \param cacheSize Memory for parts kept to answer requests of other nodes
+ * (see addCache()). Caching means every OTA data package that this node relays
+ * is parsed, so it is off (0) by default.
+ */
+template <class T>
+void addPackageCallback(Scheduler& scheduler, plugin::PackageHandler<T>& mesh,
+                        TSTRING role = "", bool resumable = false,
+                        size_t cacheSize = 0) {
+  using namespace logger;
+  if (cacheSize > 0) addCache(mesh, cacheSize);
+#if defined(ESP32) || defined(ESP8266)
+  State current;
+  current.role = role;
+#ifdef ESP32
+  SPIFFS.begin(true);  // Start the SPI Flash Files System
+#else
+  SPIFFS.begin();  // Start the SPI Flash Files System
+#endif
+  if (SPIFFS.exists(current.ota_fn)) {
+    auto file = SPIFFS.open(current.ota_fn, "r");
+    TSTRING msg = "";
+    while (file.available()) {
+      msg += (char)file.read();
+    }
+    auto var = protocol::Variant(msg);
+    auto fw = var.to<State>();
+    if (fw.role == role && fw.hardware == current.hardware) {
+      Log(DEBUG, "MD5 found %s\n", fw.md5.c_str());
+      current.md5 = fw.md5;
+    }
+  }
+
+  std::shared_ptr<Sink> sink;
+  if (resumable)
+    sink = std::make_shared<ResumableSink>();
+  else
+    sink = std::make_shared<UpdateSink>();
+  addUpdater(scheduler, mesh, current, sink,
+             [](const Progress& progress) {
+               State fw;
+               fw.md5 = progress.md5;
+               fw.role = progress.role;
+               fw.hardware = progress.hardware;
+               auto file = SPIFFS.open(fw.ota_fn, "w");
+               String msg;
+               auto var = protocol::Variant(&fw);
+               var.printTo(msg);
+               file.print(msg);
+               file.close();
+
+               Log(DEBUG, "handleOTA(): OTA Success! %s, %s\n", msg.c_str(),
+                   fw.role.c_str());
+               ESP.restart();
+             });
+
+  mesh.onPackage(11, [](protocol::Variant& variant) {
+    Log(ERROR, "Data request should not be send to this node\n");
     return false;
   });
 #endif
@@ -4,7 +4,9 @@
 #include "Arduino.h"
 #include "painlessmesh/configuration.hpp"
 
+#include "painlessmesh/buffer.hpp"
 #include "painlessmesh/router.hpp"
+#include "painlessmesh/schema.hpp"
 
 namespace painlessmesh {
 
@@ -32,6 +34,9 @@ namespace painlessmesh {
  * };
  *
  * \endcode
+ *
+ * See painlessmesh::schema for how to list the fields of a package once, so
+ * that reading, writing and sizing it are done for you.
  */
 namespace plugin {
 
@@ -45,19 +50,21 @@ class SinglePackage : public protocol::PackageInterface {
 
   SinglePackage(int type) : routing(router::SINGLE), type(type) {}
 
-  SinglePackage(JsonObject jsonObj) {
-    from = jsonObj["from"];
-    dest = jsonObj["dest"];
-    type = jsonObj["type"];
-    routing = static_cast<router::Type>(jsonObj["routing"].as<int>());
-  }
+  SinglePackage(JsonObject jsonObj) { schema::read(*this, jsonObj); }
 
   JsonObject addTo(JsonObject&& jsonObj) const {
-    jsonObj["from"] = from;
-    jsonObj["dest"] = dest;
-    jsonObj["routing"] = static_cast<int>(routing);
-    jsonObj["type"] = type;
-    return jsonObj;
+    return schema::write(*this, std::move(jsonObj));
+  }
+
+  /**
+   * The fields of the package, see painlessmesh::schema
+   */
+  template <class V>
+  void visit(V& v) {
+    v("from", from);
+    v("dest", dest);
+    v("routing", routing);
+    v("type", type);
   }
 };
 
@@ -70,17 +77,20 @@ class BroadcastPackage : public protocol::PackageInterface {
 
   BroadcastPackage(int type) : routing(router::BROADCAST), type(type) {}
 
-  BroadcastPackage(JsonObject jsonObj) {
-    from = jsonObj["from"];
-    type = jsonObj["type"];
-    routing = static_cast<router::Type>(jsonObj["routing"].as<int>());
-  }
+  BroadcastPackage(JsonObject jsonObj) { schema::read(*this, jsonObj); }
 
   JsonObject addTo(JsonObject&& jsonObj) const {
-    jsonObj["from"] = from;
-    jsonObj["routing"] = static_cast<int>(routing);
-    jsonObj["type"] = type;
-    return jsonObj;
+    return schema::write(*this, std::move(jsonObj));
+  }
+
+  /**
+   * The fields of the package, see painlessmesh::schema
+   */
+  template <class V>
+  void visit(V& v) {
+    v("from", from);
+    v("routing", routing);
+    v("type", type);
   }
 };
 
@@ -106,17 +116,23 @@ class PackageHandler : public layout::Layout<T> {
  public:
   void stop() {
     for (auto&& task : taskList) {
+      task->setOnDisable(NULL);
       task->disable();
       task->setCallback(NULL);
     }
     taskList.clear();
+    freeTasks.clear();
+    scannedSize = 0;
   }
 
   ~PackageHandler() {
-    if (taskList.size() > 0)
+    if (taskList.size() > 0) {
       Log(logger::ERROR,
           "~PackageHandler(): Always call PackageHandler::stop(scheduler) "
           "before calling this destructor");
+      // The OnDisable callbacks of the tasks refer to this handler
+      PackageHandler<T>::stop();
+    }
   }
 
   bool sendPackage(const protocol::PackageInterface* pkg) {
@@ -137,12 +153,24 @@ class PackageHandler : public layout::Layout<T> {
     return false;
   }
 
-  void onPackage(int type, std::function<bool(protocol::Variant)> function) {
-    auto func = [function](protocol::Variant var, std::shared_ptr<T>,
+  void onPackage(int type, std::function<bool(protocol::Variant&)> function) {
+    auto func = [function](protocol::Variant& var, std::shared_ptr<T>,
                            uint32_t) { return function(var); };
     this->callbackList.onPackage(type, func);
   }
 
+  /**
+   * Handle SINGLE packages of the given type that this node relays to another
+   * node
+   *
+   * Normally these are send on without parsing them. If the function returns
+   * true the package is considered handled and is not send on, e.g. because
+   * this node replied on behalf of the destination.
+   */
+  void onRelay(int type, std::function<bool(protocol::Variant&)> function) {
+    this->relayCallbacks[type].push_back(function);
+  }
+
   /**
    * Add a task to the scheduler
    *
@@ -150,24 +178,31 @@ class PackageHandler : public layout::Layout<T> {
    * returned. If the task is anonymous (i.e. no shared_ptr to it is held
    * anywhere else) and disabled then it will be reused when a new task is
    * added.
+   *
+   * Tasks put themselves on a free list when they are disabled, so finding a
+   * task to reuse does not depend on the number of tasks. Tasks that were
+   * still referenced at that time (or whose OnDisable callback was replaced)
+   * are found by a scan of all tasks, which is only done after the number of
+   * tasks doubled, to keep the cost of adding a task constant on average.
    */
   std::shared_ptr<Task> addTask(Scheduler& scheduler, unsigned long aInterval,
                                 long aIterations,
                                 std::function<void()> aCallback) {
     using namespace painlessmesh::logger;
-    for (auto&& task : taskList) {
-      if (task.use_count() == 1 && !task->isEnabled()) {
-        task->set(aInterval, aIterations, aCallback, NULL, NULL);
-        task->enable();
-        return task;
-      }
+    auto task = reusableTask();
+    if (!task) {
+      task = std::make_shared<Task>();
+      scheduler.addTask((*task));
+      taskList.push_front(task);
     }
-
-    std::shared_ptr<Task> task =
-        std::make_shared<Task>(aInterval, aIterations, aCallback);
-    scheduler.addTask((*task));
+    task->set(aInterval, aIterations, aCallback, NULL,
+              [this, weak = std::weak_ptr<Task>(task)]() {
+                // Entries can be stale, so the list is bounded by the number
+                // of tasks. Anything dropped is found again by a scan.
+                if (freeTasks.size() < taskList.size())
+                  freeTasks.push_back(weak);
+              });
     task->enable();
-    taskList.push_front(task);
     return task;
   }
 
@@ -178,7 +213,31 @@ class PackageHandler : public layout::Layout<T> {
 
  protected:
   callback::MeshPackageCallbackList<T> callbackList;
+  buffer::ring_queue_t<std::weak_ptr<Task> > freeTasks;
   std::list<std::shared_ptr<Task> > taskList = {};
+  size_t scannedSize = 0;
+
+  static bool isReusable(const std::shared_ptr<Task>& task) {
+    return task.use_count() == 1 && !task->isEnabled();
+  }
+
+  std::shared_ptr<Task> reusableTask() {
+    while (!freeTasks.empty()) {
+      auto weak = freeTasks.front();
+      freeTasks.pop_front();
+      // Only the taskList should hold on to it (besides us)
+      if (weak.use_count() != 1) continue;
+      auto task = weak.lock();
+      if (!task->isEnabled()) return task;
+    }
+    if (taskList.size() < 2 * scannedSize) return NULL;
+    scannedSize = taskList.size();
+    for (auto&& task : taskList) {
+      if (isReusable(task)) freeTasks.push_back(task);
+    }
+    if (freeTasks.empty()) return NULL;
+    return reusableTask();
+  }
 };
 
 }  // namespace plugin
@@ -0,0 +1,134 @@
+#ifndef _PAINLESS_MESH_POOL_HPP_
+#define _PAINLESS_MESH_POOL_HPP_
+
+#include <cstdlib>
+#include <cstring>
+
+#include "Arduino.h"
+#include "painlessmesh/configuration.hpp"
+
+#ifndef PAINLESSMESH_JSON_POOL_BLOCKS
+#define PAINLESSMESH_JSON_POOL_BLOCKS 4
+#endif
+
+#ifndef PAINLESSMESH_JSON_POOL_BLOCK_SIZE
+#define PAINLESSMESH_JSON_POOL_BLOCK_SIZE 1024
+#endif
+
+namespace painlessmesh {
+namespace pool {
+
+/**
+ * Usage statistics of a Pool, to help choose the number and size of blocks
+ */
+struct stats_t {
+  // Allocations served from the pool
+  size_t hits = 0;
+  // Allocations that did not fit the pool and went to the heap
+  size_t misses = 0;
+  // Blocks currently in use
+  size_t inUse = 0;
+  // Maximum number of blocks in use at the same time
+  size_t highWater = 0;
+  // Largest allocation requested
+  size_t largest = 0;
+};
+
+/**
+ * \brief A fixed number of equally sized memory blocks that are reused
+ *
+ * Blocks are allocated the first time they are needed and then kept, so in
+ * steady state no heap allocations are needed. Requests that are larger than
+ * a block, or arrive when all blocks are in use, fall back to malloc.
+ */
+template <size_t N, size_t S>
+class Pool {
+ public:
+  ~Pool() {
+    for (size_t i = 0; i < N; ++i) free(blocks[i]);
+  }
+
+  void* allocate(size_t size) {
+    if (size > stats.largest) stats.largest = size;
+    if (size <= S) {
+      for (size_t i = 0; i < N; ++i) {
+        if (used[i]) continue;
+        if (blocks[i] == NULL) {
+          blocks[i] = (char*)malloc(S);
+          if (blocks[i] == NULL) break;
+        }
+        used[i] = true;
+        ++stats.hits;
+        ++stats.inUse;
+        if (stats.inUse > stats.highWater) stats.highWater = stats.inUse;
+        return blocks[i];
+      }
+    }
+    ++stats.misses;
+    return malloc(size);
+  }
+
+  void deallocate(void* ptr) {
+    auto i = indexOf(ptr);
+    if (i < N) {
+      used[i] = false;
+      --stats.inUse;
+    } else {
+      free(ptr);
+    }
+  }
+
+  void* reallocate(void* ptr, size_t size) {
+    auto i = indexOf(ptr);
+    if (i >= N) return realloc(ptr, size);
+    if (size <= S) return ptr;
+    auto newPtr = malloc(size);
+    if (newPtr == NULL) return NULL;
+    ++stats.misses;
+    memcpy(newPtr, ptr, S);
+    deallocate(ptr);
+    return newPtr;
+  }
+
+  stats_t stats;
+
+ private:
+  char* blocks[N] = {};
+  bool used[N] = {};
+
+  size_t indexOf(void* ptr) {
+    if (ptr == NULL) return N;
+    for (size_t i = 0; i < N; ++i) {
+      if (blocks[i] == ptr) return i;
+    }
+    return N;
+  }
+};
+
+typedef Pool<PAINLESSMESH_JSON_POOL_BLOCKS, PAINLESSMESH_JSON_POOL_BLOCK_SIZE>
+    JsonPool;
+
+/**
+ * The pool used for the json documents of protocol::Variant
+ */
+inline JsonPool& jsonPool() {
+  static JsonPool pool;
+  return pool;
+}
+
+/**
+ * ArduinoJson allocator that uses the jsonPool()
+ */
+struct JsonAllocator {
+  void* allocate(size_t size) { return jsonPool().allocate(size); }
+  void deallocate(void* ptr) { jsonPool().deallocate(ptr); }
+  void* reallocate(void* ptr, size_t size) {
+    return jsonPool().reallocate(ptr, size);
+  }
+};
+
+typedef BasicJsonDocument<JsonAllocator> PooledJsonDocument;
+
+}  // namespace pool
+}  // namespace painlessmesh
+#endif
@@ -2,10 +2,13 @@
 #define _PAINLESS_MESH_PROTOCOL_HPP_
 
 #include <cmath>
+#include <cstring>
 #include <list>
 
 #include "Arduino.h"
+#include "painlessmesh/binary.hpp"
 #include "painlessmesh/configuration.hpp"
+#include "painlessmesh/pool.hpp"
 
 namespace painlessmesh {
 
@@ -36,6 +39,24 @@ enum Type {
   SINGLE = 9      // application data for a single node
 };
 
+/**
+ * Optional protocol features
+ *
+ * Nodes send the features they support with each node sync. A feature is only
+ * used on a connection when both neighbours support it.
+ */
+enum Feature {
+  BINARY_FORMAT = 1 << 0,  // Packages can be send in the binary format
+  DELTA_SYNC = 1 << 1,     // Node syncs only contain the changed subs
+  TIME64 = 1 << 2          // Time syncs carry the 64 bit node time
+};
+
+#ifndef PAINLESSMESH_FEATURES
+#define PAINLESSMESH_FEATURES      \
+  (painlessmesh::protocol::BINARY_FORMAT | \
+   painlessmesh::protocol::DELTA_SYNC | painlessmesh::protocol::TIME64)
+#endif
+
 enum TimeType {
   TIME_SYNC_ERROR = -1,
   TIME_SYNC_REQUEST,
@@ -83,7 +104,8 @@ class Single : public PackageInterface {
   }
 
   size_t jsonObjectSize() const {
-    return JSON_OBJECT_SIZE(4) + round(1.1 * msg.length());
+    // Including the terminating zero of the copied msg
+    return JSON_OBJECT_SIZE(4) + round(1.1 * msg.length()) + 1;
   }
 };
 
@@ -93,17 +115,27 @@ class Single : public PackageInterface {
 class Broadcast : public Single {
  public:
   int type = BROADCAST;
+  /**
+   * Sequence number set by the origin (from), used to drop broadcasts that
+   * are received more than once. Zero if not set.
+   */
+  uint32_t seq = 0;
 
   using Single::Single;
 
+  Broadcast(JsonObject jsonObj) : Single(jsonObj) {
+    if (jsonObj.containsKey("seq")) seq = jsonObj["seq"].as<uint32_t>();
+  }
+
   JsonObject addTo(JsonObject&& jsonObj) const {
     jsonObj = Single::addTo(std::move(jsonObj));
     jsonObj["type"] = type;
+    if (seq != 0) jsonObj["seq"] = seq;
     return jsonObj;
   }
 
   size_t jsonObjectSize() const {
-    return JSON_OBJECT_SIZE(4) + round(1.1 * msg.length());
+    return JSON_OBJECT_SIZE(5) + round(1.1 * msg.length()) + 1;
   }
 };
 
@@ -166,7 +198,7 @@ class NodeTree : public PackageInterface {
 
   bool operator!=(const NodeTree& b) const { return !this->operator==(b); }
 
-  TSTRING toString(bool pretty = false);
+  TSTRING toString(bool pretty = false) const;
 
   size_t jsonObjectSize() const {
     size_t base = 1;
@@ -187,12 +219,27 @@ class NodeTree : public PackageInterface {
 
 /**
  * NodeSyncRequest package
+ *
+ * Between nodes that support the DELTA_SYNC feature the package can be a
+ * delta against the previous sync. Then subs only contains the subs that
+ * were added or changed, and removed the nodeIds of the subs that are gone.
  */
 class NodeSyncRequest : public NodeTree {
  public:
   int type = NODE_SYNC_REQUEST;
   uint32_t from;
   uint32_t dest;
+  uint32_t features = 0;
+
+  // Whether this is a delta against the tree with hash baseHash
+  bool delta = false;
+  uint32_t baseHash = 0;
+  // Hash of the tree after applying the delta
+  uint32_t hash = 0;
+  std::list<uint32_t> removed;
+
+  // Ask the receiver to send its full tree with the next sync
+  bool resend = false;
 
   NodeSyncRequest() {}
   NodeSyncRequest(uint32_t fromID, uint32_t destID, std::list<NodeTree> subTree,
@@ -207,6 +254,20 @@ class NodeSyncRequest : public NodeTree {
   NodeSyncRequest(JsonObject jsonObj) : NodeTree(jsonObj) {
     dest = jsonObj["dest"].as<uint32_t>();
     from = jsonObj["from"].as<uint32_t>();
+    if (jsonObj.containsKey("features"))
+      features = jsonObj["features"].as<uint32_t>();
+    if (jsonObj.containsKey("base")) {
+      delta = true;
+      baseHash = jsonObj["base"].as<uint32_t>();
+      hash = jsonObj["hash"].as<uint32_t>();
+      if (jsonObj.containsKey("removed")) {
+        auto jsonArr = jsonObj["removed"].as<JsonArray>();
+        for (size_t i = 0; i < jsonArr.size(); ++i)
+          removed.push_back(jsonArr[i].as<uint32_t>());
+      }
+    }
+    if (jsonObj.containsKey("resend"))
+      resend = jsonObj["resend"].as<bool>();
   }
 
   JsonObject addTo(JsonObject&& jsonObj) const {
@@ -214,6 +275,16 @@ class NodeSyncRequest : public NodeTree {
     jsonObj["type"] = type;
     jsonObj["dest"] = dest;
     jsonObj["from"] = from;
+    if (features) jsonObj["features"] = features;
+    if (delta) {
+      jsonObj["base"] = baseHash;
+      jsonObj["hash"] = hash;
+      if (removed.size() > 0) {
+        JsonArray removedArr = jsonObj.createNestedArray("removed");
+        for (auto&& id : removed) removedArr.add(id);
+      }
+    }
+    if (resend) jsonObj["resend"] = resend;
     return jsonObj;
   }
 
@@ -228,9 +299,14 @@ class NodeSyncRequest : public NodeTree {
 
   size_t jsonObjectSize() const {
     size_t base = 4;
+    if (features) ++base;
+    if (delta) base += 2;
+    if (removed.size() > 0) ++base;
+    if (resend) ++base;
     if (root) ++base;
     if (subs.size() > 0) ++base;
     size_t size = JSON_OBJECT_SIZE(base);
+    if (removed.size() > 0) size += JSON_ARRAY_SIZE(removed.size());
     if (subs.size() > 0) size += JSON_ARRAY_SIZE(subs.size());
     for (auto&& s : subs) size += s.jsonObjectSize();
     return size;
@@ -253,11 +329,17 @@ class NodeSyncReply : public NodeSyncRequest {
   }
 };
 
+/**
+ * Timestamps of a time sync exchange
+ *
+ * These hold the 64 bit node time if both neighbours support
+ * protocol::TIME64, otherwise only the lower 32 bits.
+ */
 struct time_sync_msg_t {
   int type = TIME_SYNC_ERROR;
-  uint32_t t0 = 0;
-  uint32_t t1 = 0;
-  uint32_t t2 = 0;
+  uint64_t t0 = 0;
+  uint64_t t1 = 0;
+  uint64_t t2 = 0;
 };
 
 /**
@@ -278,14 +360,14 @@ class TimeSync : public PackageInterface {
     msg.type = TIME_SYNC_REQUEST;
   }
 
-  TimeSync(uint32_t fromID, uint32_t destID, uint32_t t0) {
+  TimeSync(uint32_t fromID, uint32_t destID, uint64_t t0) {
     from = fromID;
     dest = destID;
     msg.type = TIME_REQUEST;
     msg.t0 = t0;
   }
 
-  TimeSync(uint32_t fromID, uint32_t destID, uint32_t t0, uint32_t t1) {
+  TimeSync(uint32_t fromID, uint32_t destID, uint64_t t0, uint64_t t1) {
     from = fromID;
     dest = destID;
     msg.type = TIME_REPLY;
@@ -293,8 +375,8 @@ class TimeSync : public PackageInterface {
     msg.t1 = t1;
   }
 
-  TimeSync(uint32_t fromID, uint32_t destID, uint32_t t0, uint32_t t1,
-           uint32_t t2) {
+  TimeSync(uint32_t fromID, uint32_t destID, uint64_t t0, uint64_t t1,
+           uint64_t t2) {
     from = fromID;
     dest = destID;
     msg.type = TIME_REPLY;
@@ -308,11 +390,11 @@ class TimeSync : public PackageInterface {
     from = jsonObj["from"].as<uint32_t>();
     msg.type = jsonObj["msg"]["type"].as<int>();
     if (jsonObj["msg"].containsKey("t0"))
-      msg.t0 = jsonObj["msg"]["t0"].as<uint32_t>();
+      msg.t0 = jsonObj["msg"]["t0"].as<uint64_t>();
     if (jsonObj["msg"].containsKey("t1"))
-      msg.t1 = jsonObj["msg"]["t1"].as<uint32_t>();
+      msg.t1 = jsonObj["msg"]["t1"].as<uint64_t>();
     if (jsonObj["msg"].containsKey("t2"))
-      msg.t2 = jsonObj["msg"]["t2"].as<uint32_t>();
+      msg.t2 = jsonObj["msg"]["t2"].as<uint64_t>();
   }
 
   JsonObject addTo(JsonObject&& jsonObj) const {
@@ -332,7 +414,7 @@ class TimeSync : public PackageInterface {
   /**
    * Create a reply to the current message with the new time set
    */
-  void reply(uint32_t newT0) {
+  void reply(uint64_t newT0) {
     msg.t0 = newT0;
     ++msg.type;
     std::swap(from, dest);
@@ -341,7 +423,7 @@ class TimeSync : public PackageInterface {
   /**
    * Create a reply to the current message with the new time set
    */
-  void reply(uint32_t newT1, uint32_t newT2) {
+  void reply(uint64_t newT1, uint64_t newT2) {
     msg.t1 = newT1;
     msg.t2 = newT2;
     ++msg.type;
@@ -368,6 +450,325 @@ class TimeDelay : public TimeSync {
   }
 };
 
+/**
+ * The routing method used for the given package type
+ *
+ * Packages can override this with an explicit "routing" field.
+ */
+inline router::Type routing(int type) {
+  if (type == SINGLE || type == TIME_DELAY) return router::SINGLE;
+  if (type == BROADCAST) return router::BROADCAST;
+  if (type == NODE_SYNC_REQUEST || type == NODE_SYNC_REPLY || type == TIME_SYNC)
+    return router::NEIGHBOUR;
+  return router::ROUTING_ERROR;
+}
+
+/**
+ * The fields of a package that are needed to route it
+ */
+struct Header {
+  int type = 0;
+  uint32_t dest = 0;
+  router::Type routing = router::ROUTING_ERROR;
+  uint32_t from = 0;
+  // Sequence number of a broadcast, zero if not present
+  uint32_t seq = 0;
+};
+
+/**
+ * Helper functions to scan a json package without parsing it
+ */
+namespace scan {
+inline const char* skipWhitespace(const char* it, const char* end) {
+  while (it < end && (*it == ' ' || *it == '\t' || *it == '\n' || *it == '\r'))
+    ++it;
+  return it;
+}
+
+/**
+ * Skip a json string
+ *
+ * @param it Should point to the opening quote
+ * @return Pointer just past the closing quote, or NULL if the string is not
+ * terminated
+ */
+inline const char* skipString(const char* it, const char* end) {
+  ++it;
+  while (it < end) {
+    auto quote = (const char*)memchr(it, '"', end - it);
+    if (quote == NULL) return NULL;
+    // The quote is escaped if it is preceded by an odd number of backslashes
+    size_t slashes = 0;
+    while (quote - slashes > it && *(quote - slashes - 1) == '\\') ++slashes;
+    it = quote + 1;
+    if (slashes % 2 == 0) return it;
+  }
+  return NULL;
+}
+
+/**
+ * Skip any json value, including nested objects and arrays
+ *
+ * @return Pointer just past the value, or NULL if the value is malformed
+ */
+inline const char* skipValue(const char* it, const char* end) {
+  if (it >= end) return NULL;
+  if (*it == '"') return skipString(it, end);
+  if (*it == '{' || *it == '[') {
+    size_t depth = 0;
+    while (it < end) {
+      if (*it == '"') {
+        it = skipString(it, end);
+        if (it == NULL) return NULL;
+        continue;
+      }
+      if (*it == '{' || *it == '[') ++depth;
+      if (*it == '}' || *it == ']') {
+        --depth;
+        if (depth == 0) return it + 1;
+      }
+      ++it;
+    }
+    return NULL;
+  }
+  auto start = it;
+  while (it < end && *it != ',' && *it != '}' && *it != ']' && *it != ' ' &&
+         *it != '\t' && *it != '\n' && *it != '\r')
+    ++it;
+  if (it == start) return NULL;
+  return it;
+}
+
+/**
+ * Read an integer value
+ *
+ * @return Pointer just past the value, or NULL if the value is not an integer
+ */
+inline const char* readInteger(const char* it, const char* end,
+                               int64_t& value) {
+  bool negative = false;
+  if (it < end && *it == '-') {
+    negative = true;
+    ++it;
+  }
+  auto start = it;
+  int64_t result = 0;
+  while (it < end && *it >= '0' && *it <= '9') {
+    result = 10 * result + (*it - '0');
+    ++it;
+  }
+  if (it == start || (it < end && (*it == '.' || *it == 'e' || *it == 'E')))
+    return NULL;
+  value = negative ? -result : result;
+  return it;
+}
+
+/**
+ * Memory needed to parse a json string into a JsonDocument
+ *
+ * Every value (except the root) takes a slot and every string, keys included,
+ * is copied. Escaped characters are counted with their escaped length, so the
+ * result can be slightly larger than needed, but is never too small.
+ *
+ * @return The capacity, or 0 if the json is malformed
+ */
+inline size_t capacity(const char* json, size_t length) {
+  auto end = json + length;
+  size_t values = 0;
+  size_t strings = 0;
+  auto it = json;
+  while (it < end) {
+    auto c = *it;
+    if (c == '"') {
+      auto next = skipString(it, end);
+      if (next == NULL) return 0;
+      // Content without the quotes, plus the terminating zero
+      strings += next - it - 1;
+      auto after = skipWhitespace(next, end);
+      if (after >= end || *after != ':') ++values;
+      it = next;
+    } else if (c == '{' || c == '[') {
+      ++values;
+      ++it;
+    } else if (c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' ||
+               c == 'n') {
+      ++values;
+      it = skipValue(it, end);
+      if (it == NULL) return 0;
+    } else if (c == '\0') {
+      break;
+    } else {
+      // Whitespace, separators and closing brackets
+      ++it;
+    }
+  }
+  if (values == 0) return 0;
+  return JSON_OBJECT_SIZE(values - 1) + strings;
+}
+
+inline bool isKey(const char* key, size_t length, const char* name) {
+  return strlen(name) == length && memcmp(key, name, length) == 0;
+}
+
+/**
+ * Extract the routing fields of a binary frame
+ */
+inline bool peekBinaryHeader(const char* data, size_t length, Header& header) {
+  binary::Reader reader(data, length);
+  uint8_t tag;
+  size_t size;
+  if (!binary::readHeader(reader) || !reader.readByte(tag) ||
+      tag != binary::OBJECT || !reader.readSize(size))
+    return false;
+
+  bool hasType = false;
+  bool hasDest = false;
+  bool hasRouting = false;
+  bool hasFrom = false;
+  bool hasSeq = false;
+  int64_t value;
+  size_t capacity = 0;
+  for (size_t i = 0; i < size; ++i) {
+    const char* key;
+    char* bytes;
+    size_t keyLength;
+    if (!reader.readKey(key, bytes, keyLength)) return false;
+    if (key != NULL) {
+      bytes = (char*)key;
+      keyLength = strlen(key);
+    }
+    if (!hasType && isKey(bytes, keyLength, "type")) {
+      if (!reader.readInteger(value)) return false;
+      header.type = (int)value;
+      hasType = true;
+    } else if (!hasDest && isKey(bytes, keyLength, "dest")) {
+      if (!reader.readInteger(value)) return false;
+      header.dest = (uint32_t)value;
+      hasDest = true;
+    } else if (!hasRouting && isKey(bytes, keyLength, "routing")) {
+      if (!reader.readInteger(value)) return false;
+      header.routing = (router::Type)value;
+      hasRouting = true;
+    } else if (!hasFrom && isKey(bytes, keyLength, "from")) {
+      if (!reader.readInteger(value)) return false;
+      header.from = (uint32_t)value;
+      hasFrom = true;
+    } else if (!hasSeq && isKey(bytes, keyLength, "seq")) {
+      if (!reader.readInteger(value)) return false;
+      header.seq = (uint32_t)value;
+      hasSeq = true;
+    } else if (!reader.skipValue(capacity, 1)) {
+      return false;
+    }
+  }
+
+  if (!hasType) return false;
+  if (!hasDest) header.dest = 0;
+  if (!hasRouting) header.routing = routing(header.type);
+  if (!hasFrom) header.from = 0;
+  if (!hasSeq) header.seq = 0;
+  return true;
+}
+}  // namespace scan
+
+/**
+ * Extract the routing fields of a package without parsing the package
+ *
+ * Only the top level of the json object is scanned and nested values (like
+ * the msg) are skipped over. This is much cheaper than a full parse and is
+ * used to forward packages that are not meant for this node. Binary frames
+ * are supported as well.
+ *
+ * @param json The raw json package
+ * @param length The length of the raw package
+ * @param header The header to fill
+ * @return Whether the package is a json object that contains a type
+ */
+inline bool peekHeader(const char* json, size_t length, Header& header) {
+  using namespace scan;
+  if (binary::isFrame(json, length))
+    return peekBinaryHeader(json, length, header);
+  auto end = json + length;
+  auto it = skipWhitespace(json, end);
+  if (it >= end || *it != '{') return false;
+  ++it;
+
+  bool hasType = false;
+  bool hasDest = false;
+  bool hasRouting = false;
+  bool hasFrom = false;
+  bool hasSeq = false;
+  int64_t value;
+  while (true) {
+    it = skipWhitespace(it, end);
+    if (it >= end) return false;
+    if (*it == '}') break;
+    if (*it != '"') return false;
+    auto key = it + 1;
+    it = skipString(it, end);
+    if (it == NULL) return false;
+    auto keyLength = (size_t)(it - key - 1);
+    it = skipWhitespace(it, end);
+    if (it >= end || *it != ':') return false;
+    it = skipWhitespace(it + 1, end);
+
+    if (!hasType && isKey(key, keyLength, "type")) {
+      it = readInteger(it, end, value);
+      if (it == NULL) return false;
+      header.type = (int)value;
+      hasType = true;
+    } else if (!hasDest && isKey(key, keyLength, "dest")) {
+      it = readInteger(it, end, value);
+      if (it == NULL) return false;
+      header.dest = (uint32_t)value;
+      hasDest = true;
+    } else if (!hasRouting && isKey(key, keyLength, "routing")) {
+      it = readInteger(it, end, value);
+      if (it == NULL) return false;
+      header.routing = (router::Type)value;
+      hasRouting = true;
+    } else if (!hasFrom && isKey(key, keyLength, "from")) {
+      it = readInteger(it, end, value);
+      if (it == NULL) return false;
+      header.from = (uint32_t)value;
+      hasFrom = true;
+    } else if (!hasSeq && isKey(key, keyLength, "seq")) {
+      it = readInteger(it, end, value);
+      if (it == NULL) return false;
+      header.seq = (uint32_t)value;
+      hasSeq = true;
+    } else {
+      it = skipValue(it, end);
+      if (it == NULL) return false;
+    }
+
+    it = skipWhitespace(it, end);
+    if (it >= end) return false;
+    if (*it == '}') break;
+    if (*it != ',') return false;
+    ++it;
+  }
+
+  if (!hasType) return false;
+  if (!hasDest) header.dest = 0;
+  if (!hasRouting) header.routing = routing(header.type);
+  if (!hasFrom) header.from = 0;
+  if (!hasSeq) header.seq = 0;
+  return true;
+}
+
+#ifdef ARDUINOJSON_ENABLE_STD_STRING
+inline bool peekHeader(const std::string& json, Header& header) {
+  return peekHeader(json.c_str(), json.length(), header);
+}
+#endif
+
+#ifdef ARDUINOJSON_ENABLE_ARDUINO_STRING
+inline bool peekHeader(const String& json, Header& header) {
+  return peekHeader(json.c_str(), json.length(), header);
+}
+#endif
+
 /**
  * Can store any package variant
  *
@@ -383,11 +784,8 @@ class Variant {
    * @param json The json string containing a package
    */
   Variant(std::string json)
-      : jsonBuffer(JSON_OBJECT_SIZE(5) + JSON_OBJECT_SIZE(4) +
-                   2 * json.length()) {
-    error = deserializeJson(jsonBuffer, json,
-                            DeserializationOption::NestingLimit(255));
-    if (!error) jsonObj = jsonBuffer.as<JsonObject>();
+      : jsonBuffer(capacityFor(json.c_str(), json.length())) {
+    deserialize(json);
   }
 
   /**
@@ -396,10 +794,9 @@ class Variant {
    * @param json The json string containing a package
    * @param capacity The capacity to reserve for parsing the string
    */
-  Variant(std::string json, size_t capacity) : jsonBuffer(capacity) {
-    error = deserializeJson(jsonBuffer, json,
-                            DeserializationOption::NestingLimit(255));
-    if (!error) jsonObj = jsonBuffer.as<JsonObject>();
+  Variant(std::string json, size_t capacity)
+      : jsonBuffer(capacityFor(json.c_str(), json.length(), capacity)) {
+    deserialize(json);
   }
 #endif
 
@@ -410,11 +807,8 @@ class Variant {
    * @param json The json string containing a package
    */
   Variant(String json)
-      : jsonBuffer(JSON_OBJECT_SIZE(5) + JSON_OBJECT_SIZE(4) +
-                   2 * json.length()) {
-    error = deserializeJson(jsonBuffer, json,
-                            DeserializationOption::NestingLimit(255));
-    if (!error) jsonObj = jsonBuffer.as<JsonObject>();
+      : jsonBuffer(capacityFor(json.c_str(), json.length())) {
+    deserialize(json);
   }
 
   /**
@@ -423,10 +817,9 @@ class Variant {
    * @param json The json string containing a package
    * @param capacity The capacity to reserve for parsing the string
    */
-  Variant(String json, size_t capacity) : jsonBuffer(capacity) {
-    error = deserializeJson(jsonBuffer, json,
-                            DeserializationOption::NestingLimit(255));
-    if (!error) jsonObj = jsonBuffer.as<JsonObject>();
+  Variant(String json, size_t capacity)
+      : jsonBuffer(capacityFor(json.c_str(), json.length(), capacity)) {
+    deserialize(json);
   }
 #endif
   /**
@@ -537,13 +930,7 @@ class Variant {
     if (jsonObj.containsKey("routing"))
       return (router::Type)jsonObj["routing"].as<int>();
 
-    auto type = this->type();
-    if (type == SINGLE || type == TIME_DELAY) return router::SINGLE;
-    if (type == BROADCAST) return router::BROADCAST;
-    if (type == NODE_SYNC_REQUEST || type == NODE_SYNC_REPLY ||
-        type == TIME_SYNC)
-      return router::NEIGHBOUR;
-    return router::ROUTING_ERROR;
+    return protocol::routing(this->type());
   }
 
   /**
@@ -566,6 +953,11 @@ class Variant {
     else
       serializeJson(jsonObj, str);
   }
+
+  /**
+   * Print a variant to a string using the binary wire format
+   */
+  void printBinaryTo(std::string& str) { binary::write(jsonObj, str); }
 #endif
 
 #ifdef ARDUINOJSON_ENABLE_ARDUINO_STRING
@@ -580,12 +972,53 @@ class Variant {
     else
       serializeJson(jsonObj, str);
   }
+
+  /**
+   * Print a variant to a string using the binary wire format
+   */
+  void printBinaryTo(String& str) { binary::write(jsonObj, str); }
 #endif
 
   DeserializationError error = DeserializationError::Ok;
 
  private:
-  DynamicJsonDocument jsonBuffer;
+  /**
+   * Capacity needed to parse the string
+   *
+   * Binary frames know their exact size, json strings are measured by
+   * scan::capacity, unless a capacity is given
+   */
+  static size_t capacityFor(const char* data, size_t length) {
+    auto capacity = binary::isFrame(data, length)
+                        ? binary::capacity(data, length)
+                        : scan::capacity(data, length);
+    if (capacity > 0) return capacity;
+    // Malformed, parsing will fail anyway
+    return JSON_OBJECT_SIZE(5) + JSON_OBJECT_SIZE(4) + 2 * length;
+  }
+
+  static size_t capacityFor(const char* data, size_t length,
+                            size_t jsonCapacity) {
+    if (!binary::isFrame(data, length)) return jsonCapacity;
+    auto capacity = binary::capacity(data, length);
+    if (capacity == 0) return jsonCapacity;
+    return capacity;
+  }
+
+  template <class S>
+  void deserialize(S& json) {
+    if (binary::isFrame(json.c_str(), json.length())) {
+      auto obj = jsonBuffer.to<JsonObject>();
+      error = binary::read(&json[0], json.length(), obj);
+      if (!error) jsonObj = obj;
+      return;
+    }
+    error = deserializeJson(jsonBuffer, json,
+                            DeserializationOption::NestingLimit(255));
+    if (!error) jsonObj = jsonBuffer.as<JsonObject>();
+  }
+
+  pool::PooledJsonDocument jsonBuffer;
   JsonObject jsonObj;
 };
 
@@ -624,7 +1057,7 @@ inline JsonObject Variant::to<JsonObject>() {
   return jsonObj;
 }
 
-inline TSTRING NodeTree::toString(bool pretty) {
+inline TSTRING NodeTree::toString(bool pretty) const {
   TSTRING str;
   auto variant = Variant(*this);
   variant.printTo(str, pretty);
@@ -18,7 +18,7 @@ namespace painlessmesh {
  */
 namespace router {
 template <class T>
-std::shared_ptr<T> findRoute(layout::Layout<T> tree,
+std::shared_ptr<T> findRoute(layout::Layout<T>& tree,
                              std::function<bool(std::shared_ptr<T>)> func) {
   auto route = std::find_if(tree.subs.begin(), tree.subs.end(), func);
   if (route == tree.subs.end()) return NULL;
@@ -26,70 +26,63 @@ std::shared_ptr<T> findRoute(layout::Layout<T> tree,
 }
 
 template <class T>
-std::shared_ptr<T> findRoute(layout::Layout<T> tree, uint32_t nodeId) {
-  return findRoute<T>(tree, [nodeId](std::shared_ptr<T> s) {
-    return layout::contains((*s), nodeId);
-  });
+std::shared_ptr<T> findRoute(layout::Layout<T>& tree, uint32_t nodeId) {
+  return tree.findRoute(nodeId);
+}
+
+/**
+ * Serialize the variant in the format the connection supports
+ */
+template <class U>
+TSTRING serialize(protocol::Variant& variant, std::shared_ptr<U> conn) {
+  TSTRING msg;
+  if (conn->features & protocol::BINARY_FORMAT)
+    variant.printBinaryTo(msg);
+  else
+    variant.printTo(msg);
+  return msg;
 }
 
 template <class T, class U>
 bool send(T package, std::shared_ptr<U> conn, bool priority = false) {
   auto variant = painlessmesh::protocol::Variant(package);
-  TSTRING msg;
-  variant.printTo(msg);
+  auto msg = serialize(variant, conn);
   return conn->addMessage(msg, priority);
 }
 
 template <class U>
-bool send(protocol::Variant variant, std::shared_ptr<U> conn,
+bool send(protocol::Variant& variant, std::shared_ptr<U> conn,
           bool priority = false) {
-  TSTRING msg;
-  variant.printTo(msg);
+  auto msg = serialize(variant, conn);
   return conn->addMessage(msg, priority);
 }
 
-template <class T, class U>
-bool send(T package, layout::Layout<U> layout) {
-  auto variant = painlessmesh::protocol::Variant(package);
-  TSTRING msg;
-  variant.printTo(msg);
-  auto conn = findRoute<U>(layout, variant.dest);
-  if (conn) return conn->addMessage(msg);
-  return false;
-}
-
 template <class U>
-bool send(protocol::Variant variant, layout::Layout<U> layout) {
-  TSTRING msg;
-  variant.printTo(msg);
+bool send(protocol::Variant& variant, layout::Layout<U>& layout) {
   auto conn = findRoute<U>(layout, variant.dest());
-  if (conn) return conn->addMessage(msg);
-  return false;
+  if (!conn) return false;
+  auto msg = serialize(variant, conn);
+  return conn->addMessage(msg);
 }
 
 template <class T, class U>
-size_t broadcast(T package, layout::Layout<U> layout, uint32_t exclude) {
+bool send(T package, layout::Layout<U>& layout) {
   auto variant = painlessmesh::protocol::Variant(package);
-  TSTRING msg;
-  variant.printTo(msg);
-  size_t i = 0;
-  for (auto&& conn : layout.subs) {
-    if (conn->nodeId != 0 && conn->nodeId != exclude) {
-      auto sent = conn->addMessage(msg);
-      if (sent) ++i;
-    }
-  }
-  return i;
+  return send<U>(variant, layout);
 }
 
 template <class T>
-size_t broadcast(protocol::Variant variant, layout::Layout<T> layout,
+size_t broadcast(protocol::Variant& variant, layout::Layout<T>& layout,
                  uint32_t exclude) {
-  TSTRING msg;
-  variant.printTo(msg);
+  // Each format is serialized at most once and the result is shared by the
+  // queues of all connections
+  std::shared_ptr<const TSTRING> json;
+  std::shared_ptr<const TSTRING> binary;
   size_t i = 0;
   for (auto&& conn : layout.subs) {
     if (conn->nodeId != 0 && conn->nodeId != exclude) {
+      auto& msg = (conn->features & protocol::BINARY_FORMAT) ? binary : json;
+      if (!msg) msg = std::make_shared<const TSTRING>(serialize(variant, conn));
       auto sent = conn->addMessage(msg);
       if (sent) ++i;
     }
@@ -97,44 +90,151 @@ size_t broadcast(protocol::Variant variant, layout::Layout<T> layout,
   return i;
 }
 
+template <class T, class U>
+size_t broadcast(T package, layout::Layout<U>& layout, uint32_t exclude) {
+  auto variant = painlessmesh::protocol::Variant(package);
+  return broadcast<U>(variant, layout, exclude);
+}
+
+/**
+ * Send our layout to a neighbour as a NODE_SYNC_REQUEST or NODE_SYNC_REPLY
+ *
+ * The serialized package is cached per neighbour, so periodic syncs of an
+ * unchanged layout are not serialized again.
+ */
+template <class T, class U>
+bool sendNodeSync(T& mesh, std::shared_ptr<U> conn, int type,
+                  bool priority = false) {
+  auto revision = mesh.getTreeRevision();
+  auto& cache = conn->syncCache;
+  if (!cache.reusable || cache.msg.length() == 0 || cache.type != type ||
+      cache.revision != revision || cache.nodeId != conn->nodeId ||
+      cache.features != conn->features || conn->resendRequested) {
+    auto tree = mesh.asNodeTree();
+    protocol::NodeSyncRequest pkg;
+    if (type == protocol::NODE_SYNC_REQUEST) {
+      pkg = conn->request(std::move(tree));
+      auto variant = protocol::Variant(pkg);
+      cache.msg = serialize(variant, conn);
+    } else {
+      auto reply = conn->reply(std::move(tree));
+      auto variant = protocol::Variant(reply);
+      cache.msg = serialize(variant, conn);
+      pkg = reply;
+    }
+    // With delta syncs only a sync without changes can be send again
+    auto unchanged = pkg.delta && pkg.subs.empty() && pkg.removed.empty() &&
+                     pkg.baseHash == pkg.hash;
+    cache.reusable = !pkg.resend &&
+                     (!(conn->features & protocol::DELTA_SYNC) || unchanged);
+    cache.type = type;
+    cache.revision = revision;
+    cache.nodeId = conn->nodeId;
+    cache.features = conn->features;
+  }
+  // Delta syncs must arrive in the order they were made, because each is
+  // based on the one before. A priority sync could overtake a queued one.
+  if (conn->features & protocol::DELTA_SYNC) priority = false;
+  auto sent = conn->addMessage(cache.msg, priority);
+  // The neighbour does not know about this tree, next sync has to be full
+  if (!sent) conn->resetSync();
+  return sent;
+}
+
+/**
+ * Handle the delta and resend fields of a received node sync
+ *
+ * @return Whether the package holds the full tree of the neighbour
+ */
+template <class U>
+bool readNodeSync(std::shared_ptr<U> conn, protocol::NodeSyncRequest& pkg) {
+  conn->features = pkg.features & PAINLESSMESH_FEATURES;
+  if (pkg.resend) conn->resetSync();
+  if (!conn->applyDelta(pkg)) {
+    Log(logger::SYNC,
+        "readNodeSync(): delta from %u does not match, requesting full "
+        "sync\n",
+        conn->nodeId);
+    conn->resendRequested = true;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Handle a received message: send it on, and/or call the callbacks for it
+ *
+ * Packages that are only send on are queued without copying or parsing them
+ * here.
+ */
 template <class T>
-void routePackage(layout::Layout<T> layout, std::shared_ptr<T> connection,
-                  TSTRING pkg, callback::MeshPackageCallbackList<T> cbl, uint32_t receivedAt) {
+void routePackage(layout::Layout<T>& layout, std::shared_ptr<T> connection,
+                  const TSTRING& pkg, callback::MeshPackageCallbackList<T>& cbl,
+                  uint32_t receivedAt) {
   using namespace logger;
-  static size_t baseCapacity = 512;
   Log(COMMUNICATION, "routePackage(): Recvd from %u: %s\n", connection->nodeId,
       pkg.c_str());
-  // Using a ptr so we can overwrite it if we need to grow capacity.
-  // Bug in copy constructor with grown capacity can cause segmentation fault
-  auto variant =
-      std::make_shared<protocol::Variant>(pkg, pkg.length() + baseCapacity);
-  while (variant->error == 3 && baseCapacity <= 20480) {
-    // Not enough memory, adapt scaling (variant::capacityScaling) and log the
-    // new value
-    Log(DEBUG,
-        "routePackage(): parsing failed. err=%u, increasing capacity: %u\n",
-        variant->error, baseCapacity);
-    baseCapacity += 256;
-    variant =
-        std::make_shared<protocol::Variant>(pkg, pkg.length() + baseCapacity);
+
+  // SINGLE packages meant for another node are send on as is, we only need
+  // their header to know where to send them
+  protocol::Header header;
+  auto peeked = protocol::peekHeader(pkg, header);
+  if (peeked && header.routing == SINGLE && header.dest != layout.getNodeId()) {
+    if (layout.relays(header.type)) {
+      // Plugins can answer some packages on behalf of their destination
+      ++layout.parsedPackages;
+      protocol::Variant variant(pkg);
+      if (!variant.error && layout.relay(variant)) return;
+    } else {
+      ++layout.forwardedPackages;
+    }
+    auto conn = findRoute<T>(layout, header.dest);
+    if (!conn) return;
+    if (binary::isFrame(pkg.c_str(), pkg.length()) &&
+        !(conn->features & protocol::BINARY_FORMAT)) {
+      // Next hop does not understand the binary format
+      protocol::Variant variant(pkg);
+      send<T>(variant, conn);
+      return;
+    }
+    conn->addMessage(pkg);
+    return;
+  }
+
+  // Broadcasts can come back to us through a loop in the mesh, drop them
+  // before they are handled or flooded again
+  if (peeked && header.routing == BROADCAST &&
+      (header.from == layout.getNodeId() ||
+       (header.seq != 0 &&
+        layout.seenBroadcasts.seen(header.from, header.seq)))) {
+    ++layout.duplicatePackages;
+    Log(COMMUNICATION, "routePackage(): Dropped duplicate broadcast %u/%u\n",
+        header.from, header.seq);
+    return;
   }
-  if (variant->error) {
+
+  ++layout.parsedPackages;
+  // The capacity is measured up front, so parsing only fails on bad input
+  protocol::Variant variant(pkg);
+  if (variant.error) {
     Log(ERROR,
         "routePackage(): parsing failed. err=%u, total_length=%d, data=%s<--\n",
-        variant->error, pkg.length(), pkg.c_str());
+        variant.error, pkg.length(), pkg.c_str());
     return;
   }
 
-  if (variant->routing() == SINGLE && variant->dest() != layout.getNodeId()) {
-    // Send on without further processing
-    send<T>((*variant), layout);
+  if (variant.routing() == SINGLE && variant.dest() != layout.getNodeId()) {
+    // Send on without further processing. Normally these are already handled
+    // by the header check above
+    if (layout.relay(variant)) return;
+    send<T>(variant, layout);
     return;
-  } else if (variant->routing() == BROADCAST) {
-    broadcast<T>((*variant), layout, connection->nodeId);
+  } else if (variant.routing() == BROADCAST) {
+    broadcast<T>(variant, layout, connection->nodeId);
   }
-  auto calls = cbl.execute(variant->type(), (*variant), connection, receivedAt);
+  auto calls = cbl.execute(variant.type(), variant, connection, receivedAt);
   if (calls == 0)
-    Log(DEBUG, "routePackage(): No callbacks executed; %u, %s\n", variant->type(), pkg.c_str());
+    Log(DEBUG, "routePackage(): No callbacks executed; %u, %s\n", variant.type(), pkg.c_str());
 }
 
 template <class T, class U>
@@ -171,17 +271,16 @@ void handleNodeSync(T& mesh, protocol::NodeTree newTree,
     // after first succesfull sync
     // TODO move it to a new connection callback and use initTimeSync from
     // ntp.hpp
-    conn->timeSyncTask.set(10 * TASK_SECOND, TASK_FOREVER, [conn, &mesh]() {
+    conn->timeSyncTimer.set(10 * TASK_SECOND, TASK_FOREVER, [conn, &mesh]() {
       Log(logger::S_TIME, "timeSyncTask(): %u\n", conn->nodeId);
       mesh.startTimeSync(conn);
     });
-    mesh.mScheduler->addTask(conn->timeSyncTask);
     if (conn->station)
       // We are STA, request time immediately
-      conn->timeSyncTask.enable();
+      conn->timeSyncTimer.enable();
     else
       // We are the AP, give STA the change to initiate time sync
-      conn->timeSyncTask.enableDelayed();
+      conn->timeSyncTimer.enableDelayed();
     conn->newConnection = false;
   }
 
@@ -190,7 +289,10 @@ void handleNodeSync(T& mesh, protocol::NodeTree newTree,
       mesh.changedConnectionCallbacks.execute(nodeId);
     });
   } else {
-    conn->nodeSyncTask.delay();
+    // Postponing the next sync is only safe if the neighbour knows our current
+    // layout, otherwise it would cancel a sync forced by syncLayout()
+    if (conn->syncCache.revision == mesh.getTreeRevision())
+      conn->nodeSyncTimer.delay();
     mesh.stability += std::min(1000 - mesh.stability, (size_t)25);
   }
 }
@@ -201,23 +303,27 @@ callback::MeshPackageCallbackList<U> addPackageCallback(
   // REQUEST type,
   callbackList.onPackage(
       protocol::NODE_SYNC_REQUEST,
-      [&mesh](protocol::Variant variant, std::shared_ptr<U> connection,
+      [&mesh](protocol::Variant& variant, std::shared_ptr<U> connection,
               uint32_t receivedAt) {
         auto newTree = variant.to<protocol::NodeSyncRequest>();
-        handleNodeSync<T, U>(mesh, newTree, connection);
-        send<protocol::NodeSyncReply>(
-            connection->reply(std::move(mesh.asNodeTree())), connection, true);
+        if (readNodeSync(connection, newTree))
+          handleNodeSync<T, U>(mesh, newTree, connection);
+        sendNodeSync<T, U>(mesh, connection, protocol::NODE_SYNC_REPLY, true);
         return false;
       });
 
   // Reply type just handle it
   callbackList.onPackage(
       protocol::NODE_SYNC_REPLY,
-      [&mesh](protocol::Variant variant, std::shared_ptr<U> connection,
+      [&mesh](protocol::Variant& variant, std::shared_ptr<U> connection,
               uint32_t receivedAt) {
         auto newTree = variant.to<protocol::NodeSyncReply>();
-        handleNodeSync<T, U>(mesh, newTree, connection);
-        connection->timeOutTask.disable();
+        if (readNodeSync(connection, newTree))
+          handleNodeSync<T, U>(mesh, newTree, connection);
+        // Send the requested full tree (or our request for it) right away
+        if (newTree.resend || connection->resendRequested)
+          connection->nodeSyncTimer.forceNextIteration();
+        connection->timeOutTimer.disable();
         return false;
       });
 
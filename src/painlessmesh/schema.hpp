@@ -0,0 +1,184 @@
+#ifndef _PAINLESS_MESH_SCHEMA_HPP_
+#define _PAINLESS_MESH_SCHEMA_HPP_
+
+#include <type_traits>
+
+#include "painlessmesh/configuration.hpp"
+
+namespace painlessmesh {
+
+/**
+ * Packages described by a list of their fields
+ *
+ * Instead of writing addTo(), a JsonObject constructor and an estimate of
+ * jsonObjectSize() by hand, a package lists its fields once in a visit()
+ * member template. The functions in this namespace use that list to read and
+ * write the json object and to calculate the exact capacity needed. The
+ * binary format is written from the json object, so it follows automatically.
+ *
+ * \code
+ * class SensorPackage : public plugin::SinglePackage {
+ *  public:
+ *   double temperature = 0;
+ *   TSTRING unit;
+ *
+ *   SensorPackage() : SinglePackage(20) {}
+ *
+ *   SensorPackage(JsonObject jsonObj) : SinglePackage(20) {
+ *     schema::read(*this, jsonObj);
+ *   }
+ *
+ *   JsonObject addTo(JsonObject&& jsonObj) const {
+ *     return schema::write(*this, std::move(jsonObj));
+ *   }
+ *
+ *   size_t jsonObjectSize() const { return schema::jsonObjectSize(*this); }
+ *
+ *   template <class V>
+ *   void visit(V& v) {
+ *     SinglePackage::visit(v);
+ *     v("temperature", temperature);
+ *     v("unit", unit);
+ *   }
+ * };
+ * \endcode
+ *
+ * Keys should be string literals, they are not copied into the document.
+ * Fields added with v.optional() are left out when they have their default
+ * value, and are left unchanged when they are missing.
+ */
+namespace schema {
+
+/**
+ * Read the fields from a json object
+ */
+class Reader {
+ public:
+  Reader(JsonObject obj) : obj(obj) {}
+
+  template <class T>
+  void operator()(const char* key, T& value) {
+    read(obj[key], value);
+  }
+
+  template <class T>
+  void optional(const char* key, T& value) {
+    auto var = obj[key];
+    if (!var.isNull()) read(var, value);
+  }
+
+ protected:
+  JsonObject obj;
+
+  template <class T>
+  static typename std::enable_if<!std::is_enum<T>::value>::type read(
+      JsonVariant var, T& value) {
+    value = var.as<T>();
+  }
+
+  template <class T>
+  static typename std::enable_if<std::is_enum<T>::value>::type read(
+      JsonVariant var, T& value) {
+    value = static_cast<T>(var.as<int>());
+  }
+};
+
+/**
+ * Write the fields to a json object
+ */
+class Writer {
+ public:
+  Writer(JsonObject obj) : obj(obj) {}
+
+  template <class T>
+  void operator()(const char* key, const T& value) {
+    write(key, value);
+  }
+
+  template <class T>
+  void optional(const char* key, const T& value) {
+    if (!(value == T())) write(key, value);
+  }
+
+ protected:
+  JsonObject obj;
+
+  template <class T>
+  typename std::enable_if<!std::is_enum<T>::value>::type write(
+      const char* key, const T& value) {
+    obj[key] = value;
+  }
+
+  template <class T>
+  typename std::enable_if<std::is_enum<T>::value>::type write(
+      const char* key, const T& value) {
+    obj[key] = static_cast<int>(value);
+  }
+};
+
+/**
+ * Calculate the capacity the fields need in a json document
+ */
+class Size {
+ public:
+  size_t fields = 0;
+  // Strings are copied into the document, including their terminating zero
+  size_t strings = 0;
+
+  template <class T>
+  void operator()(const char* key, const T& value) {
+    add(value);
+  }
+
+  template <class T>
+  void optional(const char* key, const T& value) {
+    if (!(value == T())) add(value);
+  }
+
+  size_t capacity() const { return JSON_OBJECT_SIZE(fields) + strings; }
+
+ protected:
+  template <class T>
+  void add(const T& value) {
+    ++fields;
+  }
+
+  void add(const TSTRING& value) {
+    ++fields;
+    strings += value.length() + 1;
+  }
+};
+
+/**
+ * Read all fields of the package from the json object
+ */
+template <class T>
+void read(T& pkg, JsonObject obj) {
+  Reader reader(obj);
+  pkg.visit(reader);
+}
+
+/**
+ * Write all fields of the package to the json object
+ */
+template <class T>
+JsonObject write(const T& pkg, JsonObject&& obj) {
+  Writer writer(obj);
+  // visit() is shared with read(), but writing does not change the package
+  const_cast<T&>(pkg).visit(writer);
+  return obj;
+}
+
+/**
+ * The exact capacity needed to hold the package in a json document
+ */
+template <class T>
+size_t jsonObjectSize(const T& pkg) {
+  Size size;
+  const_cast<T&>(pkg).visit(size);
+  return size.capacity();
+}
+
+}  // namespace schema
+}  // namespace painlessmesh
+#endif
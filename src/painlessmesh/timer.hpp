@@ -0,0 +1,125 @@
+#ifndef _PAINLESS_MESH_TIMER_HPP_
+#define _PAINLESS_MESH_TIMER_HPP_
+
+#include <functional>
+
+#include "Arduino.h"
+#include "painlessmesh/configuration.hpp"
+
+namespace painlessmesh {
+namespace timer {
+
+/**
+ * \brief A recurring deadline that is run by a shared task
+ *
+ * Connections used to register a Task for each of their periodic activities
+ * (node sync, time sync, time out), so the length of the scheduler chain grew
+ * with the number of connections. A Timer only stores its next deadline. All
+ * timers are run by one mesh wide task (see Mesh::handleTimers()), which
+ * sleeps until the earliest deadline.
+ *
+ * The api mirrors the part of the Task api that was used, so the timers
+ * behave the same as the tasks they replace. Any change that can move the
+ * deadline forward wakes up the shared task.
+ */
+class Timer {
+ public:
+  /**
+   * Set the interval and callback
+   *
+   * \param iterations Either TASK_ONCE or TASK_FOREVER
+   */
+  void set(uint32_t interval, long iterations, std::function<void()> callback) {
+    this->interval = interval;
+    this->once = iterations == TASK_ONCE;
+    this->callback = callback;
+    this->enabled = false;
+  }
+
+  /**
+   * The task that runs this timer and should be woken up on changes
+   */
+  void attach(Task *task) { wake = task; }
+
+  /**
+   * Run the callback as soon as possible
+   */
+  void enable() { schedule(0); }
+
+  /**
+   * Run the callback after the given delay, or after one interval if the delay
+   * is zero
+   */
+  void enableDelayed(uint32_t delay = 0) {
+    schedule(delay == 0 ? interval : delay);
+  }
+
+  void restartDelayed(uint32_t delay = 0) { enableDelayed(delay); }
+
+  /**
+   * Postpone the next run by the given delay, or by one interval if the delay
+   * is zero. Like Task::delay() this does not enable the timer.
+   */
+  void delay(uint32_t delay = 0) {
+    next = millis() + (delay == 0 ? interval : delay);
+    if (enabled && wake) wake->forceNextIteration();
+  }
+
+  void forceNextIteration() { schedule(0); }
+
+  void disable() { enabled = false; }
+
+  bool isEnabled() { return enabled; }
+
+  /**
+   * Disable the timer and drop the callback (and anything it holds on to)
+   */
+  void clear() {
+    enabled = false;
+    callback = NULL;
+    wake = NULL;
+  }
+
+  /**
+   * Time left before the timer is due, zero if it is due already
+   */
+  uint32_t remaining(uint32_t now) {
+    int32_t left = next - now;  // Safe when millis() wraps around
+    return left > 0 ? left : 0;
+  }
+
+  /**
+   * Run the callback if the timer is due
+   *
+   * \return Whether the callback was run
+   */
+  bool run(uint32_t now) {
+    if (!enabled || remaining(now) > 0) return false;
+    if (once)
+      enabled = false;
+    else
+      next = now + interval;
+    // Run a copy, the callback might clear() this timer
+    auto cb = callback;
+    if (cb) cb();
+    return true;
+  }
+
+ protected:
+  std::function<void()> callback;
+  Task *wake = NULL;
+  uint32_t interval = 0;
+  uint32_t next = 0;
+  bool enabled = false;
+  bool once = false;
+
+  void schedule(uint32_t delay) {
+    enabled = true;
+    next = millis() + delay;
+    if (wake) wake->forceNextIteration();
+  }
+};
+
+}  // namespace timer
+}  // namespace painlessmesh
+#endif
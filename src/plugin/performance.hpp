@@ -64,27 +64,24 @@ class PerformancePackage : public plugin::BroadcastPackage {
 #endif
   PerformancePackage() : plugin::BroadcastPackage(13) {}
 
-  PerformancePackage(JsonObject jsonObj) : plugin::BroadcastPackage(jsonObj) {
-    id = jsonObj["id"];
-    time = jsonObj["time"];
-    stability = jsonObj["stability"];
-    freeMemory = jsonObj["freeMemory"];
-    hardware = jsonObj["hardware"].as<TSTRING>();
+  PerformancePackage(JsonObject jsonObj) : plugin::BroadcastPackage(13) {
+    schema::read(*this, jsonObj);
   }
 
   JsonObject addTo(JsonObject&& jsonObj) const {
-    jsonObj = BroadcastPackage::addTo(std::move(jsonObj));
-    jsonObj["type"] = type;
-    jsonObj["id"] = id;
-    jsonObj["time"] = time;
-    jsonObj["stability"] = stability;
-    jsonObj["freeMemory"] = freeMemory;
-    jsonObj["hardware"] = hardware;
-    return jsonObj;
+    return schema::write(*this, std::move(jsonObj));
   }
 
-  size_t jsonObjectSize() const {
-    return JSON_OBJECT_SIZE(4 + 5) + round(2 * (hardware.length()));
+  size_t jsonObjectSize() const { return schema::jsonObjectSize(*this); }
+
+  template <class V>
+  void visit(V& v) {
+    BroadcastPackage::visit(v);
+    v("id", id);
+    v("time", time);
+    v("stability", stability);
+    v("freeMemory", freeMemory);
+    v("hardware", hardware);
   }
 };
 
@@ -144,7 +141,7 @@ void begin(T& mesh, double frequency = 2) {
   auto tracker = std::make_shared<TrackMap>();
   auto sendPkg = std::make_shared<PerformancePackage>();
 
-  mesh.onPackage(sendPkg->type, [&mesh, tracker](protocol::Variant var) {
+  mesh.onPackage(sendPkg->type, [&mesh, tracker](protocol::Variant& var) {
     auto pkg = var.to<PerformancePackage>();
     // if not in tracker, add it
     if (!tracker->count(pkg.from)) {
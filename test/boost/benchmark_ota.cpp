@@ -0,0 +1,153 @@
+/*
+ * Measure how long it takes to update a mesh over the loopback interface
+ *
+ * Usage: benchmark_ota [--nodes n] [--depth d] [--seed s] [--mb m] [--kb k]
+ *                      [--timeout s]
+ *
+ * The first node distributes a random image of the given size (--kb overrides
+ * --mb), the other nodes receive it in memory (see ota::MemorySink) and keep
+ * a cache of the parts they relay. Distribution starts once all nodes joined
+ * the mesh. The result is printed as a single line of json, e.g.
+ *
+ * {"nodes":20,"depth":5,"seed":1,"image_bytes":1048576,"parts":1024,
+ *  "updated":19,"transfer_ms":51234,"links":19,"total_bytes":45678901,
+ *  "bytes_per_link":2404152,"max_link_bytes":9876543,"broadcasts":812,
+ *  "unicasts":3456,"cache_hits":123}
+ *
+ * Bytes are counted in both directions of a link, including all other
+ * traffic during the update.
+ */
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+
+#include "Arduino.h"
+
+#include "boost/asynctcp.hpp"
+
+WiFiClass WiFi;
+ESPClass ESP;
+
+#include "mesh_test.hpp"
+
+#include "painlessmesh/ota.hpp"
+
+using namespace painlessmesh;
+painlessmesh::logger::LogClass Log;
+
+/**
+ * Bytes sent over each link, in both directions
+ */
+std::map<std::pair<uint32_t, uint32_t>, size_t> linkBytes(Nodes &n) {
+  std::map<std::pair<uint32_t, uint32_t>, size_t> bytes;
+  for (auto &&node : n.nodes) {
+    for (auto &&conn : node->subs) {
+      auto id = node->getNodeId();
+      auto link = std::make_pair(std::min(id, conn->nodeId),
+                                 std::max(id, conn->nodeId));
+      bytes[link] += conn->client->bytesSent;
+    }
+  }
+  return bytes;
+}
+
+int main(int argc, char *argv[]) {
+  size_t nodes = 20;
+  size_t depth = 0;
+  uint32_t seed = rd();
+  size_t imageBytes = 1024 * 1024;
+  uint32_t timeout = 600;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    auto value = std::strtoul(argv[i + 1], NULL, 10);
+    if (strcmp(argv[i], "--nodes") == 0)
+      nodes = value;
+    else if (strcmp(argv[i], "--depth") == 0)
+      depth = value;
+    else if (strcmp(argv[i], "--seed") == 0)
+      seed = value;
+    else if (strcmp(argv[i], "--mb") == 0)
+      imageBytes = value * 1024 * 1024;
+    else if (strcmp(argv[i], "--kb") == 0)
+      imageBytes = value * 1024;
+    else if (strcmp(argv[i], "--timeout") == 0)
+      timeout = value;
+    else {
+      std::cerr << "Unknown option " << argv[i] << std::endl;
+      return 1;
+    }
+  }
+  if (nodes < 2 || imageBytes == 0) {
+    std::cerr << "At least two nodes and a non empty image are needed"
+              << std::endl;
+    return 1;
+  }
+  // Logging is left off, so the output is only the result
+  gen.seed(seed);
+
+  Scheduler scheduler;
+  boost::asio::io_service io_service;
+  Nodes n(&scheduler, nodes, io_service, depth);
+
+  auto deadline = millis() + timeout * 1000;
+  while (layout::size(n.nodes[0]->asNodeTree()) < n.size() &&
+         millis() < deadline) {
+    n.update();
+    delay(10);
+  }
+
+  using namespace plugin::ota;
+  State current;
+  current.role = "benchmark";
+  size_t updated = 0;
+  auto image = std::make_shared<const std::string>(randomString(imageBytes));
+  std::vector<std::shared_ptr<Cache>> caches;
+  for (auto &&node : n.nodes) {
+    if (node == n.nodes[0]) continue;
+    caches.push_back(addCache(*node));
+    auto sink = std::make_shared<MemorySink>();
+    sink->onEnd = [&updated, image](const std::string &received) {
+      if (received == *image) ++updated;
+      return true;
+    };
+    addUpdater(scheduler, *node, current, sink);
+  }
+
+  auto before = linkBytes(n);
+  auto start = millis();
+  Announce announce;
+  announce.role = current.role;
+  announce.hardware = current.hardware;
+  auto distributor = addDistributor(scheduler, *n.nodes[0], announce, image,
+                                    OTA_PART_SIZE, 5 * TASK_SECOND);
+  while (updated < n.size() - 1 && millis() < deadline) {
+    n.update();
+    delay(10);
+  }
+  auto transferMs = millis() - start;
+
+  size_t total = 0;
+  size_t maxLink = 0;
+  auto after = linkBytes(n);
+  for (auto &&pair : after) {
+    auto bytes = pair.second - before[pair.first];
+    total += bytes;
+    maxLink = std::max(maxLink, bytes);
+  }
+  size_t hits = 0;
+  for (auto &&cache : caches) hits += cache->hits;
+
+  std::cout << "{\"nodes\":" << n.size() << ",\"depth\":" << n.depth()
+            << ",\"seed\":" << seed << ",\"image_bytes\":" << image->length()
+            << ",\"parts\":"
+            << (image->length() + OTA_PART_SIZE - 1) / OTA_PART_SIZE
+            << ",\"updated\":" << updated << ",\"transfer_ms\":" << transferMs
+            << ",\"links\":" << after.size() << ",\"total_bytes\":" << total
+            << ",\"bytes_per_link\":" << (after.size() ? total / after.size() : 0)
+            << ",\"max_link_bytes\":" << maxLink
+            << ",\"broadcasts\":" << distributor->broadcasts
+            << ",\"unicasts\":" << distributor->unicasts
+            << ",\"cache_hits\":" << hits << "}" << std::endl;
+  n.stop();
+  return updated == n.size() - 1 ? 0 : 2;
+}
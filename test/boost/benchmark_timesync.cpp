@@ -0,0 +1,126 @@
+/*
+ * Measure how fast the time sync converges on a mesh over the loopback
+ * interface
+ *
+ * Usage: benchmark_timesync [--nodes n] [--depth d] [--seed s]
+ *                           [--updates u] [--skew us] [--settle u]
+ *
+ * Every node starts with a random time offset. The mesh is updated until the
+ * time of all nodes is within the given skew of each other (or the maximum
+ * number of updates is reached), then for a number of settle updates. The
+ * result is printed as a single line of json, e.g.
+ *
+ * {"nodes":12,"depth":4,"seed":1,"converged":true,"updates":2345,
+ *  "convergence_ms":5123,"time_sync_messages":412,"max_skew_us":812}
+ */
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "Arduino.h"
+
+#include "boost/asynctcp.hpp"
+
+WiFiClass WiFi;
+ESPClass ESP;
+
+#include "mesh_test.hpp"
+
+using namespace painlessmesh;
+painlessmesh::logger::LogClass Log;
+
+/**
+ * The largest difference between the node times (in us)
+ */
+uint32_t maxSkew(Nodes &n) {
+  auto base = n.nodes[0]->getNodeTime();
+  int32_t min = 0;
+  int32_t max = 0;
+  for (auto &&node : n.nodes) {
+    int32_t diff = node->getNodeTime() - base;
+    min = std::min(min, diff);
+    max = std::max(max, diff);
+  }
+  return max - min;
+}
+
+int main(int argc, char *argv[]) {
+  size_t nodes = 12;
+  size_t depth = 0;
+  uint32_t seed = rd();
+  size_t maxUpdates = 20000;
+  uint32_t skew = 10000;
+  size_t settle = 1000;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    auto value = std::strtoul(argv[i + 1], NULL, 10);
+    if (strcmp(argv[i], "--nodes") == 0)
+      nodes = value;
+    else if (strcmp(argv[i], "--depth") == 0)
+      depth = value;
+    else if (strcmp(argv[i], "--seed") == 0)
+      seed = value;
+    else if (strcmp(argv[i], "--updates") == 0)
+      maxUpdates = value;
+    else if (strcmp(argv[i], "--skew") == 0)
+      skew = value;
+    else if (strcmp(argv[i], "--settle") == 0)
+      settle = value;
+    else {
+      std::cerr << "Unknown option " << argv[i] << std::endl;
+      return 1;
+    }
+  }
+  if (nodes < 2) {
+    std::cerr << "At least two nodes are needed" << std::endl;
+    return 1;
+  }
+  // Logging is left off, so the output is only the result
+  gen.seed(seed);
+
+  Scheduler scheduler;
+  boost::asio::io_service io_service;
+  Nodes n(&scheduler, nodes, io_service, depth);
+
+  size_t messages = 0;
+  for (auto &&node : n.nodes) {
+    node->onPackage(protocol::TIME_SYNC, [&messages](protocol::Variant &) {
+      ++messages;
+      return false;
+    });
+  }
+
+  auto start = millis();
+  size_t updates = 0;
+  bool converged = false;
+  uint32_t convergenceMs = 0;
+  size_t convergenceMessages = 0;
+  while (updates < maxUpdates) {
+    n.update();
+    ++updates;
+    delay(10);
+    // Nodes that have not joined yet are not synced, even if they happen to
+    // be close
+    if (layout::size(n.nodes[0]->asNodeTree()) == n.size() &&
+        maxSkew(n) < skew) {
+      converged = true;
+      convergenceMs = millis() - start;
+      convergenceMessages = messages;
+      break;
+    }
+  }
+  for (size_t i = 0; converged && i < settle; ++i) {
+    n.update();
+    delay(10);
+  }
+
+  std::cout << "{\"nodes\":" << n.size() << ",\"depth\":" << n.depth()
+            << ",\"seed\":" << seed
+            << ",\"converged\":" << (converged ? "true" : "false")
+            << ",\"updates\":" << updates
+            << ",\"convergence_ms\":" << convergenceMs
+            << ",\"time_sync_messages\":"
+            << (converged ? convergenceMessages : messages)
+            << ",\"max_skew_us\":" << maxSkew(n) << "}" << std::endl;
+  n.stop();
+  return converged ? 0 : 2;
+}
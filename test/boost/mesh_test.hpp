@@ -0,0 +1,96 @@
+#ifndef _PAINLESS_MESH_TEST_BOOST_MESH_TEST_HPP_
+#define _PAINLESS_MESH_TEST_BOOST_MESH_TEST_HPP_
+
+/*
+ * Meshes connected over the loopback interface, shared by the boost based
+ * tests and benchmarks
+ */
+
+#include "Arduino.h"
+
+#include "catch_utils.hpp"
+
+#include "boost/asynctcp.hpp"
+
+#include "painlessMeshConnection.h"
+
+#include "painlessmesh/mesh.hpp"
+
+using PMesh = painlessmesh::Mesh<MeshConnection>;
+
+class MeshTest : public PMesh {
+ public:
+  MeshTest(Scheduler *scheduler, size_t id, boost::asio::io_service &io)
+      : io_service(io) {
+    this->nodeId = id;
+    this->init(scheduler, this->nodeId);
+    timeOffset = runif(0, 1e09);
+    pServer = std::make_shared<AsyncServer>(io_service, this->nodeId);
+    painlessmesh::tcp::initServer<MeshConnection, PMesh>(*pServer, (*this));
+  }
+
+  void connect(MeshTest &mesh) {
+    auto pClient = new AsyncClient(io_service);
+    painlessmesh::tcp::connect<MeshConnection, PMesh>(
+        (*pClient), boost::asio::ip::address::from_string("127.0.0.1"),
+        mesh.nodeId, (*this));
+  }
+
+  std::shared_ptr<AsyncServer> pServer;
+  boost::asio::io_service &io_service;
+};
+
+class Nodes {
+ public:
+  /**
+   * Create n nodes, each connected to a random earlier node
+   *
+   * \param maxDepth Limit the number of hops from the first node, zero for no
+   * limit
+   */
+  Nodes(Scheduler *scheduler, size_t n, boost::asio::io_service &io,
+        size_t maxDepth = 0)
+      : io_service(io) {
+    std::vector<size_t> candidates;
+    for (size_t i = 0; i < n; ++i) {
+      auto m = std::make_shared<MeshTest>(scheduler, i + baseID, io_service);
+      size_t depth = 0;
+      if (i > 0) {
+        auto parent = candidates[runif(0, candidates.size() - 1)];
+        m->connect((*nodes[parent]));
+        depth = depths[parent] + 1;
+      }
+      if (maxDepth == 0 || depth < maxDepth) candidates.push_back(i);
+      depths.push_back(depth);
+      nodes.push_back(m);
+    }
+  }
+
+  void update() {
+    for (auto &&m : nodes) {
+      m->update();
+      io_service.poll();
+    }
+  }
+
+  void stop() {
+    for (auto &&m : nodes) m->stop();
+  }
+
+  auto size() { return nodes.size(); }
+
+  /**
+   * The number of hops between the first and the furthest node
+   */
+  size_t depth() { return *std::max_element(depths.begin(), depths.end()); }
+
+  std::shared_ptr<MeshTest> get(size_t nodeId) {
+    return nodes[nodeId - baseID];
+  }
+
+  size_t baseID = 6481;
+  std::vector<std::shared_ptr<MeshTest>> nodes;
+  std::vector<size_t> depths;
+  boost::asio::io_service &io_service;
+};
+#endif
@@ -4,76 +4,16 @@
 
 #include "Arduino.h"
 
-#include "catch_utils.hpp"
-
 #include "boost/asynctcp.hpp"
 
 WiFiClass WiFi;
 ESPClass ESP;
 
-#include "painlessMeshConnection.h"
-
-#include "painlessmesh/mesh.hpp"
-
-using PMesh = painlessmesh::Mesh<MeshConnection>;
+#include "mesh_test.hpp"
 
 using namespace painlessmesh;
 painlessmesh::logger::LogClass Log;
 
-class MeshTest : public PMesh {
- public:
-  MeshTest(Scheduler *scheduler, size_t id, boost::asio::io_service &io)
-      : io_service(io) {
-    this->nodeId = id;
-    this->init(scheduler, this->nodeId);
-    timeOffset = runif(0, 1e09);
-    pServer = std::make_shared<AsyncServer>(io_service, this->nodeId);
-    painlessmesh::tcp::initServer<MeshConnection, PMesh>(*pServer, (*this));
-  }
-
-  void connect(MeshTest &mesh) {
-    auto pClient = new AsyncClient(io_service);
-    painlessmesh::tcp::connect<MeshConnection, PMesh>(
-        (*pClient), boost::asio::ip::address::from_string("127.0.0.1"),
-        mesh.nodeId, (*this));
-  }
-
-  std::shared_ptr<AsyncServer> pServer;
-  boost::asio::io_service &io_service;
-};
-
-class Nodes {
- public:
-  Nodes(Scheduler *scheduler, size_t n, boost::asio::io_service &io)
-      : io_service(io) {
-    for (size_t i = 0; i < n; ++i) {
-      auto m = std::make_shared<MeshTest>(scheduler, i + baseID, io_service);
-      if (i > 0) m->connect((*nodes[runif(0, i - 1)]));
-      nodes.push_back(m);
-    }
-  }
-  void update() {
-    for (auto &&m : nodes) {
-      m->update();
-      io_service.poll();
-    }
-  }
-
-  void stop() {
-    for (auto &&m : nodes) m->stop();
-  }
-
-  auto size() { return nodes.size(); }
-
-  std::shared_ptr<MeshTest> get(size_t nodeId) {
-    return nodes[nodeId - baseID];
-  }
-
-  size_t baseID = 6481;
-  std::vector<std::shared_ptr<MeshTest>> nodes;
-  boost::asio::io_service &io_service;
-};
-
 SCENARIO("We can setup and connect two meshes over localport") {
   using namespace logger;
   Scheduler scheduler;
@@ -397,3 +337,71 @@ SCENARIO("Disconnects don't lead to crashes") {
   n.stop();
   REQUIRE(y > 0);
 }
+
+SCENARIO("Unsignalled work is picked up while other connections keep IO busy") {
+  using namespace logger;
+  Log.setLogLevel(ERROR);
+
+  Scheduler scheduler;
+  boost::asio::io_service io_service;
+  MeshTest mesh1(&scheduler, 6841, io_service);
+  MeshTest mesh2(&scheduler, 6842, io_service);
+  MeshTest mesh3(&scheduler, 6843, io_service);
+  mesh2.connect(mesh1);
+  mesh3.connect(mesh1);
+
+  for (auto i = 0; i < 100; ++i) {
+    mesh1.update();
+    mesh2.update();
+    mesh3.update();
+    io_service.poll();
+  }
+  REQUIRE(layout::size(mesh1.asNodeTree()) == 3);
+
+  size_t busy = 0;
+  size_t retried = 0;
+  size_t busyWhenRetried = 0;
+  mesh1.onReceive([&](auto id, auto msg) {
+    if (msg == "Busy") ++busy;
+    if (msg == "Retried") {
+      ++retried;
+      busyWhenRetried = busy;
+    }
+  });
+
+  // A message that nothing signals, like the work left after a failed write
+  std::shared_ptr<MeshConnection> conn;
+  for (auto&& sub : mesh1.subs) {
+    if (sub->nodeId == mesh3.getNodeId()) conn = sub;
+  }
+  REQUIRE(conn);
+  std::string msg = "Retried";
+  auto single = protocol::Single(mesh3.getNodeId(), mesh1.getNodeId(), msg);
+  std::string frame;
+  protocol::Variant(&single).printTo(frame);
+  conn->receiveBuffer.push(frame.c_str(), frame.length() + 1);
+  mesh1.retryIO(100);
+
+  // mesh2 sends more than mesh1 handles per pass, so the queue is never empty
+  mesh1.setIOBudget(1);
+  size_t sent = 0;
+  auto start = millis();
+  while (retried == 0 && millis() - start < 1000) {
+    for (auto i = 0; i < 2; ++i) {
+      mesh2.sendSingle(mesh1.getNodeId(), "Busy");
+      ++sent;
+    }
+    mesh1.update();
+    mesh2.update();
+    mesh3.update();
+    io_service.poll();
+  }
+
+  REQUIRE(retried == 1);
+  REQUIRE(busyWhenRetried > 0);
+  REQUIRE(busyWhenRetried < sent);
+
+  mesh1.stop();
+  mesh2.stop();
+  mesh3.stop();
+}
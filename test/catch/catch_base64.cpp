@@ -2,17 +2,174 @@
 
 #include "catch2/catch.hpp"
 
+#include <chrono>
+#include <iostream>
+
 #include "painlessmesh/configuration.hpp"
 
 #include "painlessmesh/base64.hpp"
 
 #include "catch_utils.hpp"
 
+using namespace painlessmesh;
+
 SCENARIO("Base64 encoding can succesfully be decoded") {
-  using namespace painlessmesh;
   auto bindata = randomString(100);
   auto enc = base64::encode(bindata);
   auto dec = base64::decode(enc);
   REQUIRE(dec.length() > 0);
   REQUIRE(dec == bindata);
 }
+
+SCENARIO("Base64 matches the reference values") {
+  // Test vectors from RFC 4648
+  std::vector<std::pair<std::string, std::string>> suite = {
+      {"", ""},         {"f", "Zg=="},         {"fo", "Zm8="},
+      {"foo", "Zm9v"},  {"foob", "Zm9vYg=="},  {"fooba", "Zm9vYmE="},
+      {"foobar", "Zm9vYmFy"}};
+  for (auto&& pair : suite) {
+    REQUIRE(base64::encode(pair.first) == pair.second);
+    REQUIRE(base64::decode(pair.second) == pair.first);
+  }
+  std::string text = "The quick brown fox jumps over the lazy dog, twice. "
+                     "The quick brown fox jumps over the lazy dog, twice.";
+  std::string encoded =
+      "VGhlIHF1aWNrIGJyb3duIGZveCBqdW1wcyBvdmVyIHRoZSBsYXp5IGRvZywgdHdpY2UuIF"
+      "RoZSBxdWljayBicm93biBmb3gganVtcHMgb3ZlciB0aGUgbGF6eSBkb2csIHR3aWNlLg==";
+  REQUIRE(base64::encode(text) == encoded);
+  REQUIRE(base64::decode(encoded) == text);
+}
+
+SCENARIO("Base64 works for every length and all byte values") {
+  std::string bytes;
+  for (auto i = 0; i < 256; ++i) bytes += (char)i;
+  bytes += randomString(200);
+  for (size_t length = 0; length <= bytes.length(); ++length) {
+    auto data = bytes.substr(0, length);
+    std::string out(base64::encodedLength(length), '\0');
+    auto written =
+        base64::encode((const unsigned char*)data.c_str(), length, &out[0]);
+    REQUIRE(written == out.length());
+    REQUIRE(out == base64::encode(data));
+    auto size = base64::decodedLength(out.c_str(), out.length());
+    REQUIRE(size == length);
+    std::string dec(size, '\0');
+    REQUIRE(base64::decode(out.c_str(), out.length(), (unsigned char*)&dec[0]) ==
+            size);
+    REQUIRE(dec == data);
+  }
+}
+
+SCENARIO("Base64 decodes unpadded data without reading past its end") {
+  std::vector<std::pair<std::string, std::string>> suite = {
+      {"f", "Zg"},       {"fo", "Zm8"},       {"foob", "Zm9vYg"},
+      {"fooba", "Zm9vYmE"}};
+  for (auto&& pair : suite) {
+    auto length = pair.second.length();
+    REQUIRE(base64::decodedLength(pair.second.c_str(), length) ==
+            pair.first.length());
+    // Followed by more data instead of a terminator or padding
+    auto buffer = pair.second + "QUJD";
+    std::string dec(pair.first.length(), '\0');
+    REQUIRE(base64::decode(buffer.c_str(), length, (unsigned char*)&dec[0]) ==
+            pair.first.length());
+    REQUIRE(dec == pair.first);
+    // Exactly as large as the data, so out of bounds reads are caught
+    std::vector<char> exact(pair.second.begin(), pair.second.end());
+    REQUIRE(base64::decode(exact.data(), exact.size()) == pair.first);
+  }
+  THEN("A single character left over decodes to nothing") {
+    REQUIRE(base64::decodedLength("Zm9vZ", 5) == 3);
+    REQUIRE(base64::decode(std::string("Zm9vZ")) == "foo");
+  }
+}
+
+SCENARIO("Base64 decoding accepts characters outside the alphabet") {
+  auto data = randomString(300);
+  auto enc = base64::encode(data);
+  GIVEN("Url safe characters") {
+    auto safe = enc;
+    for (auto&& c : safe) {
+      if (c == '+') c = '-';
+      if (c == '/') c = '_';
+    }
+    THEN("They decode like the normal ones") {
+      REQUIRE(base64::decode(safe) == data);
+    }
+  }
+  GIVEN("Invalid characters") {
+    auto invalid = enc;
+    auto zero = enc;
+    for (auto i : {5, 37, 100, 101, 250}) {
+      invalid[i] = (i % 2) ? '*' : (char)0xC3;
+      zero[i] = 'A';
+    }
+    THEN("They decode as zero") {
+      REQUIRE(base64::decode(invalid) == base64::decode(zero));
+    }
+  }
+}
+
+/**
+ * The previous implementation, which appends one character at a time
+ */
+std::string encodeAppend(const unsigned char* bytes, size_t length) {
+  std::string ret;
+  size_t i = 0;
+  for (; i + 3 <= length; i += 3) {
+    uint32_t n = bytes[i] << 16 | bytes[i + 1] << 8 | bytes[i + 2];
+    for (auto shift : {18, 12, 6, 0}) ret += base64::chars[n >> shift & 0x3f];
+  }
+  if (i < length) {
+    uint32_t n = bytes[i] << 16;
+    if (i + 1 < length) n |= bytes[i + 1] << 8;
+    ret += base64::chars[n >> 18];
+    ret += base64::chars[n >> 12 & 0x3f];
+    ret += (i + 1 < length) ? base64::chars[n >> 6 & 0x3f] : '=';
+    ret += '=';
+  }
+  return ret;
+}
+
+template <class F>
+double megabytesPerSecond(size_t bytes, size_t repeat, F&& f) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < repeat; ++i) f();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return bytes * repeat / elapsed.count() / 1e6;
+}
+
+SCENARIO("Base64 throughput", "[.][benchmark]") {
+  // Run with: catch_base64 [benchmark]
+  for (auto size : {64, 1024, 65536}) {
+    auto data = randomString(size);
+    auto enc = base64::encode(data);
+    auto repeat = (size_t)(64 * 1024 * 1024 / size);
+    std::string out(base64::encodedLength(size), '\0');
+    std::string dec(size, '\0');
+    size_t check = 0;
+    auto append = megabytesPerSecond(size, repeat, [&]() {
+      check += encodeAppend((const unsigned char*)data.c_str(), size).length();
+    });
+    auto encode = megabytesPerSecond(size, repeat, [&]() {
+      check += base64::encode(data).length();
+    });
+    auto encodeInto = megabytesPerSecond(size, repeat, [&]() {
+      check += base64::encode((const unsigned char*)data.c_str(), size, &out[0]);
+    });
+    auto decode = megabytesPerSecond(size, repeat, [&]() {
+      check += base64::decode(enc).length();
+    });
+    auto decodeInto = megabytesPerSecond(size, repeat, [&]() {
+      check += base64::decode(enc.c_str(), enc.length(),
+                              (unsigned char*)&dec[0]);
+    });
+    REQUIRE(check > 0);
+    REQUIRE(dec == data);
+    std::cout << size << " bytes (MB/s): append " << append << ", encode "
+              << encode << ", encode into buffer " << encodeInto
+              << ", decode " << decode << ", decode into buffer "
+              << decodeInto << std::endl;
+  }
+}
@@ -0,0 +1,278 @@
+#define CATCH_CONFIG_MAIN
+
+#include "catch2/catch.hpp"
+
+#define ARDUINOJSON_USE_LONG_LONG 1
+#include "ArduinoJson.h"
+#undef ARDUINOJSON_ENABLE_ARDUINO_STRING
+typedef std::string TSTRING;
+
+#include "catch_utils.hpp"
+#include "painlessmesh/binary.hpp"
+#include "painlessmesh/protocol.hpp"
+
+using namespace painlessmesh;
+using namespace painlessmesh::protocol;
+
+template <class T>
+std::string toBinary(T pkg) {
+  auto variant = Variant(pkg);
+  std::string str;
+  variant.printBinaryTo(str);
+  return str;
+}
+
+template <class T>
+std::string toJson(T pkg) {
+  auto variant = Variant(pkg);
+  std::string str;
+  variant.printTo(str);
+  return str;
+}
+
+SCENARIO("Packages can be converted to and from the binary format",
+         "[Variant][protocol][binary]") {
+  GIVEN("A Single package converted to binary") {
+    auto pkg = createSingle();
+    auto str = toBinary(pkg);
+    THEN("It starts with the marker and contains no zero byte") {
+      REQUIRE(binary::isFrame(str.c_str(), str.length()));
+      REQUIRE(str.find('\0') == std::string::npos);
+    }
+    THEN("It is smaller than the json version") {
+      REQUIRE(str.length() < toJson(pkg).length());
+    }
+    THEN("It can be read back") {
+      auto variant = Variant(str);
+      REQUIRE(!variant.error);
+      REQUIRE(variant.is<Single>());
+      auto pkg2 = variant.to<Single>();
+      REQUIRE(pkg2.from == pkg.from);
+      REQUIRE(pkg2.dest == pkg.dest);
+      REQUIRE(pkg2.msg == pkg.msg);
+    }
+    THEN("Reading it back does not change the frame") {
+      auto copy = str;
+      auto variant = Variant(str);
+      REQUIRE(copy == str);
+    }
+  }
+
+  GIVEN("A Broadcast package converted to binary") {
+    auto pkg = createBroadcast();
+    auto variant = Variant(toBinary(pkg));
+    THEN("It can be read back") {
+      REQUIRE(!variant.error);
+      REQUIRE(variant.is<Broadcast>());
+      auto pkg2 = variant.to<Broadcast>();
+      REQUIRE(pkg2.from == pkg.from);
+      REQUIRE(pkg2.msg == pkg.msg);
+      REQUIRE(variant.routing() == router::BROADCAST);
+    }
+  }
+
+  GIVEN("NodeSync packages converted to binary") {
+    auto request = createNodeSyncRequest();
+    request.features = BINARY_FORMAT;
+    auto reply = createNodeSyncReply();
+    auto str1 = toBinary(request);
+    auto str2 = toBinary(reply);
+    THEN("They contain no zero byte and are smaller than json") {
+      REQUIRE(str1.find('\0') == std::string::npos);
+      REQUIRE(str2.find('\0') == std::string::npos);
+      REQUIRE(str1.length() < toJson(request).length());
+      REQUIRE(str2.length() < toJson(reply).length());
+    }
+    THEN("They can be read back") {
+      auto variant1 = Variant(str1);
+      REQUIRE(!variant1.error);
+      REQUIRE(variant1.is<NodeSyncRequest>());
+      auto request2 = variant1.to<NodeSyncRequest>();
+      REQUIRE(request2 == request);
+      REQUIRE(request2.features == BINARY_FORMAT);
+
+      auto variant2 = Variant(str2);
+      REQUIRE(!variant2.error);
+      REQUIRE(variant2.is<NodeSyncReply>());
+      auto reply2 = variant2.to<NodeSyncReply>();
+      REQUIRE(reply2 == reply);
+      REQUIRE(reply2.features == 0);
+    }
+  }
+
+  GIVEN("Time packages converted to binary") {
+    auto pkg1 = createTimeSync();
+    auto pkg2 = createTimeDelay();
+    THEN("They can be read back") {
+      auto variant1 = Variant(toBinary(pkg1));
+      REQUIRE(!variant1.error);
+      auto pkg3 = variant1.to<TimeSync>();
+      REQUIRE(pkg3.from == pkg1.from);
+      REQUIRE(pkg3.msg.type == pkg1.msg.type);
+      REQUIRE(pkg3.msg.t0 == pkg1.msg.t0);
+      REQUIRE(pkg3.msg.t1 == pkg1.msg.t1);
+      REQUIRE(pkg3.msg.t2 == pkg1.msg.t2);
+
+      auto variant2 = Variant(toBinary(pkg2));
+      REQUIRE(!variant2.error);
+      auto pkg4 = variant2.to<TimeDelay>();
+      REQUIRE(pkg4.dest == pkg2.dest);
+      REQUIRE(pkg4.msg.type == pkg2.msg.type);
+      REQUIRE(pkg4.msg.t2 == pkg2.msg.t2);
+    }
+  }
+
+  GIVEN("A time package with 64 bit times") {
+    auto pkg1 = TimeSync(10, 11, (1ULL << 40) + 12, (1ULL << 33) + 13,
+                         0xFFFFFFFFFFULL);
+    THEN("The times survive both formats") {
+      auto variant1 = Variant(toBinary(pkg1));
+      REQUIRE(!variant1.error);
+      auto pkg2 = variant1.to<TimeSync>();
+      REQUIRE(pkg2.msg.t0 == pkg1.msg.t0);
+      REQUIRE(pkg2.msg.t1 == pkg1.msg.t1);
+      REQUIRE(pkg2.msg.t2 == pkg1.msg.t2);
+
+      TSTRING str;
+      Variant(pkg1).printTo(str);
+      auto pkg3 = Variant(str).to<TimeSync>();
+      REQUIRE(pkg3.msg.t0 == pkg1.msg.t0);
+      REQUIRE(pkg3.msg.t1 == pkg1.msg.t1);
+      REQUIRE(pkg3.msg.t2 == pkg1.msg.t2);
+    }
+  }
+}
+
+SCENARIO("The binary format can hold any json value",
+         "[Variant][protocol][binary]") {
+  GIVEN("A json package with unknown keys and all kinds of values") {
+    std::string json =
+        "{\"type\":13,\"dest\":10,\"routing\":1,\"custom\":\"value\","
+        "\"negative\":-1234567,\"double\":3.5,\"flag\":true,\"off\":false,"
+        "\"nothing\":null,\"big\":4294967295,\"small\":-1,"
+        "\"list\":[1,[2,3],{\"x\":\"y\"}],\"empty\":{},\"text\":\"\"}";
+    auto variant = Variant(json);
+    REQUIRE(!variant.error);
+    std::string str;
+    variant.printBinaryTo(str);
+    THEN("It contains no zero byte") {
+      REQUIRE(str.find('\0') == std::string::npos);
+    }
+    THEN("It results in the same json after a round trip") {
+      auto variant2 = Variant(str);
+      REQUIRE(!variant2.error);
+      std::string json2;
+      variant2.printTo(json2);
+      REQUIRE(json2 == json);
+    }
+    THEN("Its capacity is exact") {
+      auto variant2 = Variant(str, 0);
+      REQUIRE(!variant2.error);
+      REQUIRE(variant2.type() == 13);
+    }
+  }
+
+  GIVEN("Truncated or corrupt frames") {
+    auto str = toBinary(createSingle(100));
+    THEN("Reading them results in an error, but does not crash") {
+      for (size_t i = 1; i < str.length(); ++i) {
+        auto variant = Variant(str.substr(0, i));
+        REQUIRE(variant.error);
+      }
+      for (size_t i = 0; i < 100; ++i) {
+        auto corrupt = str;
+        corrupt[runif(1, str.length() - 1)] = (char)runif(1, 255);
+        auto variant = Variant(corrupt);
+        // Either an error or a valid variant
+        if (!variant.error) variant.type();
+      }
+    }
+  }
+}
+
+SCENARIO("The header of a binary frame can be read without parsing it",
+         "[protocol][binary]") {
+  GIVEN("Binary frames of different types") {
+    auto single = createSingle();
+    auto broadcast = createBroadcast();
+    auto sync = createNodeSyncReply();
+    Header header;
+    THEN("peekHeader returns the routing information") {
+      REQUIRE(peekHeader(toBinary(single), header));
+      REQUIRE(header.type == SINGLE);
+      REQUIRE(header.dest == single.dest);
+      REQUIRE(header.routing == router::SINGLE);
+
+      REQUIRE(peekHeader(toBinary(broadcast), header));
+      REQUIRE(header.type == BROADCAST);
+      REQUIRE(header.routing == router::BROADCAST);
+
+      REQUIRE(peekHeader(toBinary(sync), header));
+      REQUIRE(header.type == NODE_SYNC_REPLY);
+      REQUIRE(header.dest == sync.dest);
+      REQUIRE(header.routing == router::NEIGHBOUR);
+    }
+    THEN("Truncated frames are rejected") {
+      auto str = toBinary(single);
+      REQUIRE(!peekHeader(str.substr(0, str.length() - 1), header));
+    }
+  }
+}
+
+SCENARIO("Raw bytes can be escaped so they contain no zeros",
+         "[protocol][binary]") {
+  GIVEN("Byte strings with zeros and long runs without them") {
+    std::vector<std::string> inputs = {"", std::string(1, 0),
+                                       std::string(3, 0), "abc"};
+    inputs.push_back(std::string(254, 'x'));
+    inputs.push_back(std::string(255, 'x'));
+    inputs.push_back(std::string(254, 'x') + std::string(1, 0));
+    std::string random;
+    for (auto i = 0; i < 2000; ++i) random += (char)runif(0, 255);
+    inputs.push_back(random);
+    THEN("They survive the round trip") {
+      for (auto&& input : inputs) {
+        std::string escaped;
+        binary::escape(input.c_str(), input.length(), escaped);
+        REQUIRE(escaped.find((char)0) == std::string::npos);
+        REQUIRE(escaped.length() <= input.length() + input.length() / 254 + 1);
+        auto length = binary::unescape(&escaped[0], escaped.length());
+        REQUIRE(escaped.substr(0, length) == input);
+      }
+    }
+  }
+}
+
+SCENARIO("The binary format is faster than json", "[protocol][binary][.]") {
+  auto single = createSingle(512);
+  auto sync = createNodeSyncReply(100);
+  auto singleJson = toJson(single);
+  auto singleBinary = toBinary(single);
+  auto syncJson = toJson(sync);
+  auto syncBinary = toBinary(sync);
+
+  BENCHMARK("Serialize a Single to json") {
+    for (auto i = 0; i < 1000; ++i) toJson(single);
+  }
+  BENCHMARK("Serialize a Single to binary") {
+    for (auto i = 0; i < 1000; ++i) toBinary(single);
+  }
+  BENCHMARK("Parse a json Single") {
+    for (auto i = 0; i < 1000; ++i) Variant(singleJson).to<Single>();
+  }
+  BENCHMARK("Parse a binary Single") {
+    for (auto i = 0; i < 1000; ++i) Variant(singleBinary).to<Single>();
+  }
+  BENCHMARK("Serialize a NodeSyncReply to json") {
+    for (auto i = 0; i < 1000; ++i) toJson(sync);
+  }
+  BENCHMARK("Serialize a NodeSyncReply to binary") {
+    for (auto i = 0; i < 1000; ++i) toBinary(sync);
+  }
+  BENCHMARK("Parse a json NodeSyncReply") {
+    for (auto i = 0; i < 1000; ++i) Variant(syncJson).to<NodeSyncReply>();
+  }
+  BENCHMARK("Parse a binary NodeSyncReply") {
+    for (auto i = 0; i < 1000; ++i) Variant(syncBinary).to<NodeSyncReply>();
+  }
+}
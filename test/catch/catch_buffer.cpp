@@ -25,10 +25,10 @@ SCENARIO("ReceiveBuffer receives strings and needs to process them") {
     auto length = runif(10, tmp_buffer.length - 10);
     randomCString(cstring, length);
     // Note we need to send a \0 to know this is the end
-    rBuffer.push(cstring, length + 1, tmp_buffer);
+    rBuffer.push(cstring, length + 1);
     THEN("It gets copied to the front of the buffer") {
       REQUIRE(!rBuffer.empty());
-      REQUIRE(rBuffer.front() == std::string(cstring));
+      REQUIRE(std::string(rBuffer.front().data) == std::string(cstring));
     }
   }
 
@@ -37,10 +37,10 @@ SCENARIO("ReceiveBuffer receives strings and needs to process them") {
     auto length = runif(tmp_buffer.length + 10, 2 * tmp_buffer.length);
     randomCString(cstring, length);
     // Note we need to send a \0 to know this is the end
-    rBuffer.push(cstring, length + 1, tmp_buffer);
+    rBuffer.push(cstring, length + 1);
     THEN("It gets copied to the front of the buffer") {
       REQUIRE(!rBuffer.empty());
-      REQUIRE(rBuffer.front() == std::string(cstring));
+      REQUIRE(std::string(rBuffer.front().data) == std::string(cstring));
     }
   }
 
@@ -49,18 +49,18 @@ SCENARIO("ReceiveBuffer receives strings and needs to process them") {
     auto length = runif(tmp_buffer.length + 10, 2 * tmp_buffer.length);
     size_t part_len = length / 2;
     randomCString(cstring, length);
-    rBuffer.push(cstring, part_len, tmp_buffer);
+    rBuffer.push(cstring, part_len);
     THEN("The first part doesn't get copied to the front of the buffer") {
       REQUIRE(rBuffer.empty());
     }
 
     auto data_ptr = cstring + sizeof(char) * part_len;
-    rBuffer.push(data_ptr, length - part_len + 1, tmp_buffer);
+    rBuffer.push(data_ptr, length - part_len + 1);
     THEN(
         "When getting the second part the whole thing gets copied to the front "
         "of the buffer") {
       REQUIRE(!rBuffer.empty());
-      REQUIRE(rBuffer.front() == std::string(cstring));
+      REQUIRE(std::string(rBuffer.front().data) == std::string(cstring));
     }
   }
 
@@ -70,9 +70,9 @@ SCENARIO("ReceiveBuffer receives strings and needs to process them") {
       auto length = runif(tmp_buffer.length + 10, 2 * tmp_buffer.length);
       size_t part_len = length / 2;
       randomCString(cstring, length);
-      rBuffer.push(cstring, part_len, tmp_buffer);
+      rBuffer.push(cstring, part_len);
       auto data_ptr = cstring + sizeof(char) * part_len;
-      rBuffer.push(data_ptr, length - part_len + 1, tmp_buffer);
+      rBuffer.push(data_ptr, length - part_len + 1);
     }
     THEN(
         "When getting the second part the whole thing gets copied to the front "
@@ -97,13 +97,13 @@ SCENARIO("ReceiveBuffer receives strings and needs to process them") {
     randomCString(data_ptr, length2);
 
     // Note we need to send a \0 to know this is the end
-    rBuffer.push(cstring, length + length2 + 2, tmp_buffer);
+    rBuffer.push(cstring, length + length2 + 2);
     THEN("We have both strings in the buffer") {
       REQUIRE(!rBuffer.empty());
-      REQUIRE(rBuffer.front() == std::string(cstring));
+      REQUIRE(std::string(rBuffer.front().data) == std::string(cstring));
       rBuffer.pop_front();
       REQUIRE(!rBuffer.empty());
-      REQUIRE(rBuffer.front() == std::string(data_ptr));
+      REQUIRE(std::string(rBuffer.front().data) == std::string(data_ptr));
       rBuffer.pop_front();
       REQUIRE(rBuffer.empty());
     }
@@ -119,15 +119,15 @@ SCENARIO("ReceiveBuffer receives strings and needs to process them") {
     cstring[3] = 'a';
     cstring[4] = 't';
     cstring[5] = '\0';
-    rBuffer.push(cstring, 3, tmp_buffer);
+    rBuffer.push(cstring, 3);
     cstring[0] = 'r';
     cstring[1] = 'n';
     cstring[2] = 'd';
     randomCString(tmp_buffer.buffer, tmp_buffer.length);
     auto data_ptr = cstring + sizeof(char) * 3;
-    rBuffer.push(data_ptr, 3, tmp_buffer);
+    rBuffer.push(data_ptr, 3);
     THEN("We still have the correct result") {
-      REQUIRE(rBuffer.front() == std::string("Blaat"));
+      REQUIRE(std::string(rBuffer.front().data) == std::string("Blaat"));
       REQUIRE(std::string(cstring) != std::string("Blaat"));
       REQUIRE(std::string(tmp_buffer.buffer, 6) != std::string("Blaat"));
       REQUIRE(std::string(tmp_buffer.buffer, 5) != std::string("Blaat"));
@@ -140,9 +140,9 @@ SCENARIO("ReceiveBuffer receives strings and needs to process them") {
       auto length = runif(tmp_buffer.length + 10, 2 * tmp_buffer.length);
       size_t part_len = length / 2;
       randomCString(cstring, length);
-      rBuffer.push(cstring, part_len, tmp_buffer);
+      rBuffer.push(cstring, part_len);
       auto data_ptr = cstring + sizeof(char) * part_len;
-      rBuffer.push(data_ptr, length - part_len + 1, tmp_buffer);
+      rBuffer.push(data_ptr, length - part_len + 1);
     }
     THEN("We can clear it") {
       REQUIRE(!rBuffer.empty());
@@ -157,14 +157,14 @@ SCENARIO("ReceiveBuffer receives strings and needs to process them") {
       auto length = runif(tmp_buffer.length + 10, 2 * tmp_buffer.length);
       size_t part_len = length / 2;
       randomCString(cstring, length);
-      rBuffer.push(cstring, part_len, tmp_buffer);
+      rBuffer.push(cstring, part_len);
       auto data_ptr = cstring + sizeof(char) * part_len;
-      rBuffer.push(data_ptr, length - part_len + 1, tmp_buffer);
+      rBuffer.push(data_ptr, length - part_len + 1);
     }
     auto length = runif(tmp_buffer.length + 10, 2 * tmp_buffer.length);
     size_t part_len = length / 2;
     randomCString(cstring, length);
-    rBuffer.push(cstring, part_len, tmp_buffer);
+    rBuffer.push(cstring, part_len);
 
     THEN("We can clear removes it") {
       REQUIRE(!rBuffer.empty());
@@ -173,9 +173,51 @@ SCENARIO("ReceiveBuffer receives strings and needs to process them") {
     }
     rBuffer.clear();
     randomCString(cstring, length);
-    rBuffer.push(cstring, length + 1, tmp_buffer);
+    rBuffer.push(cstring, length + 1);
     THEN("Reusing it works correctly") {
-      REQUIRE(rBuffer.front() == std::string(cstring));
+      REQUIRE(std::string(rBuffer.front().data) == std::string(cstring));
+    }
+  }
+}
+
+SCENARIO("ReceiveBuffer hands out messages as views into its own memory") {
+  ReceiveBuffer<std::string> rBuffer = ReceiveBuffer<std::string>();
+  GIVEN("Messages received in arbitrary chunks") {
+    std::string stream;
+    std::vector<std::string> msgs;
+    for (auto i = 0; i < 20; ++i) {
+      msgs.push_back(randomString(runif(1, 3000)));
+      stream += msgs.back();
+      stream += '\0';
+      if (runif(0, 3) == 0) stream += '\0';  // Empty messages are skipped
+    }
+    size_t pos = 0;
+    while (pos < stream.length()) {
+      auto len = std::min((size_t)runif(1, 1500), stream.length() - pos);
+      rBuffer.push(stream.c_str() + pos, len);
+      pos += len;
+    }
+    THEN("They come out as zero terminated views of the right length") {
+      for (auto&& msg : msgs) {
+        REQUIRE(!rBuffer.empty());
+        auto view = rBuffer.front();
+        REQUIRE(view.length == msg.length());
+        REQUIRE(std::string(view.data, view.length) == msg);
+        REQUIRE(view.data[view.length] == '\0');
+        rBuffer.pop_front();
+      }
+      REQUIRE(rBuffer.empty());
+    }
+  }
+
+  GIVEN("A buffer of which all messages are consumed") {
+    auto msg = randomString(100);
+    rBuffer.push(msg.c_str(), msg.length() + 1);
+    auto first = rBuffer.front().data;
+    rBuffer.pop_front();
+    THEN("Its memory is reused for the next message") {
+      rBuffer.push(msg.c_str(), msg.length() + 1);
+      REQUIRE(rBuffer.front().data == first);
     }
   }
 }
@@ -228,8 +270,10 @@ SCENARIO("SentBuffer receives strings and can be read in parts") {
     THEN("We can use direct access to read it in multiple parts") {
       while (!sBuffer.empty()) {
         auto rlength = sBuffer.requestLength(tmp_buffer.length);
-        auto ptr = sBuffer.readPtr(rlength);
-        memcpy(data_ptr, ptr, rlength);
+        span_t first, second;
+        sBuffer.readPtr(rlength, first, second);
+        memcpy(data_ptr, first.data, first.length);
+        memcpy(data_ptr + first.length, second.data, second.length);
         data_ptr += rlength * sizeof(char);
         sBuffer.freeRead();
       }
@@ -283,3 +327,303 @@ SCENARIO("SentBuffer receives strings and can be read in parts") {
     }
   }
 }
+
+SCENARIO("SentBuffer keeps the messages in order when the ring buffer wraps") {
+  SentBuffer<std::string> sBuffer = SentBuffer<std::string>();
+  GIVEN("Many messages pushed and read in random parts") {
+    std::string expected;
+    std::string result;
+    for (auto i = 0; i < 200; ++i) {
+      auto msg = randomString(runif(0, 1500));
+      if (runif(0, 4) == 0) {
+        // Priority messages go in front, but after a partly sent message
+        sBuffer.push(msg, true);
+      } else {
+        sBuffer.push(msg);
+        expected += msg;
+        expected += '\0';
+      }
+      auto rlength = sBuffer.requestLength(runif(2, 3000));
+      span_t first, second;
+      sBuffer.readPtr(rlength, first, second);
+      auto before = result.length();
+      result.append(first.data, first.length);
+      result.append(second.data, second.length);
+      REQUIRE(result.length() - before == rlength);
+      sBuffer.freeRead();
+    }
+    while (!sBuffer.empty()) {
+      auto rlength = sBuffer.requestLength(TCP_MSS);
+      temp_buffer_t tmp_buffer;
+      sBuffer.read(rlength, tmp_buffer);
+      result.append(tmp_buffer.buffer, rlength);
+      sBuffer.freeRead();
+    }
+    THEN("All messages are read back intact") {
+      REQUIRE(result.length() >= expected.length());
+      REQUIRE(sBuffer.size() == 0);
+      // Priority messages can end up anywhere, but the other messages
+      // should still be in order
+      size_t pos = 0;
+      size_t start = 0;
+      while (start < expected.length()) {
+        auto end = expected.find('\0', start);
+        auto msg = expected.substr(start, end - start + 1);
+        pos = result.find(msg, pos);
+        REQUIRE(pos != std::string::npos);
+        pos += msg.length();
+        start = end + 1;
+      }
+    }
+  }
+
+  GIVEN("A partly read message in a wrapped buffer") {
+    auto msg1 = randomString(SENT_BUFFER_CAPACITY - 100);
+    auto msg2 = randomString(500);
+    auto msgH = randomString(300);
+    sBuffer.push(msg1);
+    // Leave the last 9 characters and the separator unread
+    sBuffer.freeRead(msg1.length() - 9);
+    sBuffer.push(msg2);
+    sBuffer.push(msgH, true);
+    REQUIRE(sBuffer.size() == 3);
+    THEN("The priority message is send right after the partly read one") {
+      std::string result;
+      while (!sBuffer.empty()) {
+        span_t first, second;
+        sBuffer.readPtr(sBuffer.requestLength(TCP_MSS), first, second);
+        result.append(first.data, first.length);
+        result.append(second.data, second.length);
+        sBuffer.freeRead();
+      }
+      auto expected = msg1.substr(msg1.length() - 9) + '\0' + msgH + '\0' +
+                      msg2 + '\0';
+      REQUIRE(result == expected);
+    }
+  }
+
+  GIVEN("A message larger than the buffer capacity") {
+    auto msg = randomString(3 * SENT_BUFFER_CAPACITY);
+    sBuffer.push(randomString(10));
+    sBuffer.push(msg);
+    THEN("The buffer grows to hold it") {
+      REQUIRE(sBuffer.size() == 2);
+      std::string result;
+      while (!sBuffer.empty()) {
+        temp_buffer_t tmp_buffer;
+        auto rlength = sBuffer.requestLength(tmp_buffer.length);
+        sBuffer.read(rlength, tmp_buffer);
+        result.append(tmp_buffer.buffer, rlength);
+        sBuffer.freeRead();
+      }
+      REQUIRE(result.substr(11) == msg + '\0');
+    }
+    THEN("It shrinks back once the messages are sent") {
+      REQUIRE(sBuffer.capacity() > SENT_BUFFER_CAPACITY);
+      while (!sBuffer.empty()) {
+        temp_buffer_t tmp_buffer;
+        auto rlength = sBuffer.requestLength(tmp_buffer.length);
+        sBuffer.read(rlength, tmp_buffer);
+        sBuffer.freeRead();
+      }
+      REQUIRE(sBuffer.capacity() == SENT_BUFFER_CAPACITY);
+      sBuffer.push(msg);
+      REQUIRE(sBuffer.size() == 1);
+    }
+  }
+}
+
+SCENARIO("SentBuffers can share a message without copying it") {
+  GIVEN("A shared message pushed into two buffers") {
+    SentBuffer<std::string> buffer1;
+    SentBuffer<std::string> buffer2;
+    auto msg = randomString(3 * TCP_MSS);
+    auto payload = std::make_shared<const std::string>(msg);
+    buffer1.push(payload);
+    buffer2.push(payload);
+    REQUIRE(payload.use_count() == 3);
+    THEN("The data is read directly from the shared message") {
+      span_t first, second;
+      buffer1.readPtr(buffer1.requestLength(TCP_MSS), first, second);
+      REQUIRE(first.data == payload->c_str());
+      REQUIRE(first.length == TCP_MSS - 1);
+      REQUIRE(second.length == 0);
+    }
+    THEN("It is released once both buffers have sent it") {
+      std::string result1;
+      while (!buffer1.empty()) {
+        temp_buffer_t tmp_buffer;
+        auto rlength = buffer1.read(
+            buffer1.requestLength(tmp_buffer.length), tmp_buffer);
+        result1.append(tmp_buffer.buffer, rlength);
+        buffer1.freeRead();
+      }
+      REQUIRE(result1 == msg + '\0');
+      REQUIRE(payload.use_count() == 2);
+      buffer2.clear();
+      REQUIRE(payload.use_count() == 1);
+    }
+  }
+
+  GIVEN("Shared and copied messages mixed in random order") {
+    SentBuffer<std::string> sBuffer;
+    std::string expected;
+    std::string result;
+    for (auto i = 0; i < 200; ++i) {
+      auto msg = randomString(runif(0, 1500));
+      if (runif(0, 1) == 0)
+        sBuffer.push(std::make_shared<const std::string>(msg));
+      else
+        sBuffer.push(msg);
+      expected += msg;
+      expected += '\0';
+      auto rlength = sBuffer.requestLength(runif(2, 3000));
+      span_t first, second;
+      sBuffer.readPtr(rlength, first, second);
+      REQUIRE(first.length + second.length <= rlength);
+      result.append(first.data, first.length);
+      result.append(second.data, second.length);
+      sBuffer.freeRead();
+    }
+    while (!sBuffer.empty()) {
+      span_t first, second;
+      sBuffer.readPtr(sBuffer.requestLength(TCP_MSS), first, second);
+      result.append(first.data, first.length);
+      result.append(second.data, second.length);
+      sBuffer.freeRead();
+    }
+    THEN("All messages are read back in order") {
+      REQUIRE(result == expected);
+      REQUIRE(sBuffer.size() == 0);
+    }
+  }
+
+  GIVEN("A priority message pushed behind a partly sent shared message") {
+    SentBuffer<std::string> sBuffer;
+    auto msg1 = randomString(100);
+    auto msg2 = randomString(50);
+    auto msgH = randomString(30);
+    sBuffer.push(msg2);
+    sBuffer.push(std::make_shared<const std::string>(msg1), true);
+    sBuffer.freeRead(10);
+    sBuffer.push(msgH, true);
+    THEN("It is send right after the shared message") {
+      std::string result;
+      while (!sBuffer.empty()) {
+        span_t first, second;
+        sBuffer.readPtr(sBuffer.requestLength(TCP_MSS), first, second);
+        result.append(first.data, first.length);
+        result.append(second.data, second.length);
+        sBuffer.freeRead();
+      }
+      REQUIRE(result ==
+              msg1.substr(10) + '\0' + msgH + '\0' + msg2 + '\0');
+    }
+  }
+}
+
+/**
+ * The list based SentBuffer this library used to have, kept for comparison
+ */
+class ListSentBuffer {
+ public:
+  void push(std::string message, bool priority = false) {
+    if (priority) {
+      if (clean)
+        jsonStrings.push_front(message);
+      else
+        jsonStrings.insert((++jsonStrings.begin()), message);
+    } else
+      jsonStrings.push_back(message);
+  }
+
+  size_t requestLength(size_t buffer_length) {
+    if (jsonStrings.empty()) return 0;
+    return std::min(buffer_length - 1, jsonStrings.begin()->length() + 1);
+  }
+
+  const char* readPtr(size_t length) {
+    last_read_size = length;
+    return jsonStrings.front().c_str();
+  }
+
+  void freeRead() {
+    if (last_read_size == jsonStrings.begin()->length() + 1) {
+      jsonStrings.pop_front();
+      clean = true;
+    } else {
+      jsonStrings.begin()->erase(0, last_read_size);
+      clean = false;
+    }
+    last_read_size = 0;
+  }
+
+  bool empty() { return jsonStrings.empty(); }
+
+ private:
+  size_t last_read_size = 0;
+  bool clean = true;
+  std::list<std::string> jsonStrings;
+};
+
+SCENARIO("SentBuffer is faster than the list based implementation",
+         "[buffer][.]") {
+  std::vector<std::string> small;
+  for (auto i = 0; i < 100; ++i) small.push_back(randomString(runif(20, 200)));
+  auto large = randomString(16 * TCP_MSS);
+  char out[TCP_MSS];
+
+  BENCHMARK("List: push and send small messages") {
+    ListSentBuffer buffer;
+    for (auto j = 0; j < 100; ++j) {
+      for (auto&& msg : small) buffer.push(msg);
+      while (!buffer.empty()) {
+        auto len = buffer.requestLength(TCP_MSS);
+        memcpy(out, buffer.readPtr(len), len);
+        buffer.freeRead();
+      }
+    }
+  }
+
+  BENCHMARK("Ring: push and send small messages") {
+    SentBuffer<std::string> buffer;
+    for (auto j = 0; j < 100; ++j) {
+      for (auto&& msg : small) buffer.push(msg);
+      while (!buffer.empty()) {
+        auto len = buffer.requestLength(TCP_MSS);
+        span_t first, second;
+        buffer.readPtr(len, first, second);
+        memcpy(out, first.data, first.length);
+        memcpy(out + first.length, second.data, second.length);
+        buffer.freeRead();
+      }
+    }
+  }
+
+  BENCHMARK("List: push and send large messages") {
+    ListSentBuffer buffer;
+    for (auto j = 0; j < 100; ++j) {
+      buffer.push(large);
+      while (!buffer.empty()) {
+        auto len = buffer.requestLength(TCP_MSS);
+        memcpy(out, buffer.readPtr(len), len);
+        buffer.freeRead();
+      }
+    }
+  }
+
+  BENCHMARK("Ring: push and send large messages") {
+    SentBuffer<std::string> buffer;
+    for (auto j = 0; j < 100; ++j) {
+      buffer.push(large);
+      while (!buffer.empty()) {
+        auto len = buffer.requestLength(TCP_MSS);
+        span_t first, second;
+        buffer.readPtr(len, first, second);
+        memcpy(out, first.data, first.length);
+        memcpy(out + first.length, second.data, second.length);
+        buffer.freeRead();
+      }
+    }
+  }
+}
@@ -41,3 +41,65 @@ SCENARIO("CallbackMap should hold multiple callbacks by ID") {
     }
   }
 }
+
+SCENARIO("PackageCallbackList handles small and large package ids") {
+  GIVEN("Callbacks for a table id and a sparse id") {
+    auto cbl = callback::PackageCallbackList<int>();
+    auto i = 0;
+    auto j = 0;
+    cbl.onPackage(5, [&i](int z) { i += z; });
+    cbl.onPackage(PAINLESSMESH_CALLBACK_TABLE_SIZE + 100,
+                  [&j](int z) { j += z; });
+    THEN("Both are called for their own id only") {
+      REQUIRE(cbl.execute(5, 2) == 1);
+      REQUIRE(cbl.execute(PAINLESSMESH_CALLBACK_TABLE_SIZE + 100, 3) == 1);
+      REQUIRE(i == 2);
+      REQUIRE(j == 3);
+    }
+    THEN("Unknown ids call nothing") {
+      REQUIRE(cbl.execute(4, 1) == 0);
+      REQUIRE(cbl.execute(PAINLESSMESH_CALLBACK_TABLE_SIZE, 1) == 0);
+      REQUIRE(cbl.execute(-1, 1) == 0);
+      REQUIRE(i == 0);
+      REQUIRE(j == 0);
+    }
+  }
+
+  GIVEN("Callbacks that take their argument by reference") {
+    auto cbl = callback::PackageCallbackList<std::string&>();
+    std::vector<const std::string*> seen;
+    cbl.onPackage(1, [&seen](std::string& s) { seen.push_back(&s); });
+    cbl.onPackage(1, [&seen](std::string& s) { seen.push_back(&s); });
+    std::string arg = "payload";
+    cbl.execute(1, arg);
+    THEN("All of them get the same object") {
+      REQUIRE(seen.size() == 2);
+      REQUIRE(seen[0] == &arg);
+      REQUIRE(seen[1] == &arg);
+    }
+  }
+}
+
+SCENARIO("Callbacks can add callbacks while they are executed") {
+  GIVEN("A callback that adds callbacks for its own and other ids") {
+    auto cbl = callback::PackageCallbackList<int>();
+    auto i = 0;
+    cbl.onPackage(1, [&cbl, &i](int z) {
+      // Enough to make a vector reallocate
+      for (auto n = 0; n < 100; ++n) cbl.onPackage(1, [&i](int z) { ++i; });
+      cbl.onPackage(PAINLESSMESH_CALLBACK_TABLE_SIZE - 1, [](int z) {});
+      cbl.onPackage(PAINLESSMESH_CALLBACK_TABLE_SIZE + 1, [](int z) {});
+      i += z;
+    });
+    WHEN("It is executed") {
+      auto cnt = cbl.execute(1, 5);
+      THEN("The new callbacks are only called the next time") {
+        REQUIRE(cnt == 1);
+        REQUIRE(i == 5);
+        REQUIRE(cbl.execute(1, 0) == 101);
+        REQUIRE(i == 105);
+        REQUIRE(cbl.execute(PAINLESSMESH_CALLBACK_TABLE_SIZE - 1, 0) == 2);
+      }
+    }
+  }
+}
@@ -175,3 +175,234 @@ SCENARIO("A layout neighbour knows when to update its sub") {
   }
 }
 
+class TestLayout : public layout::Layout<layout::Neighbour> {
+ public:
+  TestLayout(uint32_t id) { nodeId = id; }
+};
+
+SCENARIO("A layout keeps an index of the routes to all nodes") {
+  GIVEN("A layout with two neighbours") {
+    auto lay = TestLayout(1);
+    auto conn1 = std::make_shared<layout::Neighbour>();
+    auto conn2 = std::make_shared<layout::Neighbour>();
+    lay.subs.push_back(conn1);
+    lay.subs.push_back(conn2);
+    auto tree1 = createNodeTree(20, -1);
+    auto tree2 = createNodeTree(20, -1);
+    conn1->updateSubs(tree1);
+    conn2->updateSubs(tree2);
+
+    THEN("Every node is found through the neighbour that contains it") {
+      for (auto&& id : layout::asList(tree1))
+        REQUIRE(lay.findRoute(id) == conn1);
+      for (auto&& id : layout::asList(tree2))
+        REQUIRE(lay.findRoute(id) == conn2);
+      REQUIRE(!lay.findRoute(1));
+    }
+
+    WHEN("A neighbour changes its subs") {
+      REQUIRE(lay.findRoute(tree1.nodeId) == conn1);
+      auto tree3 = createNodeTree(10, -1);
+      tree3.nodeId = tree1.nodeId;
+      conn1->updateSubs(tree3);
+      THEN("The index is updated") {
+        for (auto&& id : layout::asList(tree3))
+          REQUIRE(lay.findRoute(id) == conn1);
+        for (auto&& s : tree1.subs) {
+          if (!layout::contains(tree3, s.nodeId))
+            REQUIRE(!lay.findRoute(s.nodeId));
+        }
+      }
+    }
+
+    WHEN("A neighbour is cleared or removed") {
+      REQUIRE(lay.findRoute(tree1.nodeId) == conn1);
+      conn1->clear();
+      THEN("Its nodes can not be found anymore") {
+        REQUIRE(!lay.findRoute(tree1.nodeId));
+        REQUIRE(lay.findRoute(tree2.nodeId) == conn2);
+        lay.subs.remove(conn2);
+        REQUIRE(!lay.findRoute(tree2.nodeId));
+      }
+    }
+  }
+}
+
+SCENARIO("A layout caches its node tree") {
+  GIVEN("A layout with two neighbours") {
+    auto lay = TestLayout(1);
+    auto conn1 = std::make_shared<layout::Neighbour>();
+    auto conn2 = std::make_shared<layout::Neighbour>();
+    lay.subs.push_back(conn1);
+    lay.subs.push_back(conn2);
+    conn1->updateSubs(createNodeTree(10, -1));
+    conn2->updateSubs(createNodeTree(10, -1));
+    auto revision = lay.getTreeRevision();
+
+    THEN("The tree contains all nodes") {
+      REQUIRE(layout::size(lay.asNodeTree()) == 21);
+      REQUIRE(lay.asNodeTree().nodeId == 1);
+    }
+
+    THEN("The tree is not rebuild when nothing changed") {
+      conn1->updateSubs(protocol::NodeTree(*conn1));
+      REQUIRE(lay.getTreeRevision() == revision);
+      REQUIRE(&lay.asNodeTree() == &lay.asNodeTree());
+    }
+
+    WHEN("A neighbour changes its subs") {
+      auto tree = createNodeTree(5, -1);
+      tree.nodeId = conn1->nodeId;
+      conn1->updateSubs(tree);
+      THEN("The tree is updated") {
+        REQUIRE(lay.getTreeRevision() != revision);
+        REQUIRE(layout::size(lay.asNodeTree()) == 16);
+      }
+    }
+
+    WHEN("A neighbour is closed") {
+      conn2->clear();
+      THEN("It is removed from the tree") {
+        REQUIRE(lay.getTreeRevision() != revision);
+        REQUIRE(layout::size(lay.asNodeTree()) == 11);
+      }
+    }
+  }
+}
+
+SCENARIO("Node syncs between nodes with DELTA_SYNC only contain changes") {
+  GIVEN("A neighbour on both sides of a connection") {
+    // What node 1 knows about node 2 and the other way around
+    auto to2 = layout::Neighbour();
+    to2.nodeId = 2;
+    to2.features = protocol::DELTA_SYNC;
+    auto from1 = layout::Neighbour();
+    from1.features = protocol::DELTA_SYNC;
+
+    auto layout1 = createNodeTree(30, -1);
+    layout1.nodeId = 1;
+
+    // Pass the package through json, like on the wire
+    auto transfer = [](protocol::NodeSyncRequest pkg) {
+      std::string str;
+      protocol::Variant(pkg).printTo(str);
+      return protocol::Variant(str).to<protocol::NodeSyncRequest>();
+    };
+
+    auto pkg = transfer(to2.request(protocol::NodeTree(layout1)));
+    REQUIRE(!pkg.delta);
+    REQUIRE(from1.applyDelta(pkg));
+    from1.updateSubs(pkg);
+    REQUIRE(from1 == layout1);
+
+    WHEN("Nothing changed") {
+      auto pkg2 = transfer(to2.request(protocol::NodeTree(layout1)));
+      THEN("The sync only contains the hash") {
+        REQUIRE(pkg2.delta);
+        REQUIRE(pkg2.subs.empty());
+        REQUIRE(pkg2.removed.empty());
+        REQUIRE(pkg2.jsonObjectSize() < pkg.jsonObjectSize());
+        REQUIRE(from1.applyDelta(pkg2));
+        REQUIRE(!from1.updateSubs(pkg2));
+      }
+    }
+
+    WHEN("Subs are added, changed and removed") {
+      auto layout2 = layout1;
+      layout2.subs.pop_front();
+      layout2.subs.push_back(createNodeTree(3, -1));
+      if (layout2.subs.size() > 1)
+        layout2.subs.front().subs.push_back(createNodeTree(2, -1));
+      auto pkg2 = transfer(to2.reply(protocol::NodeTree(layout2)));
+      THEN("Only the changes are send and the receiver gets the new tree") {
+        REQUIRE(pkg2.delta);
+        REQUIRE(pkg2.removed.size() == 1);
+        REQUIRE(pkg2.subs.size() <= 2);
+        REQUIRE(from1.applyDelta(pkg2));
+        REQUIRE(from1.updateSubs(pkg2));
+        REQUIRE(layout::hash(from1) == layout::hash(layout2));
+        REQUIRE(layout::size(from1) == layout::size(layout2));
+      }
+    }
+
+    WHEN("The receiver does not know the base of a delta") {
+      from1.clear();
+      auto pkg2 = transfer(to2.request(protocol::NodeTree(layout1)));
+      THEN("The delta can not be applied") {
+        REQUIRE(!from1.applyDelta(pkg2));
+      }
+      THEN("After resetSync the next sync is complete again") {
+        to2.resetSync();
+        auto pkg3 = transfer(to2.request(protocol::NodeTree(layout1)));
+        REQUIRE(!pkg3.delta);
+        REQUIRE(from1.applyDelta(pkg3));
+        from1.updateSubs(pkg3);
+        REQUIRE(from1 == layout1);
+      }
+    }
+  }
+
+  GIVEN("A neighbour without DELTA_SYNC") {
+    auto to2 = layout::Neighbour();
+    to2.nodeId = 2;
+    auto layout1 = createNodeTree(10, -1);
+    THEN("Every sync contains the full tree") {
+      auto pkg1 = to2.request(protocol::NodeTree(layout1));
+      auto pkg2 = to2.request(protocol::NodeTree(layout1));
+      REQUIRE(!pkg2.delta);
+      REQUIRE(pkg2.subs == pkg1.subs);
+    }
+  }
+}
+
+SCENARIO("A SequenceFilter detects broadcasts that were received before") {
+  GIVEN("An empty filter") {
+    layout::SequenceFilter filter;
+    THEN("New sequence numbers pass and repeated ones are caught") {
+      REQUIRE(!filter.seen(1, 10));
+      REQUIRE(filter.seen(1, 10));
+      REQUIRE(!filter.seen(2, 10));
+      REQUIRE(!filter.seen(1, 12));
+      // Out of order, but within the window
+      REQUIRE(!filter.seen(1, 11));
+      REQUIRE(filter.seen(1, 11));
+      REQUIRE(filter.seen(1, 12));
+      REQUIRE(filter.size() == 2);
+    }
+    THEN("A large jump forward moves the window") {
+      REQUIRE(!filter.seen(1, 10));
+      REQUIRE(!filter.seen(1, 100));
+      REQUIRE(filter.seen(1, 100));
+      REQUIRE(!filter.seen(1, 99));
+    }
+    THEN("Sequence numbers can wrap around") {
+      REQUIRE(!filter.seen(1, 0xFFFFFFFF));
+      REQUIRE(!filter.seen(1, 1));
+      REQUIRE(filter.seen(1, 0xFFFFFFFF));
+    }
+    THEN("Late duplicates do not let newer broadcasts through again") {
+      for (uint32_t i = 1000; i < 1100; ++i) REQUIRE(!filter.seen(1, i));
+      REQUIRE(filter.seen(1, 1000));
+      REQUIRE(filter.seen(1, 1050));
+      for (uint32_t i = 1000; i < 1100; ++i) REQUIRE(filter.seen(1, i));
+      REQUIRE(!filter.seen(1, 1100));
+    }
+    THEN("An origin that restarts its sequence is accepted") {
+      for (uint32_t i = 1000000; i < 1000100; ++i) REQUIRE(!filter.seen(1, i));
+      REQUIRE(!filter.seen(1, 1));
+      REQUIRE(!filter.seen(1, 2));
+      REQUIRE(filter.seen(1, 1));
+    }
+    THEN("A full filter forgets the origin that was not seen the longest") {
+      for (uint32_t i = 1; i <= PAINLESSMESH_MAX_BROADCAST_ORIGINS; ++i)
+        REQUIRE(!filter.seen(i, 10));
+      // Origin 1 is used again, so 2 is now the oldest
+      REQUIRE(filter.seen(1, 10));
+      REQUIRE(!filter.seen(1000, 10));
+      REQUIRE(filter.size() == PAINLESSMESH_MAX_BROADCAST_ORIGINS);
+      REQUIRE(filter.seen(1, 10));
+      REQUIRE(filter.seen(3, 10));
+      REQUIRE(!filter.seen(2, 10));
+    }
+  }
+}
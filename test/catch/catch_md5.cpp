@@ -0,0 +1,80 @@
+#define CATCH_CONFIG_MAIN
+
+#include "catch2/catch.hpp"
+
+#include "painlessmesh/configuration.hpp"
+
+#include "painlessmesh/md5.hpp"
+
+#include "catch_utils.hpp"
+
+using namespace painlessmesh;
+
+SCENARIO("MD5 matches the reference values") {
+  // Test suite from RFC 1321
+  std::vector<std::pair<std::string, std::string>> suite = {
+      {"", "d41d8cd98f00b204e9800998ecf8427e"},
+      {"a", "0cc175b9c0f1b6a831c399e269772661"},
+      {"abc", "900150983cd24fb0d6963f7d28e17f72"},
+      {"message digest", "f96b697d7cb7938d525a2f31aaf161d0"},
+      {"abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b"},
+      {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+       "d174ab98d277d9f5a5611c2c9f419d9f"},
+      {"1234567890123456789012345678901234567890123456789012345678901234567890"
+       "1234567890",
+       "57edf4a22be3c955ac49da2e2107b67a"}};
+  for (auto&& pair : suite) {
+    md5::Context ctx;
+    ctx.update(pair.first);
+    REQUIRE(ctx.hexdigest() == pair.second);
+    REQUIRE(ctx.size() == pair.first.length());
+  }
+}
+
+SCENARIO("MD5 can be calculated in pieces") {
+  auto data = randomString(1000);
+  md5::Context whole;
+  whole.update(data);
+  GIVEN("The data added in pieces of random size") {
+    md5::Context ctx;
+    size_t pos = 0;
+    while (pos < data.length()) {
+      auto n = std::min((size_t)runif(0, 130), data.length() - pos);
+      ctx.update(data.c_str() + pos, n);
+      pos += n;
+    }
+    THEN("The hash is the same") {
+      REQUIRE(ctx.hexdigest() == whole.hexdigest());
+    }
+  }
+
+  GIVEN("A hash that is saved and restored half way") {
+    for (auto half : {0, 63, 64, 500, 517}) {
+      md5::Context ctx;
+      ctx.update(data.c_str(), half);
+      auto digest = ctx.hexdigest();
+      auto state = ctx.save();
+      md5::Context ctx2;
+      REQUIRE(ctx2.restore(state));
+      REQUIRE(ctx2.size() == (size_t)half);
+      REQUIRE(ctx2.hexdigest() == digest);
+      ctx2.update(data.c_str() + half, data.length() - half);
+      THEN("The hash is the same") {
+        REQUIRE(ctx2.hexdigest() == whole.hexdigest());
+      }
+    }
+  }
+
+  GIVEN("An invalid state") {
+    md5::Context ctx;
+    ctx.update(data);
+    auto state = ctx.save();
+    THEN("It is not restored") {
+      REQUIRE(!ctx.restore(""));
+      REQUIRE(!ctx.restore("xyz"));
+      REQUIRE(!ctx.restore(state.substr(0, state.length() - 2)));
+      REQUIRE(!ctx.restore(std::string(state.length(), 'g')));
+      REQUIRE(ctx.size() == 0);
+    }
+  }
+}
@@ -11,3 +11,178 @@
 using namespace painlessmesh;
 
 logger::LogClass Log;
+
+/**
+ * Simulate an exchange with a neighbour whose clock is ahead by the given
+ * offset. The request and the reply are delayed by the given times.
+ */
+void exchange(ntp::ClockFilter& filter, bool& complete, uint32_t t0,
+              int32_t offset, uint32_t there, uint32_t back) {
+  uint32_t t1 = t0 + there + offset;
+  uint32_t t2 = t1 + 100;
+  uint32_t t3 = t2 - offset + back;
+  int32_t measured = ((int32_t)(t1 - t0) / 2) + ((int32_t)(t2 - t3) / 2);
+  complete = filter.add(measured, ntp::tripDelay(t0, t1, t2, t3));
+}
+
+SCENARIO("The clock filter uses the fastest exchange of a burst") {
+  GIVEN("A burst of exchanges where most messages were queued") {
+    ntp::ClockFilter filter;
+    bool complete = false;
+    uint32_t t0 = runif(0, 1e9);
+    int32_t offset = 123456;
+    exchange(filter, complete, t0, offset, 1000, 50000);
+    REQUIRE(!complete);
+    exchange(filter, complete, t0 + 1e5, offset, 40000, 1000);
+    exchange(filter, complete, t0 + 2e5, offset, 1000, 1200);
+    for (auto i = 3; i < TIME_SYNC_BURST; ++i) {
+      REQUIRE(!complete);
+      exchange(filter, complete, t0 + i * 1e5, offset, 20000, 30000);
+    }
+    THEN("The offset of the fastest exchange is used") {
+      REQUIRE(complete);
+      REQUIRE(std::abs(filter.offset() - offset) <= 100);
+    }
+    WHEN("It is applied") {
+      filter.applied(filter.offset(), 0, false);
+      THEN("A new burst starts") { REQUIRE(filter.size() == 0); }
+    }
+  }
+}
+
+SCENARIO("The clock filter estimates the drift between the clocks") {
+  GIVEN("A filter without syncs") {
+    ntp::ClockFilter filter;
+    THEN("The default interval is used") {
+      REQUIRE(filter.interval() == TIME_SYNC_INTERVAL);
+    }
+  }
+
+  GIVEN("A number of syncs, one minute apart") {
+    ntp::ClockFilter filter;
+    // First sync steps the clock
+    filter.applied(1e6, 0, false);
+    // Then the first sync that was accurate
+    filter.applied(1000, 60e6, true);
+    REQUIRE(filter.interval() == TIME_SYNC_INTERVAL);
+    WHEN("The clocks drift apart slowly") {
+      // 60us per minute is 1us per second
+      filter.applied(60, 120e6, true);
+      filter.applied(60, 180e6, true);
+      THEN("The drift is estimated") {
+        REQUIRE(filter.drift == Approx(1.0));
+      }
+      THEN("Syncs are spaced out") {
+        REQUIRE(filter.interval() > TIME_SYNC_INTERVAL);
+        REQUIRE(filter.interval() <= TIME_SYNC_MAX_INTERVAL);
+      }
+    }
+    WHEN("The clocks drift apart fast") {
+      filter.applied(-4000, 120e6, true);
+      THEN("The drift is estimated") {
+        REQUIRE(filter.drift == Approx(-4000 / 60.0));
+      }
+      THEN("The default interval is used") {
+        REQUIRE(filter.interval() == TIME_SYNC_INTERVAL);
+      }
+    }
+    WHEN("The clock is stepped") {
+      filter.applied(1e6, 120e6, false);
+      filter.applied(60, 180e6, true);
+      THEN("The step is not counted as drift") {
+        REQUIRE(filter.interval() == TIME_SYNC_INTERVAL);
+      }
+    }
+  }
+}
+
+class TestTime : public ntp::MeshTime {
+ public:
+  using MeshTime::adjustTime;
+  using MeshTime::lastMicros;
+  using MeshTime::lastSlew;
+  using MeshTime::slew;
+  using MeshTime::slewRemaining;
+  using MeshTime::timeOffset;
+  using MeshTime::toNodeTime64;
+};
+
+SCENARIO("The 64 bit mesh time does not roll over") {
+  GIVEN("A clock just before micros() rolls over") {
+    TestTime t;
+    t.lastMicros = 0xFFFFFFFF;
+    auto time = t.getNodeTime64();
+    THEN("The roll over is counted") {
+      REQUIRE(time >= (1ULL << 32));
+      REQUIRE(t.getNodeTime64() >= time);
+      auto low = (uint32_t)t.getNodeTime64();
+      REQUIRE(t.getNodeTime() - low < 1000);
+    }
+  }
+
+  GIVEN("A mesh time that is beyond 32 bits") {
+    TestTime t;
+    t.timeOffset = (1LL << 33) + 5;
+    auto now = t.getNodeTime64();
+    THEN("A recent 32 bit time can be extended") {
+      REQUIRE(t.toNodeTime64((uint32_t)now - 1000) == now - 1000);
+      REQUIRE(t.toNodeTime64((uint32_t)now) == now);
+    }
+  }
+}
+
+SCENARIO("Small time offsets can be slewed in") {
+  GIVEN("A clock without slewing") {
+    TestTime t;
+    THEN("Offsets are stepped") {
+      REQUIRE(!t.adjustTime(1000));
+      REQUIRE(t.timeOffset == 1000);
+    }
+  }
+
+  GIVEN("A clock with slewing enabled") {
+    TestTime t;
+    t.setTimeSlew();
+    WHEN("A small offset is applied") {
+      REQUIRE(t.adjustTime(1000));
+      REQUIRE(t.timeOffset == 0);
+      auto start = t.lastSlew;
+      THEN("It is applied at the slew rate") {
+        t.slew(start + 1000000);
+        REQUIRE(t.timeOffset == TIME_SLEW_RATE);
+        REQUIRE(t.slewRemaining == 1000 - TIME_SLEW_RATE);
+        t.slew(start + 2000000);
+        REQUIRE(t.timeOffset == 1000);
+        REQUIRE(t.slewRemaining == 0);
+      }
+      THEN("A new offset replaces what is left") {
+        REQUIRE(t.adjustTime(-200));
+        REQUIRE(t.slewRemaining == -200);
+      }
+      THEN("Disabling slewing applies the rest") {
+        t.setTimeSlew(false);
+        REQUIRE(t.timeOffset == 1000);
+      }
+    }
+    WHEN("A negative offset is applied") {
+      REQUIRE(t.adjustTime(-100000));
+      THEN("The time never goes back") {
+        auto last = t.getNodeTime64();
+        for (auto i = 0; i < 1000; ++i) {
+          usleep(100);
+          auto now = t.getNodeTime64();
+          REQUIRE(now >= last);
+          last = now;
+        }
+        REQUIRE(t.slewRemaining < 0);
+        REQUIRE(t.timeOffset < 0);
+      }
+    }
+    WHEN("A large offset is applied") {
+      THEN("It is stepped") {
+        REQUIRE(!t.adjustTime(10 * TIME_SLEW_LIMIT));
+        REQUIRE(t.timeOffset == 10 * TIME_SLEW_LIMIT);
+      }
+    }
+  }
+}
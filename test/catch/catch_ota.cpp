@@ -0,0 +1,839 @@
+#define CATCH_CONFIG_MAIN
+
+#include "catch2/catch.hpp"
+
+#include <Arduino.h>
+
+#include "catch_utils.hpp"
+
+#include "painlessmesh/ota.hpp"
+
+using namespace painlessmesh;
+
+logger::LogClass Log;
+
+using plugin::ota::Window;
+
+class MockConnection : public layout::Neighbour {
+ public:
+  bool addMessage(TSTRING msg, bool priority = false) {
+    ++messages;
+    sent.push_back(msg);
+    return true;
+  }
+  bool addMessage(std::shared_ptr<const TSTRING> msg, bool priority = false) {
+    return addMessage(*msg, priority);
+  }
+
+  size_t messages = 0;
+  std::list<TSTRING> sent;
+};
+
+class MockHandler : public plugin::PackageHandler<MockConnection> {
+ public:
+  MockHandler(uint32_t id) { nodeId = id; }
+
+  /**
+   * Handle the messages the other side sent over the connection
+   */
+  void receive(std::shared_ptr<MockConnection> conn,
+               std::shared_ptr<MockConnection> other) {
+    while (other->sent.size() > 0) {
+      auto msg = other->sent.front();
+      other->sent.pop_front();
+      router::routePackage<MockConnection>((*this), conn, msg, callbackList, 0);
+    }
+  }
+};
+
+/**
+ * Connect two handlers, returns the connection of each side
+ */
+std::pair<std::shared_ptr<MockConnection>, std::shared_ptr<MockConnection>>
+connect(MockHandler& a, uint32_t aId, MockHandler& b, uint32_t bId) {
+  auto toB = std::make_shared<MockConnection>();
+  toB->nodeId = bId;
+  a.subs.push_back(toB);
+  auto toA = std::make_shared<MockConnection>();
+  toA->nodeId = aId;
+  b.subs.push_back(toA);
+  return {toB, toA};
+}
+
+/**
+ * Two handlers connected to each other, see connect()
+ */
+class MockLink {
+ public:
+  MockLink(MockHandler& a, MockHandler& b)
+      : a(a), b(b), conns(connect(a, a.getNodeId(), b, b.getNodeId())) {}
+
+  /**
+   * Deliver the messages that both sides queued
+   */
+  void deliver() {
+    b.receive(conns.second, conns.first);
+    a.receive(conns.first, conns.second);
+  }
+
+  MockHandler& a;
+  MockHandler& b;
+  std::pair<std::shared_ptr<MockConnection>, std::shared_ptr<MockConnection>>
+      conns;
+};
+
+/**
+ * Run the scheduler and deliver messages until done() or 10 seconds passed
+ */
+void runMesh(Scheduler& scheduler, std::vector<MockLink>& links,
+             std::function<bool()> done) {
+  auto start = millis();
+  while (!done() && millis() - start < 10000) {
+    scheduler.execute();
+    for (auto&& link : links) link.deliver();
+    delay(1000);
+  }
+}
+
+/**
+ * Answer all requests in order and write everything that is available
+ */
+size_t answer(Window& window, std::vector<size_t> requests,
+              std::vector<size_t>& written) {
+  size_t accepted = 0;
+  for (auto&& partNo : requests) {
+    if (window.add(partNo, std::string(100, 'a' + partNo % 26))) ++accepted;
+    while (window.available()) {
+      written.push_back(window.partNo());
+      window.take();
+    }
+  }
+  return accepted;
+}
+
+SCENARIO("The OTA window requests multiple parts at once") {
+  GIVEN("A window for an update of ten parts") {
+    Window window(10, 4);
+    std::vector<size_t> written;
+    auto requests = window.requests(0);
+    THEN("The first parts are requested at once") {
+      REQUIRE(requests == std::vector<size_t>({0, 1, 2, 3}));
+      REQUIRE(window.inFlight() == 4);
+      REQUIRE(window.requests(10).empty());
+    }
+
+    WHEN("The parts arrive") {
+      REQUIRE(answer(window, requests, written) == 4);
+      THEN("They are written and the window moves on") {
+        REQUIRE(written == std::vector<size_t>({0, 1, 2, 3}));
+        REQUIRE(window.requests(10) == std::vector<size_t>({4, 5, 6, 7}));
+        REQUIRE(window.bufferedBytes() == 0);
+      }
+    }
+
+    WHEN("All parts arrive") {
+      uint32_t now = 0;
+      while (!requests.empty()) {
+        answer(window, requests, written);
+        now += 100;
+        requests = window.requests(now);
+      }
+      THEN("The update is complete") {
+        REQUIRE(window.complete());
+        REQUIRE(!window.failed());
+        REQUIRE(written.size() == 10);
+        REQUIRE(window.bytesWritten() == 1000);
+        // Three round trips of 100ms
+        REQUIRE(now == 300);
+        REQUIRE(window.throughput(now) == 3333);
+      }
+    }
+
+    WHEN("A part arrives twice") {
+      answer(window, {0}, written);
+      THEN("The duplicate is ignored") {
+        REQUIRE(answer(window, {0}, written) == 0);
+        REQUIRE(written.size() == 1);
+      }
+    }
+
+    WHEN("A part is lost") {
+      answer(window, {0, 2, 3}, written);
+      THEN("The later parts are buffered") {
+        REQUIRE(written == std::vector<size_t>({0}));
+        REQUIRE(window.bufferedBytes() == 200);
+      }
+      THEN("Only the lost part is requested again") {
+        REQUIRE(window.requests(10) == std::vector<size_t>({1, 4}));
+        answer(window, {1}, written);
+        REQUIRE(written == std::vector<size_t>({0, 1, 2, 3}));
+        REQUIRE(window.bufferedBytes() == 0);
+      }
+    }
+
+    WHEN("No replies arrive") {
+      uint32_t now = 0;
+      for (auto i = 1; i < OTA_MAX_TRIES; ++i) {
+        now += OTA_REQUEST_TIMEOUT;
+        REQUIRE(window.requests(now) == std::vector<size_t>({0, 1, 2, 3}));
+      }
+      THEN("The update fails eventually") {
+        REQUIRE(!window.failed());
+        now += OTA_REQUEST_TIMEOUT;
+        REQUIRE(window.requests(now).empty());
+        REQUIRE(window.failed());
+      }
+    }
+  }
+
+  GIVEN("A window with a small buffer") {
+    Window window(20, 8, 250);
+    std::vector<size_t> written;
+    answer(window, window.requests(0), written);
+    THEN("The window shrinks so the parts fit in the buffer") {
+      auto requests = window.requests(10);
+      REQUIRE(requests.size() == 3);
+      answer(window, {requests[1], requests[2]}, written);
+      REQUIRE(window.bufferedBytes() <= 250);
+    }
+  }
+
+  GIVEN("Parts that arrive out of order with a full buffer") {
+    Window window(10, 4, 150);
+    std::vector<size_t> written;
+    window.requests(0);
+    THEN("Parts that do not fit are dropped, but the next part is kept") {
+      REQUIRE(answer(window, {2, 3}, written) == 1);
+      REQUIRE(window.bufferedBytes() == 100);
+      REQUIRE(answer(window, {1, 0}, written) == 1);
+      REQUIRE(written == std::vector<size_t>({0}));
+      REQUIRE(answer(window, {1}, written) == 1);
+      REQUIRE(written == std::vector<size_t>({0, 1, 2}));
+    }
+  }
+}
+
+SCENARIO("OTA data is send as escaped bytes when the node supports it") {
+  using namespace plugin::ota;
+  std::string firmware;
+  for (auto i = 0; i < 1024; ++i) firmware += (char)runif(0, 255);
+  firmware += std::string(100, 0);
+
+  Announce announce;
+  announce.from = 1;
+  announce.md5 = randomString(32);
+  announce.noPart = 10;
+  auto request = DataRequest::replyTo(announce, 2, 3);
+  REQUIRE(request.encoding == ESCAPED);
+
+  GIVEN("A reply to a new node") {
+    auto data = Data::replyTo(request, firmware.c_str(), firmware.length(), 3);
+    THEN("The data is barely larger than the firmware") {
+      REQUIRE(data.encoding == ESCAPED);
+      REQUIRE(data.data.length() <= firmware.length() + 10);
+      REQUIRE(data.data.find((char)0) == std::string::npos);
+    }
+    THEN("The firmware can be read back from a binary frame") {
+      std::string frame;
+      protocol::Variant(&data).printBinaryTo(frame);
+      auto data2 = protocol::Variant(frame).to<Data>();
+      REQUIRE(data2.partNo == 3);
+      REQUIRE(data2.encoding == ESCAPED);
+      REQUIRE(data2.bytes() == firmware);
+    }
+    THEN("The firmware can be read back from json") {
+      std::string json;
+      protocol::Variant(&data).printTo(json);
+      auto data2 = protocol::Variant(json).to<Data>();
+      REQUIRE(data2.bytes() == firmware);
+    }
+  }
+
+  GIVEN("A request from an older node") {
+    std::string json;
+    protocol::Variant(&request).printTo(json);
+    auto pos = json.find(",\"encoding\":1");
+    REQUIRE(pos != std::string::npos);
+    json.erase(pos, 13);
+    auto oldRequest = protocol::Variant(json).to<DataRequest>();
+    REQUIRE(oldRequest.encoding == BASE64);
+    THEN("It gets base64") {
+      auto data =
+          Data::replyTo(oldRequest, firmware.c_str(), firmware.length(), 3);
+      REQUIRE(data.encoding == BASE64);
+      REQUIRE(data.data == base64::encode((unsigned char const*)firmware.c_str(),
+                                          firmware.length()));
+    }
+  }
+
+  GIVEN("Data from an older distribution node") {
+    Data data;
+    data.data = base64::encode((unsigned char const*)firmware.c_str(),
+                               firmware.length());
+    std::string json;
+    protocol::Variant(&data).printTo(json);
+    REQUIRE(json.find("encoding") == std::string::npos);
+    THEN("The base64 data is decoded") {
+      auto data2 = protocol::Variant(json).to<Data>();
+      REQUIRE(data2.bytes() == firmware);
+    }
+  }
+}
+
+SCENARIO("The OTA window uses parts broadcast for other nodes") {
+  GIVEN("A window that requested the first parts") {
+    Window window(10, 4);
+    std::vector<size_t> written;
+    window.requests(0);
+    WHEN("Parts are broadcast") {
+      REQUIRE(window.add(0, std::string(100, 'a'), true));
+      REQUIRE(!window.add(0, std::string(100, 'a'), true));
+      window.take();
+      REQUIRE(window.add(4, std::string(100, 'e'), true));
+      THEN("Parts beyond the window are ignored") {
+        REQUIRE(!window.add(8, std::string(100, 'i'), true));
+      }
+      THEN("Broadcasts do not mark requested parts as lost") {
+        REQUIRE(window.requests(10).empty());
+      }
+      THEN("Parts that were received are not requested") {
+        answer(window, {1, 2, 3}, written);
+        REQUIRE(window.requests(10) == std::vector<size_t>({5, 6, 7, 8}));
+      }
+    }
+  }
+}
+
+SCENARIO("The OTA distributor broadcasts parts that many nodes need") {
+  using namespace plugin::ota;
+  Announce announce;
+  announce.from = 1;
+  announce.noPart = 10;
+  Distributor distributor;
+
+  GIVEN("A single node that is updating") {
+    distributor.add(DataRequest::replyTo(announce, 2, 0), 0);
+    THEN("Parts are send to it right away") {
+      auto sends = distributor.due(0);
+      REQUIRE(sends.size() == 1);
+      REQUIRE(sends[0].dest == 2);
+      REQUIRE(sends[0].partNo == 0);
+      REQUIRE(sends[0].encoding == ESCAPED);
+      REQUIRE(distributor.due(0).empty());
+    }
+  }
+
+  GIVEN("Nodes that request the same part") {
+    distributor.add(DataRequest::replyTo(announce, 2, 3), 0);
+    distributor.add(DataRequest::replyTo(announce, 3, 3), 50);
+    REQUIRE(distributor.requesters() == 2);
+    THEN("The requests are combined into a single broadcast") {
+      REQUIRE(distributor.due(50).empty());
+      auto sends = distributor.due(OTA_MULTICAST_DELAY);
+      REQUIRE(sends.size() == 1);
+      REQUIRE(sends[0].dest == 0);
+      REQUIRE(distributor.broadcasts == 1);
+    }
+  }
+
+  GIVEN("A node that is behind") {
+    distributor.add(DataRequest::replyTo(announce, 2, 1), 0);
+    distributor.add(DataRequest::replyTo(announce, 3, 5), 0);
+    THEN("Parts it still needs are broadcast, others are send directly") {
+      auto sends = distributor.due(OTA_MULTICAST_DELAY);
+      REQUIRE(sends.size() == 2);
+      REQUIRE(sends[0].partNo == 1);
+      REQUIRE(sends[0].dest == 2);
+      REQUIRE(sends[1].partNo == 5);
+      REQUIRE(sends[1].dest == 0);
+      REQUIRE(distributor.unicasts == 1);
+      REQUIRE(distributor.broadcasts == 1);
+    }
+  }
+
+  GIVEN("A node that only reads base64") {
+    distributor.add(DataRequest::replyTo(announce, 2, 3), 0);
+    auto request = DataRequest::replyTo(announce, 3, 3);
+    request.encoding = BASE64;
+    distributor.add(request, 0);
+    THEN("Broadcasts use base64") {
+      auto sends = distributor.due(OTA_MULTICAST_DELAY);
+      REQUIRE(sends.size() == 1);
+      REQUIRE(sends[0].encoding == BASE64);
+    }
+  }
+
+  GIVEN("A node that stopped requesting") {
+    distributor.add(DataRequest::replyTo(announce, 2, 3), 0);
+    distributor.add(DataRequest::replyTo(announce, 3, 9), 0);
+    distributor.due(OTA_MULTICAST_DELAY);
+    THEN("It is forgotten after the time out") {
+      distributor.add(DataRequest::replyTo(announce, 2, 4),
+                      OTA_REQUEST_TIMEOUT);
+      auto sends = distributor.due(OTA_REQUEST_TIMEOUT);
+      REQUIRE(distributor.requesters() == 1);
+      REQUIRE(sends.size() == 1);
+      REQUIRE(sends[0].dest == 2);
+    }
+  }
+}
+
+SCENARIO("An interrupted update continues where it stopped") {
+  using namespace plugin::ota;
+  std::vector<std::string> parts;
+  std::string firmware;
+  for (auto i = 0; i < 40; ++i) {
+    parts.push_back(randomString(runif(50, 150)));
+    firmware += parts.back();
+  }
+  md5::Context ctx;
+  ctx.update(firmware);
+
+  Announce announce;
+  announce.md5 = ctx.hexdigest();
+  announce.noPart = parts.size();
+
+  GIVEN("The progress of an update") {
+    Progress progress(announce);
+    size_t checkpoints = 0;
+    std::string saved;
+    for (auto i = 0; i < 20; ++i) {
+      if (progress.add(parts[i])) {
+        ++checkpoints;
+        saved = "";
+        protocol::Variant(&progress).printTo(saved);
+      }
+    }
+    REQUIRE(checkpoints == 20 / OTA_CHECKPOINT_PARTS);
+    REQUIRE(progress.partNo == 20);
+    REQUIRE(!progress.complete());
+
+    WHEN("It is read back after a reboot") {
+      auto restored = protocol::Variant(saved).to<Progress>();
+      THEN("It continues from the last checkpoint") {
+        REQUIRE(restored.valid());
+        REQUIRE(restored.md5 == announce.md5);
+        REQUIRE(restored.partNo == OTA_CHECKPOINT_PARTS);
+        size_t bytes = 0;
+        for (auto i = 0; i < OTA_CHECKPOINT_PARTS; ++i)
+          bytes += parts[i].length();
+        REQUIRE(restored.bytes == bytes);
+
+        Window window(restored.noPart);
+        window.resume(restored.partNo);
+        auto requests = window.requests(0);
+        REQUIRE(requests.size() > 0);
+        REQUIRE(requests[0] == OTA_CHECKPOINT_PARTS);
+
+        for (auto i = restored.partNo; i < parts.size(); ++i)
+          restored.add(parts[i]);
+        REQUIRE(restored.complete());
+        REQUIRE(restored.verify());
+      }
+    }
+
+    WHEN("The saved hash is corrupted") {
+      auto pos = saved.find("\"hash\":\"") + 8;
+      saved[pos] = (saved[pos] == '0') ? '1' : '0';
+      auto restored = protocol::Variant(saved).to<Progress>();
+      THEN("The update still continues, but does not verify") {
+        REQUIRE(restored.valid());
+        for (auto i = restored.partNo; i < parts.size(); ++i)
+          restored.add(parts[i]);
+        REQUIRE(restored.complete());
+        REQUIRE(!restored.verify());
+      }
+    }
+
+    WHEN("The saved progress is inconsistent") {
+      auto pos = saved.find("\"bytes\":") + 8;
+      saved.insert(pos, "1");
+      auto restored = protocol::Variant(saved).to<Progress>();
+      THEN("It starts from the beginning") {
+        REQUIRE(!restored.valid());
+        REQUIRE(restored.partNo == 0);
+        REQUIRE(restored.bytes == 0);
+      }
+    }
+
+    WHEN("The update is finished") {
+      for (auto i = progress.partNo; i < parts.size(); ++i) progress.add(parts[i]);
+      THEN("The MD5 matches") {
+        REQUIRE(progress.complete());
+        REQUIRE(progress.verify());
+        REQUIRE(progress.bytes == firmware.length());
+      }
+    }
+  }
+
+  GIVEN("A firmware that does not match the announced MD5") {
+    Progress progress(announce);
+    for (auto i = 0; i < 40; ++i)
+      progress.add(i == 7 ? std::string(parts[i].length(), 'x') : parts[i]);
+    THEN("It is not verified") {
+      REQUIRE(progress.complete());
+      REQUIRE(!progress.verify());
+    }
+  }
+}
+
+SCENARIO("Relay nodes keep the most recent parts") {
+  using namespace plugin::ota;
+  GIVEN("A small cache") {
+    Cache cache(250);
+    auto md5 = randomString(32);
+    cache.add(md5, 0, std::string(100, 'a'));
+    cache.add(md5, 1, std::string(100, 'b'));
+    REQUIRE(cache.size() == 2);
+    REQUIRE(cache.bytes() == 200);
+    THEN("Parts can be found by md5 and part number") {
+      REQUIRE(cache.find(md5, 1));
+      REQUIRE(*cache.find(md5, 1) == std::string(100, 'b'));
+      REQUIRE(!cache.find(md5, 2));
+      REQUIRE(!cache.find(randomString(32), 1));
+    }
+    WHEN("Adding a part that does not fit") {
+      cache.add(md5, 2, std::string(100, 'c'));
+      THEN("The oldest part is dropped") {
+        REQUIRE(cache.size() == 2);
+        REQUIRE(cache.bytes() == 200);
+        REQUIRE(!cache.find(md5, 0));
+        REQUIRE(cache.find(md5, 1));
+        REQUIRE(cache.find(md5, 2));
+      }
+    }
+    WHEN("Adding a part that is already there or larger than the cache") {
+      cache.add(md5, 1, std::string(100, 'b'));
+      cache.add(md5, 3, std::string(300, 'd'));
+      THEN("Nothing changes") {
+        REQUIRE(cache.size() == 2);
+        REQUIRE(cache.find(md5, 0));
+        REQUIRE(!cache.find(md5, 3));
+      }
+    }
+  }
+}
+
+SCENARIO("Relay nodes answer requests for parts they have seen") {
+  using namespace plugin::ota;
+  GIVEN("A package handler with a cache and a neighbour") {
+    MockHandler handler(1);
+    handler.subs.push_back(std::make_shared<MockConnection>());
+    handler.subs.back()->nodeId = 2;
+    auto conn = handler.subs.back();
+    auto cache = addCache(handler);
+
+    Announce announce;
+    announce.from = 9;
+    announce.md5 = randomString(32);
+    announce.noPart = 10;
+    auto request = DataRequest::replyTo(announce, 2, 3);
+
+    std::string firmware(100, 'f');
+    auto data = Data::replyTo(request, firmware.c_str(), firmware.length(), 3);
+    protocol::Variant dataVariant(&data);
+    REQUIRE(!handler.relay(dataVariant));
+    REQUIRE(cache->size() == 1);
+
+    WHEN("A request for a cached part passes through") {
+      protocol::Variant variant(&request);
+      THEN("It is answered from the cache") {
+        REQUIRE(handler.relay(variant));
+        REQUIRE(cache->hits == 1);
+        REQUIRE(conn->messages == 1);
+      }
+      THEN("The answer still comes from the distribution node") {
+        REQUIRE(handler.relay(variant));
+        auto reply = protocol::Variant(conn->sent.back()).to<Data>();
+        REQUIRE(reply.from == 9);
+        REQUIRE(reply.dest == 2);
+        REQUIRE(reply.partNo == 3);
+        // So a request made in reply to it goes to the distribution node
+        REQUIRE(DataRequest::replyTo(reply, 4).dest == 9);
+      }
+    }
+
+    WHEN("A request for another part passes through") {
+      auto other = DataRequest::replyTo(announce, 2, 4);
+      protocol::Variant variant(&other);
+      THEN("It is send on") {
+        REQUIRE(!handler.relay(variant));
+        REQUIRE(cache->hits == 0);
+        REQUIRE(conn->messages == 0);
+      }
+    }
+  }
+}
+
+SCENARIO("A node updates through a relay that caches part of the image") {
+  using namespace plugin::ota;
+  GIVEN("A distributor, a relay node with a cache and an updating node") {
+    Scheduler scheduler;
+    MockHandler distributor(1);
+    MockHandler relay(3);
+    MockHandler node(2);
+    std::vector<MockLink> links;
+    links.emplace_back(distributor, relay);
+    links.emplace_back(relay, node);
+    auto behindRelay = protocol::NodeTree(3, false);
+    behindRelay.subs.push_back(protocol::NodeTree(2, false));
+    links[0].conns.first->updateSubs(behindRelay);
+    auto towardsDistributor = protocol::NodeTree(3, false);
+    towardsDistributor.subs.push_back(protocol::NodeTree(1, false));
+    links[1].conns.second->updateSubs(towardsDistributor);
+
+    size_t partSize = 128;
+    auto image =
+        std::make_shared<const std::string>(randomString(40 * partSize));
+    md5::Context ctx;
+    ctx.update(*image);
+    Announce announce;
+    announce.role = "test";
+    announce.hardware = State().hardware;
+    auto served = addDistributor(scheduler, distributor, announce, image,
+                                 partSize, 200 * TASK_MILLISECOND);
+
+    // The cache holds the first parts only
+    auto cache = addCache(relay, 3 * partSize);
+    for (size_t i = 0; i < 3; ++i)
+      cache->add(ctx.hexdigest(), i, image->substr(i * partSize, partSize));
+
+    State current;
+    current.role = "test";
+    auto sink = std::make_shared<MemorySink>();
+    std::string installed;
+    sink->onEnd = [&installed](const std::string& image) {
+      installed = image;
+      return true;
+    };
+    auto updater = addUpdater(scheduler, node, current, sink);
+
+    WHEN("Running until the node is updated") {
+      runMesh(scheduler, links, [&updater]() { return updater->installed > 0; });
+      THEN("The cached parts come from the relay and the rest from the "
+           "distributor") {
+        REQUIRE(updater->installed == 1);
+        REQUIRE(installed == *image);
+        REQUIRE(cache->hits >= 1);
+        REQUIRE(served->unicasts >= 40 - cache->hits);
+        REQUIRE(served->requesters() == 1);
+      }
+    }
+    distributor.stop();
+    relay.stop();
+    node.stop();
+  }
+}
+
+SCENARIO("A node updates from a distributor without ESP specific code") {
+  using namespace plugin::ota;
+  GIVEN("A distributor and a node with a memory sink") {
+    Scheduler scheduler;
+    MockHandler distributor(1);
+    MockHandler node(2);
+    auto conns = connect(distributor, 1, node, 2);
+
+    auto image = std::make_shared<const std::string>(randomString(40 * 128));
+    md5::Context ctx;
+    ctx.update(*image);
+    Announce announce;
+    announce.role = "test";
+    announce.hardware = State().hardware;
+    auto served = addDistributor(scheduler, distributor, announce, image, 128,
+                                 200 * TASK_MILLISECOND);
+
+    State current;
+    current.role = "test";
+    auto sink = std::make_shared<MemorySink>();
+    std::string installed;
+    sink->onEnd = [&installed](const std::string& image) {
+      installed = image;
+      return true;
+    };
+    auto updater = addUpdater(scheduler, node, current, sink);
+
+    auto run = [&](MockHandler& node, std::function<bool()> done) {
+      auto start = millis();
+      while (!done() && millis() - start < 10000) {
+        scheduler.execute();
+        node.receive(conns.second, conns.first);
+        distributor.receive(conns.first, conns.second);
+        delay(1000);
+      }
+    };
+
+    WHEN("Running until the node is updated") {
+      run(node, [&updater]() { return updater->installed > 0; });
+      THEN("The node has the firmware") {
+        REQUIRE(updater->installed == 1);
+        REQUIRE(installed == *image);
+        REQUIRE(updater->current.md5 == ctx.hexdigest());
+        REQUIRE(updater->update.md5 == "");
+        REQUIRE(served->unicasts > 0);
+      }
+    }
+
+    WHEN("The node reboots half way") {
+      run(node, [&updater]() {
+        return updater->progress.partNo > OTA_CHECKPOINT_PARTS + 2;
+      });
+      REQUIRE(updater->installed == 0);
+      node.stop();
+      MockHandler rebooted(2);
+      rebooted.subs.push_back(conns.second);
+      auto updater2 = addUpdater(scheduler, rebooted, current, sink);
+      THEN("It continues from the last checkpoint") {
+        REQUIRE(updater2->progress.md5 == ctx.hexdigest());
+        REQUIRE(updater2->progress.partNo == OTA_CHECKPOINT_PARTS);
+        run(rebooted, [&updater2]() { return updater2->installed > 0; });
+        REQUIRE(updater2->installed == 1);
+        REQUIRE(installed == *image);
+      }
+      rebooted.stop();
+    }
+    distributor.stop();
+    node.stop();
+  }
+
+  GIVEN("A distributor with one node next to it and two behind a relay") {
+    Scheduler scheduler;
+    MockHandler distributor(1);
+    MockHandler node2(2);
+    MockHandler relay(3);
+    MockHandler node4(4);
+    MockHandler node5(5);
+    std::vector<MockLink> links;
+    links.emplace_back(distributor, node2);
+    links.emplace_back(distributor, relay);
+    links.emplace_back(relay, node4);
+    links.emplace_back(relay, node5);
+
+    // Routes over the relay
+    auto behindRelay = protocol::NodeTree(3, false);
+    behindRelay.subs.push_back(protocol::NodeTree(4, false));
+    behindRelay.subs.push_back(protocol::NodeTree(5, false));
+    links[1].conns.first->updateSubs(behindRelay);
+    for (auto i : {2, 3}) {
+      auto towardsDistributor = protocol::NodeTree(3, false);
+      towardsDistributor.subs.push_back(protocol::NodeTree(1, false));
+      towardsDistributor.subs.back().subs.push_back(
+          protocol::NodeTree(2, false));
+      links[i].conns.second->updateSubs(towardsDistributor);
+    }
+
+    auto image = std::make_shared<const std::string>(randomString(40 * 128));
+    Announce announce;
+    announce.role = "test";
+    announce.hardware = State().hardware;
+    auto served = addDistributor(scheduler, distributor, announce, image, 128,
+                                 200 * TASK_MILLISECOND);
+    auto cache = addCache(relay);
+
+    State current;
+    current.role = "test";
+    size_t installed = 0;
+    std::vector<std::shared_ptr<Updater>> updaters;
+    for (auto node : {&node2, &node4, &node5}) {
+      auto sink = std::make_shared<MemorySink>();
+      sink->onEnd = [&installed, image](const std::string& received) {
+        if (received == *image) ++installed;
+        return true;
+      };
+      updaters.push_back(addUpdater(scheduler, *node, current, sink));
+    }
+
+    WHEN("Running until all nodes are updated") {
+      runMesh(scheduler, links, [&installed]() { return installed == 3; });
+      THEN("Every node has the firmware") {
+        REQUIRE(installed == 3);
+        for (auto&& updater : updaters) REQUIRE(updater->installed == 1);
+        // The relay saw the parts on their way to the nodes behind it
+        REQUIRE(cache->size() > 0);
+      }
+      THEN("The distributor only saw requests from the updating nodes") {
+        // Requests made in reply to parts with the wrong from would add the
+        // relay or a node 0
+        REQUIRE(served->requesters() == 3);
+      }
+    }
+    distributor.stop();
+    node2.stop();
+    relay.stop();
+    node4.stop();
+    node5.stop();
+  }
+}
+
+SCENARIO("Several nodes update from the parts a distributor broadcasts") {
+  using namespace plugin::ota;
+  GIVEN("A distributor with two nodes that update at the same time") {
+    Scheduler scheduler;
+    MockHandler distributor(1);
+    MockHandler node2(2);
+    MockHandler node3(3);
+    std::vector<MockLink> links;
+    links.emplace_back(distributor, node2);
+    links.emplace_back(distributor, node3);
+
+    auto image = std::make_shared<const std::string>(randomString(40 * 128));
+    Announce announce;
+    announce.role = "test";
+    announce.hardware = State().hardware;
+    auto served = addDistributor(scheduler, distributor, announce, image, 128,
+                                 200 * TASK_MILLISECOND);
+
+    State current;
+    current.role = "test";
+    size_t installed = 0;
+    std::vector<std::shared_ptr<Updater>> updaters;
+    for (auto node : {&node2, &node3}) {
+      auto sink = std::make_shared<MemorySink>();
+      sink->onEnd = [&installed, image](const std::string& received) {
+        if (received == *image) ++installed;
+        return true;
+      };
+      updaters.push_back(addUpdater(scheduler, *node, current, sink));
+    }
+
+    WHEN("Running until both nodes are updated") {
+      runMesh(scheduler, links, [&installed]() { return installed == 2; });
+      THEN("Both nodes have the firmware") {
+        REQUIRE(installed == 2);
+        REQUIRE(updaters[0]->installed == 1);
+        REQUIRE(updaters[1]->installed == 1);
+        REQUIRE(served->broadcasts > 0);
+      }
+      THEN("The distributor only saw requests from the real nodes") {
+        // Nodes are forgotten after OTA_REQUEST_TIMEOUT, so they are all
+        // still known
+        REQUIRE(served->requesters() == 2);
+      }
+    }
+    distributor.stop();
+    node2.stop();
+    node3.stop();
+  }
+}
+
+SCENARIO("A node can distribute a firmware") {
+  using namespace plugin::ota;
+  GIVEN("A distributor added to a package handler") {
+    Scheduler scheduler;
+    plugin::PackageHandler<MockConnection> handler;
+    Announce announce;
+    announce.md5 = randomString(32);
+    announce.noPart = 4;
+    size_t reads = 0;
+    auto distributor = addDistributor(scheduler, handler, announce,
+                                      [&reads](size_t partNo) {
+                                        ++reads;
+                                        return std::string(100, 0);
+                                      });
+    THEN("It waits for requests") {
+      scheduler.execute();
+      REQUIRE(distributor->requesters() == 0);
+      REQUIRE(reads == 0);
+    }
+    handler.stop();
+  }
+}
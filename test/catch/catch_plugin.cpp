@@ -6,6 +6,7 @@
 
 #include "catch_utils.hpp"
 
+#include "painlessmesh/ota.hpp"
 #include "painlessmesh/plugin.hpp"
 #include "plugin/performance.hpp"
 
@@ -51,9 +52,52 @@ class BCustomPackage : public plugin::BroadcastPackage {
   size_t jsonObjectSize() const { return JSON_OBJECT_SIZE(noJsonFields + 1); }
 };
 
+class SchemaPackage : public plugin::SinglePackage {
+ public:
+  double sensor = 1.0;
+  TSTRING unit;
+  bool calibrated = false;
+
+  SchemaPackage() : SinglePackage(22) {}
+
+  SchemaPackage(JsonObject jsonObj) : SinglePackage(22) {
+    schema::read(*this, jsonObj);
+  }
+
+  JsonObject addTo(JsonObject&& jsonObj) const {
+    return schema::write(*this, std::move(jsonObj));
+  }
+
+  size_t jsonObjectSize() const { return schema::jsonObjectSize(*this); }
+
+  template <class V>
+  void visit(V& v) {
+    SinglePackage::visit(v);
+    v("sensor", sensor);
+    v("unit", unit);
+    v.optional("calibrated", calibrated);
+  }
+};
+
+/**
+ * Write the package into a document of exactly the reported size
+ */
+template <class T>
+T roundTrip(const T& pkg, size_t& used) {
+  DynamicJsonDocument doc(pkg.jsonObjectSize());
+  pkg.addTo(doc.to<JsonObject>());
+  used = doc.memoryUsage();
+  std::string json;
+  serializeJson(doc, json);
+  auto variant = protocol::Variant(json);
+  REQUIRE(!variant.error);
+  return variant.to<T>();
+}
+
 class MockConnection : public layout::Neighbour {
  public:
   bool addMessage(TSTRING msg) { return true; }
+  bool addMessage(std::shared_ptr<const TSTRING> msg) { return true; }
 };
 
 SCENARIO("We can send a custom package") {
@@ -97,7 +141,7 @@ SCENARIO("We can send a custom package") {
 
   GIVEN("A package handler function") {
     auto handler = plugin::PackageHandler<MockConnection>();
-    auto func = [](protocol::Variant variant) {
+    auto func = [](protocol::Variant& variant) {
       auto pkg = variant.to<CustomPackage>();
       REQUIRE(pkg.routing == router::BROADCAST);
       return false;
@@ -172,3 +216,198 @@ SCENARIO("We can add anonymous tasks to the taskscheduler") {
     }
   }
 }
+
+class CountingHandler : public plugin::PackageHandler<MockConnection> {
+ public:
+  size_t tasks() { return this->taskList.size(); }
+};
+
+SCENARIO("Disabled tasks are reused") {
+  GIVEN("A number of one shot tasks that have run") {
+    Scheduler mScheduler;
+    auto handler = CountingHandler();
+    auto i = 0;
+    for (auto n = 0; n < 100; ++n)
+      handler.addTask(mScheduler, 0, TASK_ONCE, [&i]() { ++i; });
+    mScheduler.execute();
+    mScheduler.execute();
+    REQUIRE(i == 100);
+    REQUIRE(handler.tasks() == 100);
+
+    WHEN("New tasks are added") {
+      for (auto n = 0; n < 100; ++n)
+        handler.addTask(mScheduler, 0, TASK_ONCE, [&i]() { ++i; });
+      mScheduler.execute();
+      THEN("The old tasks are used") {
+        REQUIRE(i == 200);
+        REQUIRE(handler.tasks() == 100);
+      }
+    }
+
+    WHEN("A task is still referenced") {
+      auto task = handler.addTask(mScheduler, 0, TASK_ONCE, []() {});
+      mScheduler.execute();
+      mScheduler.execute();
+      REQUIRE(!task->isEnabled());
+      auto task2 = handler.addTask(mScheduler, 0, TASK_ONCE, []() {});
+      THEN("It is not reused") { REQUIRE(task2 != task); }
+    }
+    handler.stop();
+  }
+
+  GIVEN("Tasks with their own OnDisable callback") {
+    Scheduler mScheduler;
+    auto handler = CountingHandler();
+    auto disabled = 0;
+    for (auto n = 0; n < 10; ++n) {
+      auto task = handler.addTask(mScheduler, 0, TASK_ONCE, []() {});
+      task->setOnDisable([&disabled]() { ++disabled; });
+    }
+    mScheduler.execute();
+    mScheduler.execute();
+    REQUIRE(disabled == 10);
+    WHEN("Many new tasks are added") {
+      for (auto n = 0; n < 100; ++n)
+        handler.addTask(mScheduler, 0, TASK_ONCE, []() {});
+      THEN("They are found and reused eventually") {
+        // 90 new tasks, plus the 10 old ones
+        REQUIRE(handler.tasks() == 100);
+      }
+    }
+    handler.stop();
+  }
+}
+
+SCENARIO("A handler can be destroyed while its tasks are enabled") {
+  GIVEN("An enabled task that outlives its handler") {
+    Scheduler mScheduler;
+    std::shared_ptr<Task> task;
+    {
+      auto handler = CountingHandler();
+      task = handler.addTask(mScheduler, TASK_HOUR, TASK_ONCE, []() {});
+      handler.addTask(mScheduler, TASK_HOUR, TASK_ONCE, []() {});
+    }
+    THEN("Disabling it does not refer to the handler") {
+      task->disable();
+      REQUIRE(!task->isEnabled());
+    }
+  }
+}
+
+SCENARIO("Adding a task does not depend on the number of pending tasks") {
+  GIVEN("Thousands of pending one shot tasks") {
+    Scheduler mScheduler;
+    auto handler = CountingHandler();
+    for (auto n = 0; n < 5000; ++n)
+      handler.addTask(mScheduler, TASK_HOUR, TASK_ONCE, []() {});
+    THEN("Adding and finishing one shot tasks is fast") {
+      BENCHMARK("1000 x addTask with 5000 pending tasks") {
+        for (auto n = 0; n < 1000; ++n)
+          handler.addTask(mScheduler, TASK_HOUR, TASK_ONCE, []() {})
+              ->disable();
+      }
+      REQUIRE(handler.tasks() == 5001);
+    }
+    handler.stop();
+  }
+}
+
+SCENARIO("Packages can be described by a list of fields") {
+  GIVEN("A package using the schema") {
+    auto pkg = SchemaPackage();
+    pkg.from = 1;
+    pkg.dest = 2;
+    pkg.sensor = 21.5;
+    pkg.unit = "celsius";
+    THEN("It is written and read back with the exact size") {
+      size_t used = 0;
+      auto pkg2 = roundTrip(pkg, used);
+      REQUIRE(used == pkg.jsonObjectSize());
+      REQUIRE(pkg2.from == 1);
+      REQUIRE(pkg2.dest == 2);
+      REQUIRE(pkg2.routing == router::SINGLE);
+      REQUIRE(pkg2.type == 22);
+      REQUIRE(pkg2.sensor == 21.5);
+      REQUIRE(pkg2.unit == "celsius");
+      REQUIRE(!pkg2.calibrated);
+    }
+    THEN("Optional fields are only written when set") {
+      auto variant = protocol::Variant(&pkg);
+      std::string json;
+      variant.printTo(json);
+      REQUIRE(json.find("calibrated") == std::string::npos);
+      pkg.calibrated = true;
+      auto variant2 = protocol::Variant(&pkg);
+      json.clear();
+      variant2.printTo(json);
+      REQUIRE(json.find("calibrated") != std::string::npos);
+      REQUIRE(variant2.to<SchemaPackage>().calibrated);
+    }
+  }
+
+  GIVEN("The ota packages") {
+    auto data = plugin::ota::Data();
+    data.from = 1;
+    data.dest = 2;
+    data.md5 = randomString(32);
+    data.hardware = "ESP32";
+    data.role = randomString(10);
+    data.forced = true;
+    data.noPart = 11;
+    data.partNo = 3;
+    data.data = randomString(1024);
+    THEN("They are written and read back with the exact size") {
+      size_t used = 0;
+      auto data2 = roundTrip(data, used);
+      REQUIRE(used == data.jsonObjectSize());
+      REQUIRE(data2.type == 12);
+      REQUIRE(data2.routing == router::SINGLE);
+      REQUIRE(data2.from == 1);
+      REQUIRE(data2.dest == 2);
+      REQUIRE(data2.md5 == data.md5);
+      REQUIRE(data2.hardware == "ESP32");
+      REQUIRE(data2.role == data.role);
+      REQUIRE(data2.forced);
+      REQUIRE(data2.noPart == 11);
+      REQUIRE(data2.partNo == 3);
+      REQUIRE(data2.data == data.data);
+
+      auto request = plugin::ota::DataRequest::replyTo(data2, 4);
+      auto request2 = roundTrip(request, used);
+      REQUIRE(used == request.jsonObjectSize());
+      REQUIRE(request2.type == 11);
+      REQUIRE(request2.partNo == 4);
+      REQUIRE(request2.dest == 1);
+
+      auto announce = plugin::ota::Announce();
+      announce.md5 = data.md5;
+      auto announce2 = roundTrip(announce, used);
+      REQUIRE(used == announce.jsonObjectSize());
+      REQUIRE(announce2.type == 10);
+      REQUIRE(announce2.routing == router::BROADCAST);
+      REQUIRE(announce2.md5 == data.md5);
+      REQUIRE(!announce2.forced);
+    }
+  }
+
+  GIVEN("A performance package") {
+    auto pkg = plugin::performance::PerformancePackage();
+    pkg.from = 5;
+    pkg.id = 7;
+    pkg.time = -3;
+    pkg.stability = 900;
+    pkg.freeMemory = 20000;
+    THEN("It is written and read back with the exact size") {
+      size_t used = 0;
+      auto pkg2 = roundTrip(pkg, used);
+      REQUIRE(used == pkg.jsonObjectSize());
+      REQUIRE(pkg2.type == 13);
+      REQUIRE(pkg2.from == 5);
+      REQUIRE(pkg2.id == 7);
+      REQUIRE(pkg2.time == -3);
+      REQUIRE(pkg2.stability == 900);
+      REQUIRE(pkg2.freeMemory == 20000);
+      REQUIRE(pkg2.hardware == pkg.hardware);
+    }
+  }
+}
@@ -0,0 +1,145 @@
+#define CATCH_CONFIG_MAIN
+
+#include "catch2/catch.hpp"
+
+#define ARDUINOJSON_USE_LONG_LONG 1
+#include "ArduinoJson.h"
+#undef ARDUINOJSON_ENABLE_ARDUINO_STRING
+typedef std::string TSTRING;
+
+#include "catch_utils.hpp"
+#include "painlessmesh/pool.hpp"
+#include "painlessmesh/protocol.hpp"
+
+using namespace painlessmesh;
+using namespace painlessmesh::protocol;
+
+template <class T>
+std::string toJson(T pkg) {
+  auto variant = Variant(pkg);
+  std::string str;
+  variant.printTo(str);
+  return str;
+}
+
+SCENARIO("The pool reuses its blocks", "[pool]") {
+  GIVEN("A pool with two blocks") {
+    pool::Pool<2, 64> p;
+    WHEN("Blocks are allocated and released") {
+      auto ptr1 = p.allocate(32);
+      auto ptr2 = p.allocate(64);
+      p.deallocate(ptr1);
+      auto ptr3 = p.allocate(16);
+      THEN("Released blocks are handed out again") {
+        REQUIRE(ptr3 == ptr1);
+        REQUIRE(ptr2 != ptr1);
+        REQUIRE(p.stats.hits == 3);
+        REQUIRE(p.stats.misses == 0);
+        REQUIRE(p.stats.inUse == 2);
+        REQUIRE(p.stats.highWater == 2);
+        REQUIRE(p.stats.largest == 64);
+      }
+      p.deallocate(ptr2);
+      p.deallocate(ptr3);
+      REQUIRE(p.stats.inUse == 0);
+    }
+    WHEN("The pool is exhausted or the request is too large") {
+      auto ptr1 = p.allocate(8);
+      auto ptr2 = p.allocate(8);
+      auto ptr3 = p.allocate(8);
+      auto ptr4 = p.allocate(128);
+      THEN("It falls back to the heap") {
+        REQUIRE(p.stats.hits == 2);
+        REQUIRE(p.stats.misses == 2);
+        REQUIRE(p.stats.highWater == 2);
+        REQUIRE(p.stats.largest == 128);
+      }
+      p.deallocate(ptr3);
+      p.deallocate(ptr4);
+      REQUIRE(p.stats.inUse == 2);
+      p.deallocate(ptr1);
+      p.deallocate(ptr2);
+      REQUIRE(p.stats.inUse == 0);
+    }
+    WHEN("A block is grown beyond the block size") {
+      auto ptr = (char*)p.allocate(16);
+      strcpy(ptr, "hello");
+      ptr = (char*)p.reallocate(ptr, 256);
+      THEN("It is moved to the heap and the block is released") {
+        REQUIRE(std::string(ptr) == "hello");
+        REQUIRE(p.stats.inUse == 0);
+      }
+      p.deallocate(ptr);
+    }
+  }
+}
+
+SCENARIO("Variants do not allocate from the heap in steady state",
+         "[pool][Variant]") {
+  GIVEN("A number of packages that are parsed and serialized") {
+    auto& stats = pool::jsonPool().stats;
+    for (auto i = 0; i < 10; ++i) Variant(toJson(createSingle(100)));
+    auto misses = stats.misses;
+    auto hits = stats.hits;
+    for (auto i = 0; i < 100; ++i) {
+      auto json = toJson(createSingle(100));
+      auto variant = Variant(json);
+      REQUIRE(!variant.error);
+      REQUIRE(variant.to<Single>().msg.length() == 100);
+    }
+    THEN("All documents come from the pool") {
+      REQUIRE(stats.misses == misses);
+      REQUIRE(stats.hits >= hits + 200);
+      REQUIRE(stats.inUse == 0);
+      REQUIRE(stats.highWater >= 1);
+    }
+  }
+}
+
+SCENARIO("The capacity of a json string can be measured before parsing",
+         "[pool][protocol]") {
+  GIVEN("Random packages") {
+    THEN("Parsing them with the measured capacity never runs out of memory") {
+      for (auto i = 0; i < 100; ++i) {
+        std::string json;
+        switch (i % 4) {
+          case 0:
+            json = toJson(createSingle());
+            break;
+          case 1:
+            json = toJson(createBroadcast());
+            break;
+          case 2:
+            json = toJson(createNodeSyncReply());
+            break;
+          default:
+            json = toJson(createNodeSyncRequest());
+        }
+        auto capacity = scan::capacity(json.c_str(), json.length());
+        REQUIRE(capacity > 0);
+        auto variant = Variant(json, capacity);
+        REQUIRE(!variant.error);
+        std::string json2;
+        variant.printTo(json2);
+        REQUIRE(json2 == json);
+      }
+    }
+  }
+
+  GIVEN("Json with all kinds of values") {
+    std::string json =
+        "{\"type\":13, \"custom\":\"va\\\"lue\",\"double\":3.5,"
+        "\"flag\":true,\"nothing\":null,\"list\":[1,[2,3],{\"x\":\"y\"}],"
+        "\"empty\":{},\"text\":\"\"}";
+    THEN("The measured capacity is enough") {
+      auto capacity = scan::capacity(json.c_str(), json.length());
+      auto variant = Variant(json, capacity);
+      REQUIRE(!variant.error);
+      REQUIRE(variant.type() == 13);
+    }
+    THEN("Malformed json measures as zero") {
+      REQUIRE(scan::capacity("{\"type", 6) == 0);
+      REQUIRE(scan::capacity("", 0) == 0);
+    }
+  }
+}
@@ -554,3 +554,101 @@ SCENARIO("Package constructors work as expected", "[protocol]") {
     }
   }
 }
+
+SCENARIO("The header of a package can be read without parsing it",
+         "[Header][protocol]") {
+  GIVEN("Packages of every type printed to a string") {
+    std::list<std::string> jsons;
+    for (auto i = 0; i < 10; ++i) {
+      std::string str;
+      Variant(createSingle()).printTo(str);
+      jsons.push_back(str);
+      str.clear();
+      Variant(createBroadcast()).printTo(str);
+      jsons.push_back(str);
+      str.clear();
+      Variant(createNodeSyncRequest(runif(1, 50))).printTo(str);
+      jsons.push_back(str);
+      str.clear();
+      Variant(createNodeSyncReply(runif(1, 50))).printTo(str);
+      jsons.push_back(str);
+      str.clear();
+      Variant(createTimeSync()).printTo(str);
+      jsons.push_back(str);
+      str.clear();
+      Variant(createTimeDelay()).printTo(str);
+      jsons.push_back(str);
+    }
+    THEN("The header matches the fully parsed package") {
+      for (auto&& json : jsons) {
+        Header header;
+        REQUIRE(peekHeader(json, header));
+        auto variant = Variant(json);
+        REQUIRE(header.type == variant.type());
+        REQUIRE(header.dest == variant.dest());
+        REQUIRE(header.routing == variant.routing());
+      }
+    }
+  }
+
+  GIVEN("A package with whitespace, escaped strings and nested values") {
+    std::string json =
+        "{ \"msg\" : \"a \\\"quoted\\\" }, \\\\\", \"obj\": {\"dest\": 1, "
+        "\"arr\": [1, \"]\", {}]},\n\t\"dest\" :  12345 , \"type\": 9 }";
+    THEN("Only the top level fields are used") {
+      Header header;
+      REQUIRE(peekHeader(json, header));
+      REQUIRE(header.type == SINGLE);
+      REQUIRE(header.dest == 12345);
+      REQUIRE(header.routing == painlessmesh::router::SINGLE);
+    }
+  }
+
+  GIVEN("A broadcast with a sequence number") {
+    auto pkg = createBroadcast();
+    pkg.seq = 4000000000;
+    std::string json;
+    Variant(pkg).printTo(json);
+    THEN("The origin and sequence number are part of the header") {
+      Header header;
+      REQUIRE(peekHeader(json, header));
+      REQUIRE(header.from == pkg.from);
+      REQUIRE(header.seq == pkg.seq);
+      REQUIRE(Variant(json).to<Broadcast>().seq == pkg.seq);
+    }
+    THEN("The sequence number fits, even if the msg is (almost) empty") {
+      for (auto i = 0; i < 5; ++i) {
+        auto pkg2 = createBroadcast(i);
+        pkg2.seq = 10;
+        REQUIRE(Variant(pkg2).to<Broadcast>().seq == 10);
+      }
+    }
+  }
+
+  GIVEN("A package with an explicit routing field") {
+    std::string json = "{\"type\":20,\"routing\":2,\"dest\":0}";
+    THEN("The routing field is used") {
+      Header header;
+      REQUIRE(peekHeader(json, header));
+      REQUIRE(header.type == 20);
+      REQUIRE(header.routing == painlessmesh::router::BROADCAST);
+    }
+  }
+
+  GIVEN("Malformed or incomplete packages") {
+    std::list<std::string> jsons = {"",
+                                    "[1, 2]",
+                                    "{\"dest\": 10}",
+                                    "{\"type\": 9, \"dest\": 10",
+                                    "{\"type\": 9, \"msg\": \"abc}",
+                                    "{\"type\": \"9\", \"dest\": 10}",
+                                    "{\"type\": 9.5, \"dest\": 10}",
+                                    "{\"type\": 9 \"dest\": 10}"};
+    THEN("No header is returned") {
+      for (auto&& json : jsons) {
+        Header header;
+        REQUIRE(!peekHeader(json, header));
+      }
+    }
+  }
+}
@@ -100,3 +100,280 @@ SCENARIO("routePackage should route the package correctly") {
   }
 }
 */
+
+class TestConnection : public layout::Neighbour {
+ public:
+  bool addMessage(TSTRING msg, bool priority = false) {
+    messages.push_back(msg);
+    priorities.push_back(priority);
+    return true;
+  }
+
+  bool addMessage(std::shared_ptr<const TSTRING> msg, bool priority = false) {
+    return addMessage(*msg, priority);
+  }
+
+  std::list<TSTRING> messages;
+  std::list<bool> priorities;
+};
+
+class TestLayout : public layout::Layout<TestConnection> {
+ public:
+  TestLayout(uint32_t id) { nodeId = id; }
+};
+
+SCENARIO("routePackage only parses packages it needs to handle") {
+  GIVEN("A layout with two neighbours and a callback list") {
+    auto lay = TestLayout(1);
+    lay.subs.push_back(std::make_shared<TestConnection>());
+    lay.subs.back()->nodeId = 2;
+    lay.subs.push_back(std::make_shared<TestConnection>());
+    lay.subs.back()->nodeId = 3;
+    lay.subs.back()->subs.push_back(protocol::NodeTree(5, false));
+    auto conn2 = lay.subs.front();
+    auto conn3 = lay.subs.back();
+
+    auto cbl = callback::MeshPackageCallbackList<TestConnection>();
+    size_t handled = 0;
+    cbl.onPackage(protocol::SINGLE,
+                  [&handled](protocol::Variant& variant,
+                             std::shared_ptr<TestConnection>,
+                             uint32_t) { ++handled; });
+    cbl.onPackage(protocol::BROADCAST,
+                  [&handled](protocol::Variant& variant,
+                             std::shared_ptr<TestConnection>,
+                             uint32_t) { ++handled; });
+
+    WHEN("Routing a SINGLE package for another node") {
+      std::string msg = "Some message";
+      auto pkg = protocol::Single(2, 5, msg);
+      TSTRING str;
+      protocol::Variant(pkg).printTo(str);
+      router::routePackage<TestConnection>(lay, conn2, str, cbl, 0);
+      THEN("It is send on unchanged without parsing it") {
+        REQUIRE(conn3->messages.size() == 1);
+        REQUIRE(conn3->messages.front() == str);
+        REQUIRE(conn2->messages.size() == 0);
+        REQUIRE(handled == 0);
+        REQUIRE(lay.forwardedPackages == 1);
+        REQUIRE(lay.parsedPackages == 0);
+      }
+    }
+
+    WHEN("A relay callback handles a SINGLE package for another node") {
+      size_t relayed = 0;
+      lay.relayCallbacks[protocol::SINGLE].push_back(
+          [&relayed](protocol::Variant& variant) {
+            ++relayed;
+            REQUIRE(variant.dest() == 5);
+            return true;
+          });
+      std::string msg = "Some message";
+      auto pkg = protocol::Single(2, 5, msg);
+      TSTRING str;
+      protocol::Variant(pkg).printTo(str);
+      router::routePackage<TestConnection>(lay, conn2, str, cbl, 0);
+      THEN("It is parsed but not send on") {
+        REQUIRE(relayed == 1);
+        REQUIRE(conn3->messages.size() == 0);
+        REQUIRE(handled == 0);
+        REQUIRE(lay.forwardedPackages == 0);
+        REQUIRE(lay.parsedPackages == 1);
+      }
+    }
+
+    WHEN("A relay callback only looks at a SINGLE package for another node") {
+      size_t relayed = 0;
+      lay.relayCallbacks[protocol::SINGLE].push_back(
+          [&relayed](protocol::Variant& variant) {
+            ++relayed;
+            return false;
+          });
+      std::string msg = "Some message";
+      auto pkg = protocol::Single(2, 5, msg);
+      TSTRING str;
+      protocol::Variant(pkg).printTo(str);
+      router::routePackage<TestConnection>(lay, conn2, str, cbl, 0);
+      THEN("It is still send on, and only counted as parsed") {
+        REQUIRE(relayed == 1);
+        REQUIRE(conn3->messages.size() == 1);
+        REQUIRE(conn3->messages.front() == str);
+        REQUIRE(lay.forwardedPackages == 0);
+        REQUIRE(lay.parsedPackages == 1);
+      }
+    }
+
+    WHEN("Routing a SINGLE package for this node") {
+      std::string msg = "Some message";
+      auto pkg = protocol::Single(2, 1, msg);
+      TSTRING str;
+      protocol::Variant(pkg).printTo(str);
+      router::routePackage<TestConnection>(lay, conn2, str, cbl, 0);
+      THEN("It is parsed and handled") {
+        REQUIRE(conn2->messages.size() == 0);
+        REQUIRE(conn3->messages.size() == 0);
+        REQUIRE(handled == 1);
+        REQUIRE(lay.forwardedPackages == 0);
+        REQUIRE(lay.parsedPackages == 1);
+      }
+    }
+
+    WHEN("Routing a BROADCAST package") {
+      std::string msg = "Some message";
+      auto pkg = protocol::Broadcast(2, 0, msg);
+      TSTRING str;
+      protocol::Variant(pkg).printTo(str);
+      router::routePackage<TestConnection>(lay, conn2, str, cbl, 0);
+      THEN("It is parsed, handled and send on to the other neighbours") {
+        REQUIRE(conn2->messages.size() == 0);
+        REQUIRE(conn3->messages.size() == 1);
+        REQUIRE(handled == 1);
+        REQUIRE(lay.forwardedPackages == 0);
+        REQUIRE(lay.parsedPackages == 1);
+      }
+    }
+
+    WHEN("Routing the same BROADCAST package twice") {
+      std::string msg = "Some message";
+      auto pkg = protocol::Broadcast(2, 0, msg);
+      pkg.seq = 7;
+      TSTRING str;
+      protocol::Variant(pkg).printTo(str);
+      router::routePackage<TestConnection>(lay, conn2, str, cbl, 0);
+      router::routePackage<TestConnection>(lay, conn3, str, cbl, 0);
+      THEN("The second one is dropped before parsing it") {
+        REQUIRE(conn2->messages.size() == 0);
+        REQUIRE(conn3->messages.size() == 1);
+        REQUIRE(handled == 1);
+        REQUIRE(lay.parsedPackages == 1);
+        REQUIRE(lay.duplicatePackages == 1);
+      }
+    }
+
+    WHEN("Routing a BROADCAST package that came from this node") {
+      std::string msg = "Some message";
+      auto pkg = protocol::Broadcast(1, 0, msg);
+      pkg.seq = lay.nextBroadcastSeq();
+      std::string binary;
+      protocol::Variant(pkg).printBinaryTo(binary);
+      router::routePackage<TestConnection>(lay, conn2, binary, cbl, 0);
+      THEN("It is dropped") {
+        REQUIRE(conn3->messages.size() == 0);
+        REQUIRE(handled == 0);
+        REQUIRE(lay.duplicatePackages == 1);
+      }
+    }
+
+    WHEN("Routing BROADCAST packages without a sequence number") {
+      std::string msg = "Some message";
+      auto pkg = protocol::Broadcast(2, 0, msg);
+      TSTRING str;
+      protocol::Variant(pkg).printTo(str);
+      router::routePackage<TestConnection>(lay, conn2, str, cbl, 0);
+      router::routePackage<TestConnection>(lay, conn2, str, cbl, 0);
+      THEN("They are all handled") {
+        REQUIRE(handled == 2);
+        REQUIRE(lay.duplicatePackages == 0);
+      }
+    }
+  }
+}
+
+SCENARIO("Packages are send in the format the neighbour supports") {
+  GIVEN("A layout with a binary and a json only neighbour") {
+    auto lay = TestLayout(1);
+    lay.subs.push_back(std::make_shared<TestConnection>());
+    lay.subs.back()->nodeId = 2;
+    lay.subs.back()->features = protocol::BINARY_FORMAT;
+    lay.subs.push_back(std::make_shared<TestConnection>());
+    lay.subs.back()->nodeId = 3;
+    auto conn2 = lay.subs.front();
+    auto conn3 = lay.subs.back();
+    auto cbl = callback::MeshPackageCallbackList<TestConnection>();
+
+    WHEN("Broadcasting a package") {
+      auto pkg = createBroadcast(100);
+      router::broadcast<protocol::Broadcast, TestConnection>(pkg, lay, 0);
+      THEN("The binary neighbour gets a binary frame") {
+        REQUIRE(conn2->messages.size() == 1);
+        auto msg = conn2->messages.front();
+        REQUIRE(binary::isFrame(msg.c_str(), msg.length()));
+        auto variant = protocol::Variant(msg);
+        REQUIRE(variant.to<protocol::Broadcast>().msg == pkg.msg);
+      }
+      THEN("The json neighbour gets json") {
+        REQUIRE(conn3->messages.size() == 1);
+        REQUIRE(conn3->messages.front()[0] == '{');
+      }
+    }
+
+    WHEN("Forwarding a binary SINGLE package to the json neighbour") {
+      auto pkg = createSingle(100);
+      pkg.dest = 3;
+      auto variant = protocol::Variant(pkg);
+      std::string str;
+      variant.printBinaryTo(str);
+      router::routePackage<TestConnection>(lay, conn2, str, cbl, 0);
+      THEN("It is converted to json") {
+        REQUIRE(conn3->messages.size() == 1);
+        auto variant2 = protocol::Variant(conn3->messages.front());
+        REQUIRE(!variant2.error);
+        REQUIRE(variant2.to<protocol::Single>().msg == pkg.msg);
+        REQUIRE(lay.parsedPackages == 0);
+      }
+    }
+  }
+}
+
+SCENARIO("Node syncs are only serialized when the layout changed") {
+  GIVEN("A layout with two neighbours") {
+    auto lay = TestLayout(1);
+    lay.subs.push_back(std::make_shared<TestConnection>());
+    lay.subs.back()->updateSubs(protocol::NodeTree(2, false));
+    lay.subs.push_back(std::make_shared<TestConnection>());
+    lay.subs.back()->updateSubs(protocol::NodeTree(3, false));
+    auto conn2 = lay.subs.front();
+    auto conn3 = lay.subs.back();
+
+    WHEN("Sending the same node sync twice") {
+      router::sendNodeSync(lay, conn2, protocol::NODE_SYNC_REQUEST);
+      auto revision = conn2->syncCache.revision;
+      router::sendNodeSync(lay, conn2, protocol::NODE_SYNC_REQUEST);
+      THEN("The cached message is send again") {
+        REQUIRE(conn2->messages.size() == 2);
+        REQUIRE(conn2->messages.front() == conn2->messages.back());
+        REQUIRE(conn2->syncCache.revision == revision);
+        auto pkg = protocol::Variant(conn2->messages.front())
+                       .to<protocol::NodeSyncRequest>();
+        REQUIRE(pkg.dest == 2);
+        REQUIRE(pkg.subs.size() == 1);
+        REQUIRE(pkg.subs.front().nodeId == 3);
+      }
+    }
+
+    WHEN("The layout changes in between") {
+      router::sendNodeSync(lay, conn2, protocol::NODE_SYNC_REPLY);
+      auto tree = protocol::NodeTree(3, false);
+      tree.subs.push_back(protocol::NodeTree(4, false));
+      conn3->updateSubs(tree);
+      router::sendNodeSync(lay, conn2, protocol::NODE_SYNC_REPLY);
+      THEN("The new layout is send") {
+        REQUIRE(conn2->messages.size() == 2);
+        auto pkg = protocol::Variant(conn2->messages.back())
+                       .to<protocol::NodeSyncReply>();
+        REQUIRE(pkg.type == protocol::NODE_SYNC_REPLY);
+        REQUIRE(layout::size(pkg) == 3);
+      }
+    }
+
+    WHEN("Replying with priority") {
+      conn3->features = protocol::DELTA_SYNC;
+      router::sendNodeSync(lay, conn2, protocol::NODE_SYNC_REPLY, true);
+      router::sendNodeSync(lay, conn3, protocol::NODE_SYNC_REPLY, true);
+      THEN("Only the reply without a delta baseline skips the queue") {
+        REQUIRE(conn2->priorities.back());
+        REQUIRE(!conn3->priorities.back());
+      }
+    }
+  }
+}
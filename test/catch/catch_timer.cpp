@@ -0,0 +1,123 @@
+#define CATCH_CONFIG_MAIN
+
+#include "catch2/catch.hpp"
+
+#include <Arduino.h>
+
+#include "catch_utils.hpp"
+
+#include "painlessmesh/timer.hpp"
+
+using namespace painlessmesh;
+
+SCENARIO("A timer runs its callback when it is due") {
+  GIVEN("A recurring timer") {
+    auto runs = 0;
+    timer::Timer t;
+    t.set(1000, TASK_FOREVER, [&runs]() { ++runs; });
+    REQUIRE(!t.isEnabled());
+    REQUIRE(!t.run(millis()));
+
+    WHEN("It is enabled") {
+      t.enable();
+      auto now = millis();
+      THEN("It runs right away and then every interval") {
+        REQUIRE(t.remaining(now) == 0);
+        REQUIRE(t.run(now));
+        REQUIRE(runs == 1);
+        REQUIRE(!t.run(now));
+        REQUIRE(t.remaining(now) == 1000);
+        REQUIRE(!t.run(now + 999));
+        REQUIRE(t.run(now + 1000));
+        REQUIRE(runs == 2);
+        REQUIRE(t.isEnabled());
+      }
+    }
+
+    WHEN("It is enabled with a delay") {
+      t.enableDelayed();
+      auto now = millis();
+      THEN("It waits for one interval") {
+        REQUIRE(t.remaining(now) > 990);
+        REQUIRE(!t.run(now));
+        REQUIRE(t.run(now + 1000));
+      }
+      t.forceNextIteration();
+      THEN("It can be brought forward") {
+        REQUIRE(t.run(millis()));
+        REQUIRE(runs == 1);
+      }
+    }
+
+    WHEN("It is delayed while disabled") {
+      t.delay(10);
+      THEN("It stays disabled") {
+        REQUIRE(!t.isEnabled());
+        REQUIRE(!t.run(millis() + 100));
+      }
+    }
+
+    WHEN("It is cleared") {
+      t.enable();
+      t.clear();
+      THEN("It does not run anymore") {
+        REQUIRE(!t.run(millis()));
+        REQUIRE(runs == 0);
+      }
+    }
+  }
+
+  GIVEN("A timer that runs once") {
+    auto runs = 0;
+    timer::Timer t;
+    t.set(100, TASK_ONCE, [&runs]() { ++runs; });
+    t.restartDelayed();
+    auto now = millis();
+    THEN("It is disabled after running") {
+      REQUIRE(t.run(now + 100));
+      REQUIRE(!t.isEnabled());
+      REQUIRE(!t.run(now + 200));
+      REQUIRE(runs == 1);
+    }
+  }
+
+  GIVEN("A timer that clears itself") {
+    timer::Timer t;
+    auto token = std::make_shared<int>(1);
+    t.set(100, TASK_FOREVER, [&t, token]() {
+      t.clear();
+      REQUIRE(*token == 1);
+    });
+    t.enable();
+    THEN("The callback can finish safely") {
+      REQUIRE(t.run(millis()));
+      REQUIRE(!t.isEnabled());
+      REQUIRE(token.use_count() == 1);
+    }
+  }
+}
+
+SCENARIO("A timer wakes up the task that runs it") {
+  GIVEN("A timer attached to a sleeping task") {
+    Scheduler scheduler;
+    auto runs = 0;
+    Task task(TASK_MINUTE, TASK_FOREVER, [&runs]() { ++runs; });
+    scheduler.addTask(task);
+    task.enableDelayed();
+    timer::Timer t;
+    t.set(1000, TASK_FOREVER, []() {});
+    t.attach(&task);
+    scheduler.execute();
+    REQUIRE(runs == 0);
+    WHEN("The timer is brought forward") {
+      t.forceNextIteration();
+      scheduler.execute();
+      THEN("The task runs") { REQUIRE(runs == 1); }
+    }
+    WHEN("The timer is delayed while disabled") {
+      t.delay(10);
+      scheduler.execute();
+      THEN("The task keeps sleeping") { REQUIRE(runs == 0); }
+    }
+  }
+}